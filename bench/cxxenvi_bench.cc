@@ -0,0 +1,456 @@
+/*
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/* Read/write throughput benchmarks for cxxenvi.hh.
+ *
+ * Every operation is run for all (input, output) data type pairs, image
+ * sizes and band counts, on files and on in-memory string streams. The
+ * results are printed as CSV on standard output, one row per case, with
+ * the throughput in samples/s and GB/s. The bytes are those of the ENVI
+ * data read or written (so, of the input type when reading and of the
+ * output type when writing), or of the header for the header parse.
+ */
+
+#include "cxxenvi.hh"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+/*
+ * Configuration
+ */
+
+struct Config
+{
+	double min_time; // minimum time spent on each case, in seconds
+	std::string filter; // only run cases whose name contains this
+	std::string dir; // where to put the data files
+	std::vector<std::pair<size_t, size_t>> sizes; // lines x samples
+	std::vector<size_t> bands;
+
+	Config() :
+		min_time(0.05),
+		filter(),
+		dir("."),
+		sizes{ {256, 256}, {1024, 1024} },
+		bands{ 1, 4 }
+	{}
+};
+
+void usage(const char *argv0)
+{
+	std::cerr << "usage: " << argv0 << " [options]\n"
+		"  --min-time S      run each case for at least S seconds (default 0.05)\n"
+		"  --filter STR      only run the cases whose name contains STR\n"
+		"                    (names are op/backend/input/output)\n"
+		"  --dir PATH        directory for the data files (default .)\n"
+		"  --sizes LxS,...   image sizes (default 256x256,1024x1024)\n"
+		"  --bands N,...     band counts (default 1,4)\n"
+		"  --quick           same as --min-time 0.01 --sizes 256x256 --bands 2\n";
+}
+
+// Split a comma-separated list
+std::vector<std::string> split(std::string const& str)
+{
+	std::vector<std::string> ret;
+	std::stringstream ss(str);
+	std::string item;
+	while (std::getline(ss, item, ','))
+		ret.push_back(item);
+	return ret;
+}
+
+Config parse_args(int argc, char *argv[])
+{
+	Config cfg;
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg(argv[i]);
+		const bool has_value = i + 1 < argc;
+		if (arg == "--quick") {
+			cfg.min_time = 0.01;
+			cfg.sizes.assign(1, std::make_pair(size_t(256), size_t(256)));
+			cfg.bands.assign(1, 2);
+		} else if (arg == "--min-time" && has_value) {
+			cfg.min_time = std::atof(argv[++i]);
+		} else if (arg == "--filter" && has_value) {
+			cfg.filter = argv[++i];
+		} else if (arg == "--dir" && has_value) {
+			cfg.dir = argv[++i];
+		} else if (arg == "--sizes" && has_value) {
+			cfg.sizes.clear();
+			for (auto const& s : split(argv[++i])) {
+				size_t lines = 0, samples = 0;
+				if (std::sscanf(s.c_str(), "%zux%zu", &lines, &samples) != 2 || !lines || !samples)
+					throw std::invalid_argument("invalid size " + s);
+				cfg.sizes.push_back(std::make_pair(lines, samples));
+			}
+		} else if (arg == "--bands" && has_value) {
+			cfg.bands.clear();
+			for (auto const& s : split(argv[++i])) {
+				const size_t b = std::strtoul(s.c_str(), nullptr, 10);
+				if (!b)
+					throw std::invalid_argument("invalid band count " + s);
+				cfg.bands.push_back(b);
+			}
+		} else {
+			usage(argv[0]);
+			std::exit(arg == "-h" || arg == "--help" ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	return cfg;
+}
+
+/*
+ * Data types
+ */
+
+template<typename T> const char* type_name();
+template<> const char* type_name<int8_t>() { return "int8"; }
+template<> const char* type_name<int16_t>() { return "int16"; }
+template<> const char* type_name<int32_t>() { return "int32"; }
+template<> const char* type_name<float>() { return "float32"; }
+template<> const char* type_name<double>() { return "float64"; }
+template<> const char* type_name<uint16_t>() { return "uint16"; }
+template<> const char* type_name<uint32_t>() { return "uint32"; }
+template<> const char* type_name<int64_t>() { return "int64"; }
+template<> const char* type_name<uint64_t>() { return "uint64"; }
+#if CXXENVI_COMPLEX
+template<> const char* type_name<std::complex<float>>() { return "complex64"; }
+template<> const char* type_name<std::complex<double>>() { return "complex128"; }
+#endif
+
+template<typename ...T>
+struct Types
+{};
+
+typedef Types<int8_t, int16_t, int32_t, float, double,
+	uint16_t, uint32_t, int64_t, uint64_t
+#if CXXENVI_COMPLEX
+	, std::complex<float>, std::complex<double>
+#endif
+	> AllTypes;
+
+// Sample data: small values, representable in all types
+template<typename T>
+std::vector<T> make_data(size_t count)
+{
+	std::vector<T> data(count);
+	for (size_t i = 0; i < count; ++i)
+		data[i] = T((i*7) % 101);
+	return data;
+}
+
+/*
+ * Timing and reporting
+ */
+
+const char *simd_name(ENVI::SimdLevel level)
+{
+	switch (level) {
+	case ENVI::SIMD_SSE2:   return "sse2";
+	case ENVI::SIMD_SSE41:  return "sse4.1";
+	case ENVI::SIMD_AVX2:   return "avx2";
+	case ENVI::SIMD_AVX512: return "avx512";
+	default:                return "scalar";
+	}
+}
+
+// A benchmark case: its parameters, and what one run of it processes
+struct Case
+{
+	const char *op;
+	const char *backend;
+	const char *input;
+	const char *output;
+	size_t lines, samples, bands;
+	size_t count; // samples processed by a run
+	size_t bytes; // bytes processed by a run
+
+	std::string name() const
+	{ return std::string(op) + "/" + backend + "/" + input + "/" + output; }
+};
+
+class Bench
+{
+	Config cfg;
+
+public:
+	Bench(Config const& _cfg) : cfg(_cfg)
+	{}
+
+	Config const& config() const
+	{ return cfg; }
+
+	static void print_header()
+	{
+		std::printf("op,backend,input,output,lines,samples,bands,simd,"
+			"iterations,seconds,samples_per_s,gb_per_s\n");
+	}
+
+	// Run op repeatedly for at least the minimum time, and report the
+	// average time per run
+	template<typename Op>
+	void run(Case const& c, Op&& op)
+	{
+		if (!cfg.filter.empty() && c.name().find(cfg.filter) == std::string::npos)
+			return;
+
+		typedef std::chrono::steady_clock clock;
+		op(); // warm up caches and buffers
+		size_t iterations = 0;
+		double elapsed = 0;
+		const clock::time_point start = clock::now();
+		do {
+			op();
+			++iterations;
+			elapsed = std::chrono::duration<double>(clock::now() - start).count();
+		} while (elapsed < cfg.min_time);
+
+		const double seconds = elapsed/iterations;
+		std::printf("%s,%s,%s,%s,%zu,%zu,%zu,%s,%zu,%.9g,%.6g,%.6g\n",
+			c.op, c.backend, c.input, c.output,
+			c.lines, c.samples, c.bands, simd_name(ENVI::simd_level()),
+			iterations, seconds, c.count/seconds, c.bytes/seconds/1e9);
+		std::fflush(stdout);
+	}
+};
+
+/*
+ * Benchmarks
+ */
+
+// An ENVI file of the given input type, on disk and in memory
+template<typename In>
+struct Dataset
+{
+	size_t lines, samples, bands, pixels;
+	std::vector<In> values; // one band worth of data
+	std::string fname;
+	std::string raw, hdr; // file contents
+
+	Dataset(std::string const& dir, size_t _lines, size_t _samples, size_t _bands) :
+		lines(_lines), samples(_samples), bands(_bands), pixels(lines*samples),
+		values(make_data<In>(pixels)),
+		fname(dir + "/cxxenvi_bench_" + type_name<In>() + ".raw")
+	{
+		{
+			auto out = ENVI::create<In>(fname, "benchmark", lines, samples);
+			for (size_t b = 0; b < bands; ++b)
+				out->add_channel("band " + std::to_string(b), values);
+		}
+		raw = slurp(fname);
+		hdr = slurp(hdr_name());
+	}
+
+	~Dataset()
+	{
+		std::remove(fname.c_str());
+		std::remove(hdr_name().c_str());
+	}
+
+	std::string hdr_name() const
+	{ return fname.substr(0, fname.size() - 4) + ".hdr"; }
+
+	static std::string slurp(std::string const& name)
+	{
+		std::ifstream f(name, std::ios::binary);
+		std::stringstream ss;
+		ss << f.rdbuf();
+		return ss.str();
+	}
+};
+
+template<typename In, typename Out>
+void bench_pair(Bench& bench, Dataset<In> const& d)
+{
+	// e.g. complex to real: not a valid conversion
+	if (!std::is_assignable<Out&, In const&>::value)
+		return;
+
+	const size_t count = d.pixels*d.bands;
+	Case c = { "", "", type_name<In>(), type_name<Out>(),
+		d.lines, d.samples, d.bands, count, 0 };
+	const std::string out_name = d.fname.substr(0, d.fname.size() - 4) + "_out.raw";
+
+	// Writing
+	c.bytes = count*sizeof(Out);
+
+	std::vector<In> padded;
+	const size_t stride = d.samples + 16;
+	padded.resize(d.lines*stride);
+	for (size_t l = 0; l < d.lines; ++l)
+		std::copy(d.values.begin() + l*d.samples, d.values.begin() + (l+1)*d.samples,
+			padded.begin() + l*stride);
+
+	std::vector<In> const& values = d.values;
+	const size_t samples = d.samples;
+	auto value_at = [&values, samples](size_t row, size_t col) -> In
+	{ return values[row*samples + col]; };
+
+	c.op = "add_channel";
+	c.backend = "file";
+	bench.run(c, [&]() {
+		auto out = ENVI::create<Out>(out_name, "benchmark", d.lines, d.samples);
+		for (size_t b = 0; b < d.bands; ++b)
+			out->add_channel("band", d.values);
+	});
+	c.backend = "memory";
+	bench.run(c, [&]() {
+		auto out = ENVI::create<Out>(std::stringstream(), std::stringstream(),
+			"benchmark", d.lines, d.samples);
+		for (size_t b = 0; b < d.bands; ++b)
+			out->add_channel("band", d.values);
+	});
+
+	c.op = "add_channel_rect";
+	c.backend = "file";
+	bench.run(c, [&]() {
+		auto out = ENVI::create<Out>(out_name, "benchmark", d.lines, d.samples);
+		for (size_t b = 0; b < d.bands; ++b)
+			out->add_channel_rect("band", padded, stride);
+	});
+	c.backend = "memory";
+	bench.run(c, [&]() {
+		auto out = ENVI::create<Out>(std::stringstream(), std::stringstream(),
+			"benchmark", d.lines, d.samples);
+		for (size_t b = 0; b < d.bands; ++b)
+			out->add_channel_rect("band", padded, stride);
+	});
+
+	c.op = "add_channel_func";
+	c.backend = "file";
+	bench.run(c, [&]() {
+		auto out = ENVI::create<Out>(out_name, "benchmark", d.lines, d.samples);
+		for (size_t b = 0; b < d.bands; ++b)
+			out->add_channel_func("band", value_at);
+	});
+	c.backend = "memory";
+	bench.run(c, [&]() {
+		auto out = ENVI::create<Out>(std::stringstream(), std::stringstream(),
+			"benchmark", d.lines, d.samples);
+		for (size_t b = 0; b < d.bands; ++b)
+			out->add_channel_func("band", value_at);
+	});
+
+	std::remove(out_name.c_str());
+	std::remove((out_name.substr(0, out_name.size() - 4) + ".hdr").c_str());
+
+	// Reading
+	c.bytes = count*sizeof(In);
+	std::vector<Out> buffer(d.pixels);
+
+	c.op = "get_channel";
+	c.backend = "file";
+	{
+		auto in = ENVI::ropen(d.fname);
+		bench.run(c, [&]() {
+			for (size_t b = 0; b < d.bands; ++b)
+				in->get_channel(b, buffer.data());
+		});
+	}
+	c.backend = "memory";
+	{
+		auto in = ENVI::ropen(std::stringstream(d.raw), std::stringstream(d.hdr));
+		bench.run(c, [&]() {
+			for (size_t b = 0; b < d.bands; ++b)
+				in->get_channel(b, buffer.data());
+		});
+	}
+
+	// undump() loads a single channel, header parse included
+	c.op = "undump";
+	c.backend = "file";
+	c.count = d.pixels;
+	c.bytes = d.pixels*sizeof(In);
+	bench.run(c, [&]() {
+		size_t lines, samples;
+		std::vector<Out> data;
+		ENVI::undump(d.fname, 0, lines, samples, data);
+	});
+}
+
+template<typename In>
+void bench_header(Bench& bench, Dataset<In> const& d)
+{
+	Case c = { "header_parse", "", type_name<In>(), "-",
+		d.lines, d.samples, d.bands, 0, d.hdr.size() };
+
+	c.backend = "file";
+	bench.run(c, [&]() { ENVI::ropen(d.fname); });
+	// with no data: only the header is read
+	c.backend = "memory";
+	bench.run(c, [&]() { ENVI::ropen(std::stringstream(), std::stringstream(d.hdr)); });
+}
+
+template<typename In, typename List>
+struct ForOutputs;
+
+template<typename In>
+struct ForOutputs<In, Types<>>
+{
+	static void run(Bench&, Dataset<In> const&)
+	{}
+};
+
+template<typename In, typename Out, typename ...Rest>
+struct ForOutputs<In, Types<Out, Rest...>>
+{
+	static void run(Bench& bench, Dataset<In> const& d)
+	{
+		bench_pair<In, Out>(bench, d);
+		ForOutputs<In, Types<Rest...>>::run(bench, d);
+	}
+};
+
+template<typename List>
+struct ForInputs;
+
+template<>
+struct ForInputs<Types<>>
+{
+	static void run(Bench&, size_t, size_t, size_t)
+	{}
+};
+
+template<typename In, typename ...Rest>
+struct ForInputs<Types<In, Rest...>>
+{
+	static void run(Bench& bench, size_t lines, size_t samples, size_t bands)
+	{
+		{
+			const Dataset<In> d(bench.config().dir, lines, samples, bands);
+			bench_header(bench, d);
+			ForOutputs<In, AllTypes>::run(bench, d);
+		}
+		ForInputs<Types<Rest...>>::run(bench, lines, samples, bands);
+	}
+};
+
+}
+
+int main(int argc, char *argv[])
+{
+	try {
+		Bench bench(parse_args(argc, argv));
+
+		Bench::print_header();
+		for (auto const& size : bench.config().sizes)
+			for (size_t bands : bench.config().bands)
+				ForInputs<AllTypes>::run(bench, size.first, size.second, bands);
+	} catch (std::exception const& e) {
+		std::cerr << "error: " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,17 @@
+/*
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/* Compiled companion of cxxenvi.hh: the kernel entry points and the
+ * template instances for all data types. Build it with the same
+ * configuration macros (CXXENVI_COMPLEX, CXXENVI_SIMD, ...) as the code
+ * using the library, which must define CXXENVI_LIBRARY too.
+ */
+
+#undef CXXENVI_LIBRARY
+#define CXXENVI_LIBRARY 1
+#define CXXENVI_IMPLEMENTATION
+
+#include "cxxenvi.hh"
@@ -11,8 +11,6 @@
  * 	support reading other raw formats (ESRI, or what Gdal calls 'GenBin'),
  * 	they work in the same way, just the header is marginally different.
  * TODO:
- * 	support arbitrary streams for input/ouput (WIP)
- * TODO:
  * 	support other raw interleave formats (BIL and BIP)
  * TODO:
  * 	while ENVI doesn't seem to have builtin support for compressed files,
@@ -48,6 +46,97 @@
 #define CXXENVI_DEBUG 0
 #endif
 
+// To collect I/O statistics (bytes and calls, time spent on I/O, conversion
+// and headers), define CXXENVI_PROFILE to any non-zero value before including
+// this header. By default we don't, and the statistics are all zero
+#ifndef CXXENVI_PROFILE
+#define CXXENVI_PROFILE 0
+#endif
+
+// Errors are reported by throwing exceptions, if these are enabled. The
+// try_*() functions report them as a Status instead; when building without
+// exceptions (e.g. -fno-exceptions), ENVI::last_error() gives the error of
+// the last call of the other functions.
+// Define CXXENVI_EXCEPTIONS to 0 or 1 before including this header to
+// override the detection
+#ifndef CXXENVI_EXCEPTIONS
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+#define CXXENVI_EXCEPTIONS 1
+#else
+#define CXXENVI_EXCEPTIONS 0
+#endif
+#endif
+
+// Band math spreads its evaluation over multiple threads. Define
+// CXXENVI_THREADS to 0 before including this header to do everything on
+// the calling thread (and not need to link a thread library)
+#ifndef CXXENVI_THREADS
+#define CXXENVI_THREADS 1
+#endif
+
+// Summed-area tables are queried by mapping them in memory where the
+// platform has mmap(). Define CXXENVI_MMAP to 0 before including this
+// header to load them instead
+#ifndef CXXENVI_MMAP
+#if defined(__unix__) || defined(__APPLE__)
+#define CXXENVI_MMAP 1
+#else
+#define CXXENVI_MMAP 0
+#endif
+#endif
+
+// The sample conversion kernels use SSE2 when the compiler targets it.
+// Define CXXENVI_SIMD to 0 before including this header to force the
+// portable (scalar) kernels
+#ifndef CXXENVI_SIMD
+#define CXXENVI_SIMD 1
+#endif
+
+#if CXXENVI_SIMD && (defined(__SSE2__) || defined(_M_X64))
+#define CXXENVI_SSE2 1
+#else
+#define CXXENVI_SSE2 0
+#endif
+
+// With GCC and Clang on x86, the kernels are additionally compiled for
+// SSE4.1, AVX2 and AVX-512, and the best version for the running CPU is
+// picked at runtime. Define CXXENVI_DISPATCH to 0 before including this
+// header to only use the instruction set targeted by the compiler
+#ifndef CXXENVI_DISPATCH
+#if CXXENVI_SSE2 && (defined(__GNUC__) || defined(__clang__)) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define CXXENVI_DISPATCH 1
+#else
+#define CXXENVI_DISPATCH 0
+#endif
+#endif
+
+#if CXXENVI_DISPATCH
+#define CXXENVI_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+// By default everything is defined in this header. Define CXXENVI_LIBRARY
+// to any non-zero value before including it to use instead the kernels and
+// template instances precompiled in cxxenvi.cc, which must then be built
+// with the same configuration and linked in
+#ifndef CXXENVI_LIBRARY
+#define CXXENVI_LIBRARY 0
+#endif
+
+// cxxenvi.cc defines CXXENVI_IMPLEMENTATION to get the out-of-line
+// definitions, which are otherwise inline (header-only) or only declared
+#if CXXENVI_LIBRARY && defined(CXXENVI_IMPLEMENTATION)
+#define CXXENVI_DEFINITIONS 1
+#define CXXENVI_INLINE
+#define CXXENVI_EXTERN
+#elif CXXENVI_LIBRARY
+#define CXXENVI_DEFINITIONS 0
+#define CXXENVI_EXTERN extern
+#else
+#define CXXENVI_DEFINITIONS 1
+#define CXXENVI_INLINE inline
+#endif
+
 /*
  * Standard includes
  */
@@ -61,11 +150,37 @@
 #include <sstream>
 #include <memory>
 #include <algorithm>
+#include <type_traits>
+#include <cmath>
+#include <limits>
+#include <atomic>
+#include <cstring>
+#include <chrono>
+#include <cctype>
+#include <cstdio>
+
+#if CXXENVI_THREADS
+#include <thread>
+#include <exception>
+#endif
+
+#if CXXENVI_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #if CXXENVI_COMPLEX
 #include <complex>
 #endif
 
+#if CXXENVI_DISPATCH
+#include <immintrin.h>
+#elif CXXENVI_SSE2
+#include <emmintrin.h>
+#endif
+
 #if CXXENVI_DEBUG
 #include <iostream>
 #endif
@@ -119,10 +234,10 @@ public:
 	 * the input stream?
 	 */
 	static inline std::string::size_type
-	getline(std::ifstream& stream, std::string &str)
+	getline(std::istream& stream, std::string &str)
 	{
 		std::getline(stream, str);
-		if(str.back() == '\r')
+		if(!str.empty() && str.back() == '\r')
 		{
 			str = str.substr(0, str.length() - 1);
 		}
@@ -253,6 +368,17 @@ public:
 		       );
 	}
 
+	// size in bytes of a sample of the given type
+	constexpr static inline size_t
+	type_size(DataTypeEnum type)
+	{
+		return (type == CHAR) ? 1 :
+			(type == INT16 || type == UINT16) ? 2 :
+			(type == INT32 || type == UINT32 || type == FP32) ? 4 :
+			(type == FP64C) ? 16 :
+			8;
+	}
+
 	// Forward declaration of a template structure used to convert
 	// typenames into the corresponding DataTypeEnum:
 	// Example usage: ENVI::TypeCode<float>()
@@ -265,14 +391,643 @@ public:
 	// To get: int64_t
 	template<DataTypeEnum val> struct CodeType;
 
+#if CXXENVI_COMPLEX
+	// Complex data can be loaded into real-valued buffers by reducing
+	// each sample to its magnitude |z|, power |z|^2, phase arg(z)
+	// or power in decibel 10·log10(|z|^2)
+	enum ComplexReduction
+	{
+		MAGNITUDE,
+		POWER,
+		PHASE,
+		POWER_DB
+	};
+#endif
+
+	// Policy for conversions from floating-point to integer data,
+	// and between integer types of different ranges
+	enum ConversionPolicy
+	{
+		// C++ semantics: round toward zero, undefined results for
+		// values out of the range of the target type
+		TRUNCATE = 0,
+		// round to nearest (ties to even), undefined results for
+		// values out of range
+		ROUND = 1,
+		// round toward zero, clamping values out of range to the
+		// closest representable value (and NaN to zero)
+		SATURATE = 2,
+		// round to nearest and clamp
+		SATURATE_ROUND = SATURATE | ROUND
+	};
+
+	// Sample conversion kernels, working on contiguous runs of samples.
+	// Defined after the data types
+	struct Kernels;
+
+	// Instruction set levels the kernels are available for
+	enum SimdLevel
+	{
+		SIMD_SCALAR,
+		SIMD_SSE2,
+		SIMD_SSE41,
+		SIMD_AVX2,   // AVX2 + FMA
+		SIMD_AVX512  // AVX-512 F + BW
+	};
+
+	// The best instruction set level supported by both the build and
+	// the running CPU
+	static inline SimdLevel supported_simd_level()
+	{
+		static const SimdLevel level = detect_simd_level();
+		return level;
+	}
+
+	// The instruction set level currently used by the kernels
+	static inline SimdLevel simd_level()
+	{
+		return static_cast<SimdLevel>(simd_level_state().load(std::memory_order_relaxed));
+	}
+
+	// Select the instruction set level used by the kernels (e.g. to compare
+	// the code paths). The level is capped to the supported one, and the
+	// level actually selected is returned
+	static inline SimdLevel set_simd_level(SimdLevel level)
+	{
+		level = std::min(level, supported_simd_level());
+		simd_level_state().store(level, std::memory_order_relaxed);
+		return level;
+	}
+
+	// Raw data is read and converted in chunks of (about) this many bytes
+	constexpr static inline size_t chunk_bytes()
+	{ return 256*1024; }
+
+	// Number of samples of type T in a chunk
+	template<typename T>
+	constexpr static inline size_t chunk_samples()
+	{ return chunk_bytes()/sizeof(T); }
+
+	// I/O statistics, of an Input or Output or process-wide,
+	// collected if CXXENVI_PROFILE is enabled
+	struct IOStats
+	{
+		uint64_t bytes_read;
+		uint64_t bytes_written;
+		uint64_t reads; // read calls on the data stream
+		uint64_t writes; // write calls on the data stream
+		uint64_t seeks;
+		uint64_t io_ns; // time spent reading, writing and seeking data
+		uint64_t convert_ns; // time spent converting, swapping, reducing, ...
+		uint64_t header_ns; // time spent parsing or writing the header
+
+		IOStats() :
+			bytes_read(0), bytes_written(0),
+			reads(0), writes(0), seeks(0),
+			io_ns(0), convert_ns(0), header_ns(0)
+		{}
+	};
+
+	// Statistics summed over all inputs and outputs
+	static inline IOStats global_stats()
+	{
+		IOStats ret;
+#if CXXENVI_PROFILE
+		std::atomic<uint64_t> const* g = Profiler::global();
+		ret.bytes_read = g[Profiler::BYTES_READ];
+		ret.bytes_written = g[Profiler::BYTES_WRITTEN];
+		ret.reads = g[Profiler::READS];
+		ret.writes = g[Profiler::WRITES];
+		ret.seeks = g[Profiler::SEEKS];
+		ret.io_ns = g[Profiler::IO_NS];
+		ret.convert_ns = g[Profiler::CONVERT_NS];
+		ret.header_ns = g[Profiler::HEADER_NS];
+#endif
+		return ret;
+	}
+
+	static inline void reset_global_stats()
+	{
+#if CXXENVI_PROFILE
+		std::atomic<uint64_t>* g = Profiler::global();
+		for (size_t i = 0; i < Profiler::NUM_COUNTERS; ++i)
+			g[i] = 0;
+#endif
+	}
+
+	// Progress of a channel read or write, reported after each chunk
+	struct Progress
+	{
+		uint64_t bytes_done;
+		uint64_t bytes_total;
+		double bytes_per_second; // average since the start of the operation
+	};
+
+	typedef std::function<void(Progress const&)> ProgressCallback;
+
+	// Cancellation token: operations monitoring it stop at the next chunk
+	// (throwing OperationCancelled) once it has been cancelled, possibly
+	// from a different thread
+	class CancelToken
+	{
+		std::atomic<bool> flag;
+	public:
+		CancelToken() : flag(false)
+		{}
+
+		void cancel()
+		{ flag.store(true, std::memory_order_relaxed); }
+
+		void reset()
+		{ flag.store(false, std::memory_order_relaxed); }
+
+		bool cancelled() const
+		{ return flag.load(std::memory_order_relaxed); }
+	};
+
+	class OperationCancelled : public std::runtime_error
+	{
+	public:
+		OperationCancelled() : std::runtime_error("operation cancelled")
+		{}
+	};
+
+	// Error codes returned by the try_*() functions
+	enum ErrorCode {
+		STATUS_OK,
+		STATUS_OPEN_FAILED, // the data or header file could not be opened
+		STATUS_INVALID_HEADER, // malformed or inconsistent header
+		STATUS_UNSUPPORTED, // unsupported data type, interleave, byte order
+		STATUS_NO_CHANNEL, // no such channel
+		STATUS_INVALID_ARGUMENT,
+		STATUS_READ_FAILED, // read error, or fewer bytes than expected
+		STATUS_WRITE_FAILED,
+		STATUS_CANCELLED,
+		STATUS_OUT_OF_MEMORY,
+		STATUS_FAILED // anything else
+	};
+
+	// Outcome of a try_*() function
+	struct Status
+	{
+		ErrorCode code;
+		std::string message;
+
+		Status() : code(STATUS_OK), message()
+		{}
+
+		Status(ErrorCode _code, std::string const& _message) :
+			code(_code), message(_message)
+		{}
+
+		bool ok() const
+		{ return code == STATUS_OK; }
+
+		explicit operator bool() const
+		{ return ok(); }
+	};
+
+	// Outcome of a try_*() function with a result, only valid if ok()
+	template<typename T>
+	struct Result
+	{
+		Status status;
+		T value;
+
+		Result() : status(), value()
+		{}
+
+		bool ok() const
+		{ return status.ok(); }
+
+		explicit operator bool() const
+		{ return ok(); }
+	};
+
+	// The error of the last call on this thread, when it was not thrown
+	// (i.e. when building without exceptions). Each call starts afresh,
+	// so an error only stops the call that raised it
+	static inline Status last_error()
+	{ return sticky_error(); }
+
+	// A non-owning view of a single-band image in external memory
+	// (a NumPy array, an OpenCV Mat, an Eigen matrix, a staging buffer,
+	// ...). Strides are in elements: line_stride between the starts of
+	// consecutive lines (the pitch), sample_stride between consecutive
+	// samples of a line (1 for planar data, the number of bands for one
+	// band of pixel-interleaved data)
+	template<typename T>
+	struct ImageView
+	{
+		T* data;
+		size_t lines;
+		size_t samples;
+		size_t line_stride;
+		size_t sample_stride;
+
+		// contiguous lines
+		ImageView(T* _data, size_t _lines, size_t _samples) :
+			data(_data), lines(_lines), samples(_samples),
+			line_stride(_samples), sample_stride(1)
+		{}
+
+		ImageView(T* _data, size_t _lines, size_t _samples,
+			size_t _line_stride, size_t _sample_stride = 1) :
+			data(_data), lines(_lines), samples(_samples),
+			line_stride(_line_stride), sample_stride(_sample_stride)
+		{}
+
+		// View with strides given in bytes (e.g. NumPy strides, OpenCV steps),
+		// which must be multiples of the element size
+		static ImageView with_byte_strides(T* data, size_t lines, size_t samples,
+			size_t line_bytes, size_t sample_bytes = sizeof(T))
+		{
+			if (line_bytes % sizeof(T) || sample_bytes % sizeof(T))
+				raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("strides not multiple of the element size"));
+			return ImageView(data, lines, samples, line_bytes/sizeof(T), sample_bytes/sizeof(T));
+		}
+
+		bool contiguous() const
+		{ return sample_stride == 1 && (line_stride == samples || lines < 2); }
+
+		T* line(size_t l) const
+		{ return data + l*line_stride; }
+
+		T& operator()(size_t l, size_t s) const
+		{ return data[l*line_stride + s*sample_stride]; }
+	};
+
+	// A rectangle of lines x samples pixels, from (line, sample)
+	struct Window
+	{
+		size_t line;
+		size_t sample;
+		size_t lines;
+		size_t samples;
+
+		bool empty() const
+		{ return !lines || !samples; }
+	};
+
+	// The parsed 'map info' of a header, defined after the kernels
+	struct GeoTransform;
+
 private:
 
+	// Checksums of chunks of the channels of a file, defined after the
+	// kernels
+	class Checksums;
+
+	// Reports the progress of an operation and checks for its
+	// cancellation, a chunk at a time
+	class Monitor
+	{
+		ProgressCallback callback;
+		std::shared_ptr<CancelToken const> token;
+		Progress progress;
+		std::chrono::steady_clock::time_point start;
+
+	public:
+		Monitor() : callback(), token(), progress(), start()
+		{}
+
+		void set_callback(ProgressCallback const& cb)
+		{ callback = cb; }
+
+		void set_token(std::shared_ptr<CancelToken const> const& tok)
+		{ token = tok; }
+
+		bool cancellable() const
+		{ return token != nullptr; }
+
+		void check() const
+		{
+			if (token && token->cancelled())
+				raise(STATUS_CANCELLED, OperationCancelled());
+		}
+
+		// Start an operation on the given number of bytes
+		void begin(uint64_t total)
+		{
+			check();
+			progress.bytes_done = 0;
+			progress.bytes_total = total;
+			progress.bytes_per_second = 0;
+			if (callback)
+				start = std::chrono::steady_clock::now();
+		}
+
+		// Account for a chunk of the operation being done
+		void advance(uint64_t bytes)
+		{
+			progress.bytes_done += bytes;
+			if (callback) {
+				const double elapsed = std::chrono::duration<double>(
+					std::chrono::steady_clock::now() - start).count();
+				progress.bytes_per_second = elapsed > 0 ? progress.bytes_done/elapsed : 0;
+				callback(progress);
+			}
+			check();
+		}
+	};
+
+	// The first error not thrown (or about to be) on this thread
+	static inline Status& sticky_error()
+	{
+		static thread_local Status error;
+		return error;
+	}
+
+	// Report an error: record it, and throw the given exception if
+	// exceptions are enabled. Otherwise, callers must return early
+	template<typename Exception>
+	static inline void raise(ErrorCode code, Exception const& e)
+	{
+		Status& error = sticky_error();
+		if (error.ok())
+			error = Status(code, e.what());
+#if CXXENVI_EXCEPTIONS
+		throw e;
+#endif
+	}
+
+	// Marks a call of the public API: the outermost one on a thread
+	// clears the error left by the previous call, which would otherwise
+	// stop this one too when exceptions are disabled. Nested calls keep
+	// the error of the call they are part of
+	class CallScope
+	{
+		static int& depth()
+		{
+			static thread_local int count = 0;
+			return count;
+		}
+
+	public:
+		CallScope()
+		{
+			if (!depth()++)
+				sticky_error() = Status();
+		}
+
+		~CallScope()
+		{ --depth(); }
+
+		// Is a call in progress on this thread?
+		static bool active()
+		{ return depth() > 0; }
+
+		CallScope(CallScope const&) = delete;
+		CallScope& operator=(CallScope const&) = delete;
+	};
+
+	// Has an error been raised but not thrown? Loops use it to stop
+	// early when exceptions are disabled
+	static inline bool failed()
+	{
+#if CXXENVI_EXCEPTIONS
+		return false;
+#else
+		return !sticky_error().ok();
+#endif
+	}
+
+	// Run func, returning the first error it raised (or that was thrown
+	// through it) as a Status, with fallback as the code of errors not
+	// raised by us (e.g. I/O errors thrown by the streams)
+	template<typename Func>
+	static Status capture(ErrorCode fallback, Func&& func) noexcept
+	{
+		Status outer, ret;
+		std::swap(outer, sticky_error());
+#if CXXENVI_EXCEPTIONS
+		try {
+			func();
+			ret = sticky_error();
+		} catch (std::bad_alloc const&) {
+			ret = Status(STATUS_OUT_OF_MEMORY, "out of memory");
+		} catch (std::exception const& e) {
+			ret = sticky_error().ok() ? Status(fallback, e.what()) : sticky_error();
+		} catch (...) {
+			ret = Status(STATUS_FAILED, "unknown error");
+		}
+#else
+		(void)fallback;
+		func();
+		ret = sticky_error();
+#endif
+		// a capture within a call keeps the error of that call
+		sticky_error() = CallScope::active() ? outer : Status();
+		return ret;
+	}
+
+	// Flag which of the n pixels starting at each of data[b] are valid:
+	// not NaN, nor equal to ignore in any channel
+	static void valid_pixels(std::vector<float const*> const& data, float ignore,
+		char* valid, size_t n)
+	{
+		std::fill(valid, valid + n, 1);
+		for (auto x : data)
+			for (size_t i = 0; i < n; ++i)
+				valid[i] &= (x[i] == x[i]) & (x[i] != ignore);
+	}
+
+	// Number of threads to actually use when asked for the given number,
+	// 0 meaning one per hardware thread
+	static size_t thread_count(size_t threads)
+	{
+#if CXXENVI_THREADS
+		if (!threads)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		return threads;
+#else
+		(void)threads;
+		return 1;
+#endif
+	}
+
+	// Run func(begin, end) over [0, count) split in contiguous ranges, one
+	// per thread (0 threads: one per hardware thread). Errors thrown on
+	// other threads are rethrown on the calling one; func must not
+	// raise() errors otherwise, since these are tracked per thread
+	template<typename Func>
+	static void parallel_for(size_t count, size_t threads, Func&& func)
+	{
+#if CXXENVI_THREADS
+		threads = std::min(thread_count(threads), count);
+		if (threads > 1) {
+			const size_t step = (count + threads - 1)/threads;
+			std::vector<std::thread> workers;
+#if CXXENVI_EXCEPTIONS
+			std::vector<std::exception_ptr> errors(threads);
+#endif
+			for (size_t t = 1; t < threads; ++t) {
+				const size_t begin = std::min(count, t*step);
+				const size_t end = std::min(count, begin + step);
+				workers.emplace_back([&, t, begin, end]() {
+#if CXXENVI_EXCEPTIONS
+					try {
+						func(begin, end);
+					} catch (...) {
+						errors[t] = std::current_exception();
+					}
+#else
+					func(begin, end);
+#endif
+				});
+			}
+#if CXXENVI_EXCEPTIONS
+			try {
+				func(0, std::min(count, step));
+			} catch (...) {
+				errors[0] = std::current_exception();
+			}
+#else
+			func(0, std::min(count, step));
+#endif
+			for (auto& w : workers)
+				w.join();
+#if CXXENVI_EXCEPTIONS
+			for (auto const& e : errors)
+				if (e)
+					std::rethrow_exception(e);
+#endif
+			return;
+		}
+#else
+		(void)threads;
+#endif
+		if (count)
+			func(size_t(0), count);
+	}
+
+	// Collects the statistics of an Input or Output, also adding them
+	// to the process-wide ones. Everything is a no-op without
+	// CXXENVI_PROFILE
+	class Profiler
+	{
+	public:
+		// Measures the time elapsed since its construction
+		class Timer
+		{
+#if CXXENVI_PROFILE
+			std::chrono::steady_clock::time_point start;
+		public:
+			Timer() : start(std::chrono::steady_clock::now())
+			{}
+
+			uint64_t elapsed() const
+			{
+				return std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - start).count();
+			}
+#else
+		public:
+			Timer()
+			{}
+
+			uint64_t elapsed() const
+			{ return 0; }
+#endif
+		};
+
+#if CXXENVI_PROFILE
+		enum Counter {
+			BYTES_READ, BYTES_WRITTEN, READS, WRITES, SEEKS,
+			IO_NS, CONVERT_NS, HEADER_NS, NUM_COUNTERS
+		};
+
+		static std::atomic<uint64_t>* global()
+		{
+			static std::atomic<uint64_t> counters[NUM_COUNTERS];
+			return counters;
+		}
+
+	private:
+		IOStats local;
+
+		static void add(uint64_t &counter, Counter index, uint64_t value)
+		{
+			counter += value;
+			global()[index].fetch_add(value, std::memory_order_relaxed);
+		}
+
+	public:
+		IOStats const& stats() const
+		{ return local; }
+
+		void count_read(size_t bytes, Timer const& t)
+		{
+			add(local.bytes_read, BYTES_READ, bytes);
+			add(local.reads, READS, 1);
+			add(local.io_ns, IO_NS, t.elapsed());
+		}
+
+		void count_write(size_t bytes, Timer const& t)
+		{
+			add(local.bytes_written, BYTES_WRITTEN, bytes);
+			add(local.writes, WRITES, 1);
+			add(local.io_ns, IO_NS, t.elapsed());
+		}
+
+		void count_seek(Timer const& t)
+		{
+			add(local.seeks, SEEKS, 1);
+			add(local.io_ns, IO_NS, t.elapsed());
+		}
+
+		void count_convert(Timer const& t)
+		{ add(local.convert_ns, CONVERT_NS, t.elapsed()); }
+
+		void count_header(Timer const& t)
+		{ add(local.header_ns, HEADER_NS, t.elapsed()); }
+#else
+		IOStats const& stats() const
+		{
+			static const IOStats none;
+			return none;
+		}
+
+		void count_read(size_t, Timer const&) {}
+		void count_write(size_t, Timer const&) {}
+		void count_seek(Timer const&) {}
+		void count_convert(Timer const&) {}
+		void count_header(Timer const&) {}
+#endif
+	};
+
+	static inline SimdLevel detect_simd_level()
+	{
+#if CXXENVI_DISPATCH
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+			return SIMD_AVX512;
+		if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+			return SIMD_AVX2;
+		if (__builtin_cpu_supports("sse4.1"))
+			return SIMD_SSE41;
+		return SIMD_SSE2;
+#elif CXXENVI_SSE2
+		return SIMD_SSE2;
+#else
+		return SIMD_SCALAR;
+#endif
+	}
+
+	static inline std::atomic<int>& simd_level_state()
+	{
+		static std::atomic<int> level(supported_simd_level());
+		return level;
+	}
+
 	// ENVI replaces the last extension with .hdr, or appends .hdr
 	// if no extension is found. We follow the same practice.
 	static inline std::string hdr_name(std::string const& fname)
 	{
-		if (fname.empty())
-			throw std::invalid_argument("data filename cannot be empty");
+		if (fname.empty()) {
+			raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("data filename cannot be empty"));
+			return std::string();
+		}
 		size_t dot = fname.rfind('.');
 		if (dot == fname.size() - 1)
 			return fname + "hdr";
@@ -281,6 +1036,21 @@ private:
 		return fname.substr(0, dot) + ".hdr";
 	}
 
+	// Close a stream, if its type can be closed (file streams can,
+	// string streams can't)
+	template<typename S>
+	static inline auto close_stream(S& s, int) -> decltype(s.close(), void())
+	{ s.close(); }
+
+	template<typename S>
+	static inline void close_stream(S&, long)
+	{}
+
+	// Enable the stream-based factories only for (rvalue) streams
+	template<typename S, typename R>
+	using if_stream = typename std::enable_if<
+		std::is_base_of<std::ios_base, S>::value, R>::type;
+
 	// The metadata included in a header file: a set of key-values.
 	// We want to preserve order, so instead of using a hash
 	// we use a pair of vectors
@@ -299,7 +1069,8 @@ private:
 			size_t idx = ((found == fin) ? npos : found - ini);
 
 			if (idx != npos && fail_present)
-				throw std::runtime_error("key " + _k + " already exists with value " + values[idx]);
+				raise(STATUS_INVALID_ARGUMENT,
+					std::runtime_error("key " + _k + " already exists with value " + values[idx]));
 
 			return idx;
 		}
@@ -383,7 +1154,8 @@ private:
 		template<typename T>
 		void add(std::string const& _k, T const& _v)
 		{
-			(void)index(_k, true);
+			if (index(_k, true) != npos)
+				return;
 
 			create_kval(_k, _v);
 		}
@@ -392,7 +1164,8 @@ private:
 		template<typename ... T>
 		void add_multi(std::string const& _k, T const& ... values)
 		{
-			(void)index(_k, true);
+			if (index(_k, true) != npos)
+				return;
 
 			std::stringstream ss;
 			ss.precision(16);
@@ -401,11 +1174,28 @@ private:
 			create_kval(_k, ss.str());
 		}
 
+		// Add a key-value pair where the value is an array of values
+		// known at runtime
+		template<typename T>
+		void add_multi(std::string const& _k, std::vector<T> const& values)
+		{
+			if (index(_k, true) != npos)
+				return;
+
+			std::stringstream ss;
+			ss.precision(16);
+			ss << "{ ";
+			for (size_t i = 0; i < values.size(); ++i)
+				ss << (i ? ", " : "") << values[i];
+			ss << " }";
+			create_kval(_k, ss.str());
+		}
+
 		// get the value of a key as an array of strings (splitting the original
 		// value at commas
 		std::vector<std::string> get_values(std::string const& _k) const
 		{
-			std::string const& v = this->get(_k);
+			const std::string v(this->get(_k));
 			std::stringstream ss(v);
 			std::vector<std::string> ret;
 			std::string cur;
@@ -430,274 +1220,92 @@ private:
 
 	// The ENVI::Output() template class, encapsulating writing to an ENVI file.
 	// Samples on-disk will be a serialization of OutputDataType (which must be
-	// one of the data types symbolized in DataTypeEnum
+	// one of the data types symbolized in DataTypeEnum.
+	// It is defined after the conversion kernels it uses. Forward-declare it here
 	template<typename OutputDataType, typename StreamType = std::ofstream>
-	class Output
-	{
-		Metadata meta;
-		const std::string description;
-		const size_t lines, samples, pixels;
-		std::vector<std::string> channels;
-		StreamType data;
-		StreamType hdr;
-		// Did we open data and hdr ourselves?
-		bool need_closing;
-
-		// Write out channel data, of type InputDataType.
-		// The generic version does sample-by-sample conversion from
-		// InputDataType to OutputDataType
-		template<typename InputDataType>
-		void write_channel_data(InputDataType const *ptr, size_t count)
-		{
-			for (size_t p = 0; p < count; ++p) {
-				OutputDataType sample = ptr[p];
-				data.write((const char*)&sample, sizeof(sample));
-			}
-		}
+	class Output;
 
-		// Specialization of write_channel_data when no conversion is needed
-		void write_channel_data(OutputDataType const *ptr, size_t count)
-		{
-			data.write((const char*)ptr, count*sizeof(*ptr));
-		}
+	// The Input file class needs to be defined after defining the CodeType maps,
+	// since they need to know CodeType has a type member which is a type.
+	// Forward-declare it here
+	template<typename StreamType = std::ifstream>
+	class BasicInput;
 
-		// Write out a whole channel, from data stored at ptr
-		template<typename InputDataType>
-		void write_channel(InputDataType const *ptr)
-		{
-			write_channel_data(ptr, pixels);
-		}
+	typedef BasicInput<std::ifstream> Input;
 
-		// Write out a whole channel, from data stored at ptr, assuming
-		// that consecutive lines are at stride elements of each other.
-		// (For example, because we are only storing a subset of the data,
-		// or because lines of in-memory data were allocated with a larger
-		// pitch than needed for alignment reasons or whatever.)
-		template<typename InputDataType>
-		void write_strided_channel(InputDataType const *ptr, size_t stride)
-		{
-			for (size_t l = 0; l < lines; ++l) {
-				InputDataType const *line = ptr + l*stride;
-				write_channel_data(line, samples);
-			}
-		}
+public:
 
-		// Write out a whole channel, from data provided by a function
-		// (or functor) that takes the current row, col as argument
-		// and returns the value
-		template<typename Func, typename ...Args>
-		void write_channel_function(Func&& func, Args&& ... args)
-		{
-			for (size_t l = 0; l < lines; ++l) {
-				for (size_t c = 0; c < samples; ++c) {
-					OutputDataType sample = std::bind(func, args..., l, c)();
-					data.write((const char*)&sample, sizeof(sample));
-				}
-			}
-		}
+	// Arithmetic on the channels of one or more inputs, defined after
+	// the Input class
+	class BandMath;
 
-		// Write channel names in the header: one per line if there's
-		// more than one, space-wrapped if there's only one
-		void write_channel_names()
-		{
-			size_t num = channels.size();
-			hdr << (num > 1 ? "\n" : " ");
-			for (size_t c = 0; c < num - 1; ++c)
-				hdr << channels[c] << ",\n";
-			hdr << channels.back();
-			hdr << (num > 1 ? "\n" : " ");
-		}
+	// Principal components of the channels of an input, defined after
+	// the Input class
+	class PCA;
 
-		// Write out the whole header
-		void write_header()
-		{
-			hdr << "ENVI\n";
-			hdr << "description = { " << description << " }\n";
-			hdr << "samples = " << samples << "\n";
-			hdr << "lines = " << lines << "\n";
-			hdr << "bands = " << channels.size() << "\n";
-			hdr << "data type = " << TypeCode<OutputDataType>() << "\n";
-			hdr << "interleave = bsq\n"; // TODO user choice
-			hdr << "header offset = 0\n" ;
-			hdr << "byte order = "
-				<< endianness() // TODO user choice:
-				<< "\n" ;
-			hdr << "band names = {" ;
-			write_channel_names();
-			hdr << "}\n";
+	// Scores of pixels against reference spectra
+	enum MatchMethod
+	{
+		// angle between the spectra, in radians
+		SPECTRAL_ANGLE,
+		// Euclidean distance between the spectra
+		EUCLIDEAN_DISTANCE,
+		// matched filter against the background of the image,
+		// 1 for the target itself, 0 for the background mean
+		MATCHED_FILTER
+	};
 
-			for (size_t i = 0; i < meta.size(); ++i)
-			{
-				hdr << meta.key(i) << " = " << meta.value(i) << "\n";
-			}
-		}
+	// Matching of the pixels of an input against reference spectra,
+	// defined after the Input class
+	class SpectralMatch;
 
-		void prepare_writing()
-		{
-			data.exceptions(std::ios::failbit | std::ios::badbit);
-			hdr.exceptions(std::ios::failbit | std::ios::badbit);
-		}
+	// Nearest-neighbour search among reference spectra, defined after
+	// the Input class
+	class SpectralIndex;
 
-		void flush()
-		{
-			data.flush();
-			write_header();
-			hdr.flush();
-		}
+	// Per-pixel reductions across channels
+	enum BandReduction
+	{
+		BAND_SUM,
+		BAND_MEAN,
+		BAND_MIN,
+		BAND_MAX,
+		// (0-based) channel of the minimum or maximum, the first one
+		// on ties
+		BAND_ARGMIN,
+		BAND_ARGMAX,
+		// number of valid samples
+		BAND_COUNT
+	};
 
-		// TODO enable only if StreamType has 'close'
-		void close()
-		{
-			data.close();
-			hdr.close();
-		}
-	public:
-		// Create output, with given data and header streams,
-		// description, and number of lines and samples
-		Output( StreamType&& data_stream,
-			StreamType&& hdr_stream,
-			std::string const& _desc,
-			size_t _lines, size_t _samples) :
-			description(_desc),
-			lines(_lines),
-			samples(_samples),
-			pixels(lines*samples),
-			channels(),
-			data(data_stream),
-			hdr(hdr_stream),
-			need_closing(false)
-		{
-			prepare_writing();
-		}
-
-		// Create output, with given name, header file name, description
-		// and number of lines and samples (columns).
-		Output(std::string const& fname,
-			std::string const& fname_hdr,
-			std::string const& _desc,
-			size_t _lines, size_t _samples) :
-			description(_desc),
-			lines(_lines),
-			samples(_samples),
-			pixels(lines*samples),
-			channels(),
-			data(StreamType(fname)),
-			hdr(StreamType(fname_hdr)),
-			need_closing(true)
-		{
-			prepare_writing();
-		}
-
-
-		// Create output, with given name, description
-		// and number of lines and samples (columns).
-		// The header file will have the extension replaced by
-		// '.hdr' (or hdr appended) automatically
-		Output(std::string const& fname,
-			std::string const& _desc,
-			size_t _lines, size_t _samples) :
-			description(_desc),
-			lines(_lines),
-			samples(_samples),
-			pixels(lines*samples),
-			channels(),
-			data(StreamType(fname)),
-			hdr(StreamType(hdr_name(fname))),
-			need_closing(true)
-		{
-			prepare_writing();
-		}
-
-		~Output()
-		{
-			// Finalize the files on closure, but only if they are valid
-			// otherwise we might get an exception thrown during stack
-			// unwinding
-			if (data && hdr) try {
-				flush();
-				if (need_closing)
-					close();
-			} catch (std::exception &e) {
-				// nothing we can do in a destructor anyway
-			}
-		}
-
-		// Add a channel
-		template<typename InputDataType>
-		size_t add_channel(std::string const& ch_name,
-			InputDataType const* ptr)
-		{
-			write_channel(ptr);
-			channels.push_back(ch_name);
-			return channels.size() - 1;
-		}
-
-		template<typename InputDataType>
-		size_t add_channel(std::string const& ch_name,
-			std::vector<InputDataType> const& vec)
-		{
-			if (vec.size() != lines*samples)
-				throw std::runtime_error("wrong number of pixels in channel " + ch_name);
-			return add_channel(ch_name, &vec.front());
-		}
-
-		// Add a channel from a linearized array with the given
-		// stride (in elements), starting from the given row and column
-		template<typename InputDataType>
-		size_t add_channel_rect(std::string const& ch_name,
-			InputDataType const* ptr, size_t stride,
-			size_t row=0, size_t col=0)
-		{
-			if (stride < samples + col)
-				throw std::runtime_error("data stride too small in channel " + ch_name);
-			write_strided_channel(ptr + row*stride + col, stride);
-			channels.push_back(ch_name);
-			return channels.size() - 1;
-		}
-
-		template<typename InputDataType>
-		size_t add_channel_rect(std::string const& ch_name,
-			std::vector<InputDataType> const& vec, size_t stride,
-			size_t row=0, size_t col=0)
-		{
-			if ( (row+lines)*stride < vec.size())
-				throw std::runtime_error("vector too small for channel " + ch_name);
-			return add_channel_rect(ch_name, &vec.front(), stride, row, col);
-		}
+	// Computation of per-pixel reductions, defined after the Input class
+	class BandReducer;
 
-		// Add a channel defined by applying a function to (row, column) pairs
-		template<typename Func, typename ...Args>
-		size_t add_channel_func(std::string const& ch_name, Func&& func, Args&& ... args)
-		{
-			write_channel_function(func, args...);
-			channels.push_back(ch_name);
-			return channels.size() - 1;
-		}
+	// Neighbourhood filters over channels, defined after the Input class
+	class SpatialFilter;
 
-		// Add a single-valued meta key
-		template<typename T>
-		void add_meta(std::string const& key, T const& value)
-		{
-			meta.add(key, value);
-		}
+	// Resampling to the spectral responses of another sensor, defined
+	// after the Input class
+	class SpectralResampler;
 
-		// Add a multi-valued meta key
-		template<typename ...T>
-		void add_meta(std::string const& key, T const& ... value)
-		{
-			meta.add_multi(key, value...);
-		}
-	};
+	// Summed-area tables and their box queries, defined after the Input
+	// class
+	class SummedAreaTable;
 
-	// The Input file class needs to be defined after defining the CodeType maps,
-	// since they need to know CodeType has a type member which is a type.
-	// Forward-declare it here
-	template<typename StreamType = std::ifstream>
-	class BasicInput;
+	// Mergeable quantile sketches, and their computation for the
+	// channels of an input, defined after the Input class
+	class QuantileSketch;
+	class BandQuantiles;
 
-	typedef BasicInput<std::ifstream> Input;
+	// RGB previews from decimated reads, defined after the Input class
+	class Quicklook;
 
-public:
+	// Spatial index of georeferenced files, defined after the Input
+	// class
+	class Catalog;
+
+	// Streaming comparison of two inputs, defined after the Input class
+	class CubeComparison;
 
 	// Open an ENVI file for writing, specifying
 	// the number of rows (lines) and columns (samples). If the file already exists,
@@ -721,12 +1329,40 @@ public:
 			new Output<OutputDataType>(output_fname, hdr_fname, desc, lines, samples));
 	}
 
+	// Non-throwing create()
+	template<typename OutputDataType>
+	static Result<std::shared_ptr<Output<OutputDataType>>>
+	try_create(std::string const& output_fname, std::string const& desc,
+		size_t lines, size_t samples) noexcept
+	{
+		Result<std::shared_ptr<Output<OutputDataType>>> ret;
+		ret.status = capture(STATUS_OPEN_FAILED, [&]() {
+			ret.value = create<OutputDataType>(output_fname, desc, lines, samples);
+		});
+		if (!ret.ok())
+			ret.value.reset();
+		return ret;
+	}
+
+	// create() variant writing to the given data and header streams
+	// (e.g. std::stringstream), which are taken over by the output
+	template<typename OutputDataType, typename StreamType>
+	static if_stream<StreamType, std::shared_ptr<Output<OutputDataType, StreamType>>>
+	create(StreamType&& data, StreamType&& hdr, std::string const& desc,
+		size_t lines, size_t samples)
+	{
+		return std::shared_ptr<Output<OutputDataType, StreamType>>(
+			new Output<OutputDataType, StreamType>(std::move(data), std::move(hdr),
+				desc, lines, samples));
+	}
+
 	// Comfort method to write a single-channel file
 	template<typename OutputDataType>
 	static void
 	dump(std::string const& output_fname, std::string const& desc,
 		size_t lines, size_t samples, OutputDataType const *data)
 	{
+		const CallScope call;
 		auto f = create<OutputDataType>(output_fname, desc, lines, samples);
 		f->add_channel(desc, data);
 	}
@@ -737,14 +1373,29 @@ public:
 	dump(std::string const& output_fname, std::string const& desc,
 		size_t lines, size_t samples, std::vector<OutputDataType> const& data)
 	{
+		const CallScope call;
 		auto f = create<OutputDataType>(output_fname, desc, lines, samples);
 		f->add_channel(desc, data);
 	}
 
 	// Open an ENVI file for reading
-	static inline std::shared_ptr<Input>
+	static std::shared_ptr<Input>
 	ropen(std::string const& input_fname);
 
+	// Non-throwing ropen(): header errors are reported too
+	static Result<std::shared_ptr<Input>>
+	try_ropen(std::string const& input_fname) noexcept;
+
+	// Read from the given data and header streams, which are taken
+	// over by the input
+	template<typename StreamType>
+	static if_stream<StreamType, std::shared_ptr<BasicInput<StreamType>>>
+	ropen(StreamType&& data, StreamType&& hdr)
+	{
+		return std::shared_ptr<BasicInput<StreamType>>(
+			new BasicInput<StreamType>(std::move(data), std::move(hdr)));
+	}
+
 	// Method to load a single channel from a file. This will be
 	// only declared here, as its definition depends on the ENVI::Input
 	// definition
@@ -789,393 +1440,7886 @@ DEFINE_DATA_TYPE(uint32_t, UINT32);
 DEFINE_DATA_TYPE(int64_t, INT64);
 DEFINE_DATA_TYPE(uint64_t, UINT64);
 
-
-// Class to manage input from 'arbitrary' istreams
-// TODO expose metadata
-// TODO allow reading of all channels at once
-template<typename StreamType>
-class ENVI::BasicInput
+// Kernels converting runs of samples between data types.
+// Everything that moves samples between the raw files and memory goes
+// through here, so this is where the vectorized code paths live.
+// (Some versions of GCC warn about the _mm512_undefined_* placeholders
+// used by their own AVX-512 intrinsics, silence that)
+#if CXXENVI_DISPATCH && defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+struct ENVI::Kernels
 {
-protected:
-	Metadata meta;
-	std::string description;
-	size_t lines, samples, pixels;
-	size_t data_offset;
-	DataTypeEnum input_data_type;
-	std::vector<std::string> channels;
-	StreamType data;
-	StreamType hdr;
-	bool need_closing;
+private:
+	// Conversion between types that can be assigned to each other:
+	// the plain loop is trivially vectorized by the compiler
+	template<typename In, typename Out>
+	static inline void
+	convert_impl(In const* in, Out* out, size_t count, std::true_type)
+	{
+		for (size_t i = 0; i < count; ++i)
+			out[i] = in[i];
+	}
 
-	// We assume that each key = value is in a separate line,
-	// except for array/string values, that begin with '{' and end
-	// with '}' (followed by a newline). So if an input contains a
-	// { we keep reading lines until we find the closing }
-	// TODO return information on whether it was in {} or not
-	inline void read_keyval(std::string &key, std::string &val)
+	// Conversion between types that cannot be assigned to each other
+	// (i.e. complex to real)
+	template<typename In, typename Out>
+	static inline void
+	convert_impl(In const* /* in */, Out* /* out */, size_t /* count */, std::false_type)
 	{
-		std::string keyval;
-		std::string line;
+		raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("cannot convert complex data to a real type"
+			" without a complex reduction"));
+	}
 
-		key.clear();
-		val.clear();
-		while (line.empty())
-		{
-			ENVI::getline(hdr, line);
-			if (!hdr)
-				return; // nothing else to read
-		}
+	// Does the conversion policy make a difference when converting
+	// from In to Out?
+	template<typename In, typename Out>
+	struct policy_applies : std::integral_constant<bool,
+		std::is_arithmetic<In>::value && std::is_integral<Out>::value &&
+		!std::is_same<In, Out>::value>
+	{};
 
-		keyval = line;
-		size_t open = keyval.find('{');
-		size_t close = keyval.find('}');
+	template<typename T>
+	static inline bool is_negative(T v, std::true_type)
+	{ return v < T(0); }
 
-		// if there was no closing '}', keep reading until one is
-		// found 
-		if ( open != keyval.npos && close == keyval.npos)
-		{
-			while (close == keyval.npos)
-			{
-				ENVI::getline(hdr, line);
-				keyval += line;
-				if (hdr.fail())
-					throw std::runtime_error("missing '}'");
-				close = keyval.find('}');
-			}
-		}
+	template<typename T>
+	static inline bool is_negative(T /* v */, std::false_type)
+	{ return false; }
+
+	// Clamp a floating-point value to the range of Out. The comparisons
+	// are done in the floating-point type: the range limits are rounded
+	// outwards (if at all), so that anything inside them can be converted
+	template<typename Out, typename In>
+	static inline typename std::enable_if<std::is_floating_point<In>::value, Out>::type
+	saturate(In v)
+	{
+		typedef std::numeric_limits<Out> lim;
+		if (v != v)
+			return Out(0);
+		if (v >= In(lim::max()))
+			return lim::max();
+		if (v <= In(lim::min()))
+			return lim::min();
+		return Out(v);
+	}
 
-		// the key is up to the =, excluding it
-		size_t eq = keyval.find('=');
-		if (eq == keyval.npos || eq > open)
-			throw std::runtime_error("missing '='");
+	// Clamp an integer value to the range of Out
+	template<typename Out, typename In>
+	static inline typename std::enable_if<std::is_integral<In>::value, Out>::type
+	saturate(In v)
+	{
+		typedef std::numeric_limits<Out> lim;
+		if (is_negative(v, std::is_signed<In>()))
+			return (!lim::is_signed || intmax_t(v) < intmax_t(lim::min())) ?
+				lim::min() : Out(v);
+		return uintmax_t(v) > uintmax_t(lim::max()) ? lim::max() : Out(v);
+	}
 
-		// for the key, just trim whitespace
-		key = keyval.substr(0, eq);
-		trim(key);
+	template<typename T>
+	static inline typename std::enable_if<std::is_floating_point<T>::value, T>::type
+	round_nearest(T v)
+	{ return std::nearbyint(v); }
 
-		// for the val, get between open and close if they are npos,
-		// or everything past the equal sign otherwise
-		size_t val_start = (open != keyval.npos ? open : eq)+1;
-		size_t val_len = (open != keyval.npos ? close - open-1 : keyval.npos);
-		val = keyval.substr(val_start, val_len);
-		trim(val);
+	template<typename T>
+	static inline typename std::enable_if<std::is_integral<T>::value, T>::type
+	round_nearest(T v)
+	{ return v; }
+
+	// Vectorized conversions with a given policy: these process as many
+	// samples as they can, and return how many they did. The generic versions
+	// don't do anything
+	template<ConversionPolicy policy, typename In, typename Out>
+	static inline size_t
+	convert_simd(In const* /* in */, Out* /* out */, size_t /* count */)
+	{ return 0; }
+
+#if CXXENVI_SSE2
+	template<ConversionPolicy policy, typename Out>
+	static inline size_t
+	convert_sse2(float const* /* in */, Out* /* out */, size_t /* count */)
+	{ return 0; }
+
+	// Convert four floats to int32, clamped to [lo, hi], NaN to zero
+	template<ConversionPolicy policy>
+	static inline __m128i cvt_clamp_ps(__m128 x, __m128 lo, __m128 hi)
+	{
+		x = _mm_and_ps(x, _mm_cmpord_ps(x, x));
+		x = _mm_min_ps(_mm_max_ps(x, lo), hi);
+		return (policy & ROUND) ? _mm_cvtps_epi32(x) : _mm_cvttps_epi32(x);
 	}
 
-	void process_keyval(std::string const& key, std::string const& val)
+	template<ConversionPolicy policy>
+	static inline size_t
+	convert_sse2(float const* in, int32_t* out, size_t count)
 	{
-		if (key == "description") {
-			description = val;
-		} else if (key == "samples") {
-			samples = atol(val.c_str());
-		} else if (key == "lines") {
-			lines = atol(val.c_str());
-		} else if (key == "bands") {
-			size_t nbands = atol(val.c_str());
-			if (channels.size() > 0 && nbands != channels.size())
-				throw std::runtime_error("inconsistent bands and band names");
-			channels.reserve(nbands);
-		} else if (key == "data type") {
-			long type = atol(val.c_str());
-			if (!valid_type(type))
-				throw std::invalid_argument("unknown ENVI type '" + val);
-			input_data_type = (DataTypeEnum)type;
-		} else if (key == "interleave") {
-			if (val != "bsq")
-				throw std::invalid_argument("interleave '" + val + "' not supported");
-		} else if (key == "header offset") {
-			data_offset = atol(val.c_str());
-		} else if (key == "byte order") {
-			size_t bo = atol(val.c_str());
-			if (bo)
-				throw std::invalid_argument("unsupported endianness");
-		} else if (key == "band names") {
-			// if we read a 'bands', we expect as many names as there were bands,
-			// so read the capacity we reserved when bands was read, if any
-			const size_t expected = channels.capacity();
-			if (channels.size() > 0)
-				throw std::invalid_argument("'band names' seen twice");
-
-			// comma separated list
-			size_t prev = 0, found = 0;
-			while ((found = val.find(',', prev)) != val.npos) {
-				std::string sec = val.substr(prev, found-prev);
-				channels.push_back(trim(sec));
-				prev = found+1;
-			}
-			// push the part after the last comma, if not empty
-			std::string rem = val.substr(prev, val.npos);
-			trim(rem);
-			if (!rem.empty())
-				channels.push_back(rem);
-
-			if (expected && channels.size() != expected)
-				throw std::runtime_error("inconsistent band names and bands");
-		} else {
-			meta.add(key, val);
+		// Values from 2^31 up convert to 0x80000000: flip them
+		// to 0x7fffffff instead of clamping, since INT32_MAX is not
+		// representable as a float
+		const __m128 lo = _mm_set1_ps(-2147483648.0f), hi = _mm_set1_ps(2147483648.0f);
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			const __m128 x = _mm_loadu_ps(in + i);
+			const __m128i over = _mm_castps_si128(_mm_cmpge_ps(x, hi));
+			const __m128i v = cvt_clamp_ps<policy>(x, lo, hi);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_xor_si128(v, over));
 		}
+		return i;
 	}
 
-	void read_header()
+	template<ConversionPolicy policy>
+	static inline size_t
+	convert_sse2(float const* in, int16_t* out, size_t count)
 	{
-		std::string line;
-		ENVI::getline(hdr, line);
-		if (line != "ENVI")
-			throw std::runtime_error("missing 'ENVI' in header");
-
-		std::string key, val;
+		const __m128 lo = _mm_set1_ps(-32768.0f), hi = _mm_set1_ps(32767.0f);
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			const __m128i a = cvt_clamp_ps<policy>(_mm_loadu_ps(in + i), lo, hi);
+			const __m128i b = cvt_clamp_ps<policy>(_mm_loadu_ps(in + i + 4), lo, hi);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packs_epi32(a, b));
+		}
+		return i;
+	}
 
-		do {
-			read_keyval(key, val);
-			if (key.empty())
-				break;
+	template<ConversionPolicy policy>
+	static inline size_t
+	convert_sse2(float const* in, uint16_t* out, size_t count)
+	{
+		// SSE2 has no unsigned 32-to-16 pack (packus_epi32 is SSE4.1),
+		// so we bias the values into the signed range, use the signed
+		// pack and flip the sign bit back
+		const __m128 lo = _mm_setzero_ps(), hi = _mm_set1_ps(65535.0f);
+		const __m128i bias32 = _mm_set1_epi32(32768);
+		const __m128i bias16 = _mm_set1_epi16(-32768);
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			const __m128i a = cvt_clamp_ps<policy>(_mm_loadu_ps(in + i), lo, hi);
+			const __m128i b = cvt_clamp_ps<policy>(_mm_loadu_ps(in + i + 4), lo, hi);
+			const __m128i p = _mm_packs_epi32(_mm_sub_epi32(a, bias32), _mm_sub_epi32(b, bias32));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_xor_si128(p, bias16));
+		}
+		return i;
+	}
 
-#if CXXENVI_DEBUG
-			std::clog << "KEY: '" << key << "', VAL: '" << val << "'" << std::endl;
+	template<ConversionPolicy policy>
+	static inline size_t
+	convert_sse2(float const* in, int8_t* out, size_t count)
+	{
+		const __m128 lo = _mm_set1_ps(-128.0f), hi = _mm_set1_ps(127.0f);
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			const __m128i a = cvt_clamp_ps<policy>(_mm_loadu_ps(in + i), lo, hi);
+			const __m128i b = cvt_clamp_ps<policy>(_mm_loadu_ps(in + i + 4), lo, hi);
+			const __m128i c = cvt_clamp_ps<policy>(_mm_loadu_ps(in + i + 8), lo, hi);
+			const __m128i d = cvt_clamp_ps<policy>(_mm_loadu_ps(in + i + 12), lo, hi);
+			const __m128i p = _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), p);
+		}
+		return i;
+	}
 #endif
 
-			process_keyval(key, val);
-		} while (hdr);
-
-		pixels = lines*samples;
-		// TODO other consistency checks etc
-
+#if CXXENVI_DISPATCH
+	template<ConversionPolicy policy, typename Out>
+	static inline size_t
+	convert_sse41(float const* in, Out* out, size_t count)
+	{ return convert_sse2<policy>(in, out, count); }
+
+	// SSE4.1 has the unsigned 32-to-16 pack
+	template<ConversionPolicy policy>
+	CXXENVI_TARGET("sse4.1")
+	static inline size_t
+	convert_sse41(float const* in, uint16_t* out, size_t count)
+	{
+		const __m128 lo = _mm_setzero_ps(), hi = _mm_set1_ps(65535.0f);
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			const __m128i a = cvt_clamp_ps<policy>(_mm_loadu_ps(in + i), lo, hi);
+			const __m128i b = cvt_clamp_ps<policy>(_mm_loadu_ps(in + i + 4), lo, hi);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi32(a, b));
+		}
+		return i;
 	}
 
-	void prepare_reading()
+	// Convert eight floats to int32, clamped to [lo, hi], NaN to zero
+	template<ConversionPolicy policy>
+	CXXENVI_TARGET("avx2,fma")
+	static inline __m256i cvt_clamp_ps256(__m256 x, __m256 lo, __m256 hi)
 	{
-		data.exceptions(std::ios::badbit);
-		hdr.exceptions(std::ios::badbit);
-		read_header();
+		x = _mm256_and_ps(x, _mm256_cmp_ps(x, x, _CMP_ORD_Q));
+		x = _mm256_min_ps(_mm256_max_ps(x, lo), hi);
+		return (policy & ROUND) ? _mm256_cvtps_epi32(x) : _mm256_cvttps_epi32(x);
 	}
 
+	template<ConversionPolicy policy, typename Out>
+	static inline size_t
+	convert_avx2(float const* in, Out* out, size_t count)
+	{ return convert_sse41<policy>(in, out, count); }
 
-	// TODO enable only if StreamType has 'close'
-	void close()
+	template<ConversionPolicy policy>
+	CXXENVI_TARGET("avx2,fma")
+	static inline size_t
+	convert_avx2(float const* in, int32_t* out, size_t count)
 	{
-		data.close();
-		hdr.close();
+		const __m256 lo = _mm256_set1_ps(-2147483648.0f), hi = _mm256_set1_ps(2147483648.0f);
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			const __m256 x = _mm256_loadu_ps(in + i);
+			const __m256i over = _mm256_castps_si256(_mm256_cmp_ps(x, hi, _CMP_GE_OQ));
+			const __m256i v = cvt_clamp_ps256<policy>(x, lo, hi);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_xor_si256(v, over));
+		}
+		return i;
 	}
 
-	// Loader template class. Since we need runtime switching based off the
-	// type specified in the header, this will recursively call itself until
-	// matching the required data type
-	template<DataTypeEnum input_type = CHAR>
-	struct Loader
+	// The AVX2 packs work within 128-bit lanes, so the packed 64-bit
+	// quarters need to be put back in order
+	template<ConversionPolicy policy>
+	CXXENVI_TARGET("avx2,fma")
+	static inline size_t
+	convert_avx2(float const* in, int16_t* out, size_t count)
 	{
-		typedef typename CodeType<input_type>::type InputType;
-
-		template<typename OutputType>
-		static inline void
-		undump(size_t count, std::istream &data, OutputType *o_data)
-		{
-			for (size_t px = 0; px < count; ++px) {
-				InputType val;
-				data.read(reinterpret_cast<char*>(&val), sizeof(InputType));
-				o_data[px] = val;
-			}
-		}
-
-		// Specialization for matching type
-		static inline void
-		undump(size_t count, std::istream &data, InputType *o_data)
-		{
-			data.read(reinterpret_cast<char*>(o_data), count*sizeof(InputType));
+		const __m256 lo = _mm256_set1_ps(-32768.0f), hi = _mm256_set1_ps(32767.0f);
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			const __m256i a = cvt_clamp_ps256<policy>(_mm256_loadu_ps(in + i), lo, hi);
+			const __m256i b = cvt_clamp_ps256<policy>(_mm256_loadu_ps(in + i + 8), lo, hi);
+			const __m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), p);
 		}
+		return i;
+	}
 
-
-		template<typename OutputType>
-		static inline void
-		undump(size_t count, std::istream &data, std::vector<OutputType>& o_data)
-		{
-			for (size_t px = 0; px < count; ++px) {
-				InputType val;
-				data.read(reinterpret_cast<char*>(&val), sizeof(InputType));
-				o_data[px] = val;
-			}
+	template<ConversionPolicy policy>
+	CXXENVI_TARGET("avx2,fma")
+	static inline size_t
+	convert_avx2(float const* in, uint16_t* out, size_t count)
+	{
+		const __m256 lo = _mm256_setzero_ps(), hi = _mm256_set1_ps(65535.0f);
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			const __m256i a = cvt_clamp_ps256<policy>(_mm256_loadu_ps(in + i), lo, hi);
+			const __m256i b = cvt_clamp_ps256<policy>(_mm256_loadu_ps(in + i + 8), lo, hi);
+			const __m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), p);
 		}
+		return i;
+	}
 
-		// Specialization for matching type
-		static inline void
-		undump(size_t count, std::istream &data, std::vector<InputType>& o_data)
-		{
-			data.read(reinterpret_cast<char*>(&(o_data[0])), count*sizeof(InputType));
+	template<ConversionPolicy policy>
+	CXXENVI_TARGET("avx2,fma")
+	static inline size_t
+	convert_avx2(float const* in, int8_t* out, size_t count)
+	{
+		const __m256 lo = _mm256_set1_ps(-128.0f), hi = _mm256_set1_ps(127.0f);
+		const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+		size_t i = 0;
+		for (; i + 32 <= count; i += 32) {
+			const __m256i a = cvt_clamp_ps256<policy>(_mm256_loadu_ps(in + i), lo, hi);
+			const __m256i b = cvt_clamp_ps256<policy>(_mm256_loadu_ps(in + i + 8), lo, hi);
+			const __m256i c = cvt_clamp_ps256<policy>(_mm256_loadu_ps(in + i + 16), lo, hi);
+			const __m256i d = cvt_clamp_ps256<policy>(_mm256_loadu_ps(in + i + 24), lo, hi);
+			const __m256i p = _mm256_packs_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+				_mm256_permutevar8x32_epi32(p, order));
 		}
+		return i;
+	}
 
+	// AVX-512 has saturating down-conversions, so after clamping (which
+	// takes care of NaN and of the float-to-int32 overflow) these are
+	// straightforward
+	template<ConversionPolicy policy>
+	CXXENVI_TARGET("avx512f,avx512bw")
+	static inline __m512i cvt_clamp_ps512(__m512 x, __m512 lo, __m512 hi)
+	{
+		x = _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(x, x, _CMP_ORD_Q), x);
+		x = _mm512_min_ps(_mm512_max_ps(x, lo), hi);
+		return (policy & ROUND) ? _mm512_cvtps_epi32(x) : _mm512_cvttps_epi32(x);
+	}
 
-		template<typename OutputType>
-		static inline void
-		prep_load(Input *in, size_t chnum, OutputType *o_data)
-		{
-			size_t raw_offset = in->data_offset + chnum*in->pixels*sizeof(InputType);
-			in->data.seekg(raw_offset);
+	template<ConversionPolicy policy, typename Out>
+	static inline size_t
+	convert_avx512(float const* in, Out* out, size_t count)
+	{ return convert_avx2<policy>(in, out, count); }
 
-			undump(in->pixels, in->data, o_data);
+	template<ConversionPolicy policy>
+	CXXENVI_TARGET("avx512f,avx512bw")
+	static inline size_t
+	convert_avx512(float const* in, int32_t* out, size_t count)
+	{
+		const __m512 lo = _mm512_set1_ps(-2147483648.0f), hi = _mm512_set1_ps(2147483648.0f);
+		const __m512i max = _mm512_set1_epi32(INT32_MAX);
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			const __m512 x = _mm512_loadu_ps(in + i);
+			const __mmask16 over = _mm512_cmp_ps_mask(x, hi, _CMP_GE_OQ);
+			const __m512i v = cvt_clamp_ps512<policy>(x, lo, hi);
+			_mm512_storeu_si512(out + i, _mm512_mask_mov_epi32(v, over, max));
 		}
+		return i;
+	}
 
-		template<typename OutputType>
-		static inline void
-		prep_load(Input *in, size_t chnum, std::vector<OutputType>& o_data)
-		{
-			size_t raw_offset = in->data_offset + chnum*in->pixels*sizeof(InputType);
-			in->data.seekg(raw_offset);
+	template<ConversionPolicy policy>
+	CXXENVI_TARGET("avx512f,avx512bw")
+	static inline size_t
+	convert_avx512(float const* in, int16_t* out, size_t count)
+	{
+		const __m512 lo = _mm512_set1_ps(-32768.0f), hi = _mm512_set1_ps(32767.0f);
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			const __m512i v = cvt_clamp_ps512<policy>(_mm512_loadu_ps(in + i), lo, hi);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm512_cvtsepi32_epi16(v));
+		}
+		return i;
+	}
 
-			undump(in->pixels, in->data, o_data);
+	template<ConversionPolicy policy>
+	CXXENVI_TARGET("avx512f,avx512bw")
+	static inline size_t
+	convert_avx512(float const* in, uint16_t* out, size_t count)
+	{
+		const __m512 lo = _mm512_setzero_ps(), hi = _mm512_set1_ps(65535.0f);
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			const __m512i v = cvt_clamp_ps512<policy>(_mm512_loadu_ps(in + i), lo, hi);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm512_cvtusepi32_epi16(v));
 		}
+		return i;
+	}
 
+	template<ConversionPolicy policy>
+	CXXENVI_TARGET("avx512f,avx512bw")
+	static inline size_t
+	convert_avx512(float const* in, int8_t* out, size_t count)
+	{
+		const __m512 lo = _mm512_set1_ps(-128.0f), hi = _mm512_set1_ps(127.0f);
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			const __m512i v = cvt_clamp_ps512<policy>(_mm512_loadu_ps(in + i), lo, hi);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm512_cvtsepi32_epi8(v));
+		}
+		return i;
+	}
+#endif
 
-		template<typename OutputType>
+#if CXXENVI_SSE2
+	// Vectorized conversion from float, for the best available
+	// instruction set
+	template<ConversionPolicy policy, typename Out>
+	static inline size_t
+	convert_simd(float const* in, Out* out, size_t count)
+	{
+		switch (simd_level()) {
+		case SIMD_SCALAR: return 0;
+#if CXXENVI_DISPATCH
+		case SIMD_SSE41:  return convert_sse41<policy>(in, out, count);
+		case SIMD_AVX2:   return convert_avx2<policy>(in, out, count);
+		case SIMD_AVX512: return convert_avx512<policy>(in, out, count);
+#endif
+		default:          return convert_sse2<policy>(in, out, count);
+		}
+	}
+
+	template<typename Out>
+	static inline size_t
+	convert_float(float const* in, Out* out, size_t count, ConversionPolicy policy)
+	{
+		switch (policy) {
+		case TRUNCATE:       return convert_simd<TRUNCATE>(in, out, count);
+		case ROUND:          return convert_simd<ROUND>(in, out, count);
+		case SATURATE:       return convert_simd<SATURATE>(in, out, count);
+		case SATURATE_ROUND: return convert_simd<SATURATE_ROUND>(in, out, count);
+		}
+		return 0;
+	}
+#endif
+
+	// Vectorized head of a conversion with the given policy, returning
+	// the number of samples converted. Only float to the narrower integer
+	// types has kernels, whose entry points are compiled in the library
+	template<typename In, typename Out>
+	static inline size_t
+	convert_head(In const* /* in */, Out* /* out */, size_t /* count */,
+		ConversionPolicy /* policy */)
+	{ return 0; }
+
+#if CXXENVI_SSE2
+	static size_t convert_head(float const* in, int8_t* out, size_t count, ConversionPolicy policy);
+	static size_t convert_head(float const* in, int16_t* out, size_t count, ConversionPolicy policy);
+	static size_t convert_head(float const* in, uint16_t* out, size_t count, ConversionPolicy policy);
+	static size_t convert_head(float const* in, int32_t* out, size_t count, ConversionPolicy policy);
+#endif
+
+	// Conversion with a given policy: vectorized head, scalar tail.
+	// The vectorized kernels always clamp, which is a valid outcome
+	// for the otherwise undefined out-of-range results of ROUND
+	template<ConversionPolicy policy, typename In, typename Out>
+	static inline void
+	convert_policy(In const* in, Out* out, size_t count)
+	{
+		size_t i = convert_head(in, out, count, policy);
+		for (; i < count; ++i) {
+			const In v = (policy & ROUND) ? round_nearest(in[i]) : in[i];
+			out[i] = (policy & SATURATE) ? saturate<Out>(v) : Out(v);
+		}
+	}
+
+	template<typename In, typename Out>
+	static inline void
+	convert_dispatch(In const* in, Out* out, size_t count,
+		ConversionPolicy /* policy */, std::false_type)
+	{
+		convert(in, out, count);
+	}
+
+	template<typename In, typename Out>
+	static inline void
+	convert_dispatch(In const* in, Out* out, size_t count,
+		ConversionPolicy policy, std::true_type)
+	{
+		switch (policy) {
+		case TRUNCATE:       return convert(in, out, count);
+		case ROUND:          return convert_policy<ROUND>(in, out, count);
+		case SATURATE:       return convert_policy<SATURATE>(in, out, count);
+		case SATURATE_ROUND: return convert_policy<SATURATE_ROUND>(in, out, count);
+		}
+		raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("unknown conversion policy"));
+	}
+
+#if CXXENVI_COMPLEX
+	// Reduction of a single complex sample
+	template<ComplexReduction mode, typename T>
+	static inline T reduce_one(std::complex<T> const& z)
+	{
+		const T re = z.real(), im = z.imag();
+		switch (mode) {
+		case MAGNITUDE: return std::sqrt(re*re + im*im);
+		case POWER:     return re*re + im*im;
+		case PHASE:     return std::atan2(im, re);
+		case POWER_DB:  return T(10)*std::log10(re*re + im*im);
+		}
+		return T();
+	}
+
+	template<ComplexReduction mode, typename T>
+	static inline void
+	reduce_scalar(std::complex<T> const* in, T* out, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i)
+			out[i] = reduce_one<mode>(in[i]);
+	}
+
+#if CXXENVI_SSE2
+	// Natural logarithm of four floats, adapted from the Cephes logf.
+	// Zero maps to -inf, negative values and NaN to NaN
+	static inline __m128 log_ps(__m128 x)
+	{
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 is_zero = _mm_cmpeq_ps(x, zero);
+		const __m128 invalid = _mm_cmpnge_ps(x, zero);
+
+		x = _mm_max_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x00800000)));
+
+		// split x into exponent and mantissa in [0.5, 1)
+		__m128i emm0 = _mm_srli_epi32(_mm_castps_si128(x), 23);
+		x = _mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(~0x7f800000)));
+		x = _mm_or_ps(x, _mm_set1_ps(0.5f));
+		emm0 = _mm_sub_epi32(emm0, _mm_set1_epi32(0x7f));
+		__m128 e = _mm_add_ps(_mm_cvtepi32_ps(emm0), one);
+
+		// bring the mantissa in [sqrt(0.5), sqrt(2))
+		const __m128 mask = _mm_cmplt_ps(x, _mm_set1_ps(0.707106781186547524f));
+		const __m128 tmp = _mm_and_ps(x, mask);
+		x = _mm_sub_ps(x, one);
+		e = _mm_sub_ps(e, _mm_and_ps(one, mask));
+		x = _mm_add_ps(x, tmp);
+
+		const __m128 z = _mm_mul_ps(x, x);
+		__m128 y = _mm_set1_ps(7.0376836292E-2f);
+		y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.1514610310E-1f));
+		y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.1676998740E-1f));
+		y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.2420140846E-1f));
+		y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.4249322787E-1f));
+		y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.6668057665E-1f));
+		y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(2.0000714765E-1f));
+		y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-2.4999993993E-1f));
+		y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(3.3333331174E-1f));
+		y = _mm_mul_ps(_mm_mul_ps(y, x), z);
+
+		y = _mm_add_ps(y, _mm_mul_ps(e, _mm_set1_ps(-2.12194440e-4f)));
+		y = _mm_sub_ps(y, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+		x = _mm_add_ps(x, y);
+		x = _mm_add_ps(x, _mm_mul_ps(e, _mm_set1_ps(0.693359375f)));
+
+		x = _mm_or_ps(x, invalid); // all ones is a NaN
+		const __m128 ninf = _mm_set1_ps(-HUGE_VALF);
+		return _mm_or_ps(_mm_andnot_ps(is_zero, x), _mm_and_ps(is_zero, ninf));
+	}
+
+	// Four-quadrant arctangent of four floats, adapted from the Cephes atanf
+	static inline __m128 atan2_ps(__m128 y, __m128 x)
+	{
+		const __m128 sign_mask = _mm_set1_ps(-0.0f);
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 ay = _mm_andnot_ps(sign_mask, y);
+		const __m128 ax = _mm_andnot_ps(sign_mask, x);
+		const __m128 both_zero = _mm_and_ps(_mm_cmpeq_ps(ay, zero), _mm_cmpeq_ps(ax, zero));
+
+		// atan(t) for t = |y|/|x| >= 0, with range reduction
+		__m128 t = _mm_div_ps(ay, ax);
+		const __m128 big = _mm_cmpgt_ps(t, _mm_set1_ps(2.414213562373095f));
+		const __m128 mid = _mm_andnot_ps(big, _mm_cmpgt_ps(t, _mm_set1_ps(0.4142135623730950f)));
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 t_big = _mm_div_ps(_mm_set1_ps(-1.0f), t);
+		const __m128 t_mid = _mm_div_ps(_mm_sub_ps(t, one), _mm_add_ps(t, one));
+		t = _mm_or_ps(_mm_and_ps(big, t_big), _mm_andnot_ps(big, t));
+		t = _mm_or_ps(_mm_and_ps(mid, t_mid), _mm_andnot_ps(mid, t));
+		const __m128 y0 = _mm_or_ps(
+			_mm_and_ps(big, _mm_set1_ps(1.5707963267948966f)),
+			_mm_and_ps(mid, _mm_set1_ps(0.7853981633974483f)));
+
+		const __m128 z = _mm_mul_ps(t, t);
+		__m128 r = _mm_set1_ps(8.05374449538e-2f);
+		r = _mm_add_ps(_mm_mul_ps(r, z), _mm_set1_ps(-1.38776856032E-1f));
+		r = _mm_add_ps(_mm_mul_ps(r, z), _mm_set1_ps(1.99777106478E-1f));
+		r = _mm_add_ps(_mm_mul_ps(r, z), _mm_set1_ps(-3.33329491539E-1f));
+		r = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(r, z), t), t);
+		r = _mm_add_ps(r, y0);
+		r = _mm_andnot_ps(both_zero, r);
+
+		// quadrant correction: pi - r if x is negative (including -0),
+		// then take the sign of y
+		const __m128 x_neg = _mm_castsi128_ps(_mm_srai_epi32(_mm_castps_si128(x), 31));
+		const __m128 r_neg = _mm_sub_ps(_mm_set1_ps(3.14159265358979f), r);
+		r = _mm_or_ps(_mm_and_ps(x_neg, r_neg), _mm_andnot_ps(x_neg, r));
+		return _mm_or_ps(r, _mm_and_ps(sign_mask, y));
+	}
+
+	template<ComplexReduction mode>
+	static inline __m128 reduce_ps(__m128 re, __m128 im)
+	{
+		const __m128 pwr = _mm_add_ps(_mm_mul_ps(re, re), _mm_mul_ps(im, im));
+		switch (mode) {
+		case MAGNITUDE: return _mm_sqrt_ps(pwr);
+		case POWER:     return pwr;
+		case PHASE:     return atan2_ps(im, re);
+		case POWER_DB:  return _mm_mul_ps(log_ps(pwr), _mm_set1_ps(4.342944819032518f));
+		}
+		return pwr;
+	}
+
+	template<ComplexReduction mode>
+	static inline size_t
+	reduce_sse2(std::complex<float> const* in, float* out, size_t count)
+	{
+		float const* src = reinterpret_cast<float const*>(in);
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			const __m128 a = _mm_loadu_ps(src + 2*i);
+			const __m128 b = _mm_loadu_ps(src + 2*i + 4);
+			const __m128 re = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+			const __m128 im = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+			_mm_storeu_ps(out + i, reduce_ps<mode>(re, im));
+		}
+		return i;
+	}
+
+	// For doubles, only the magnitude and power are vectorized: the
+	// transcendental functions are left to the C library for accuracy
+	template<ComplexReduction mode>
+	static inline size_t
+	reduce_sse2(std::complex<double> const* in, double* out, size_t count)
+	{
+		if (mode == PHASE || mode == POWER_DB)
+			return 0;
+		double const* src = reinterpret_cast<double const*>(in);
+		size_t i = 0;
+		for (; i + 2 <= count; i += 2) {
+			const __m128d a = _mm_loadu_pd(src + 2*i);
+			const __m128d b = _mm_loadu_pd(src + 2*i + 2);
+			const __m128d re = _mm_unpacklo_pd(a, b);
+			const __m128d im = _mm_unpackhi_pd(a, b);
+			__m128d pwr = _mm_add_pd(_mm_mul_pd(re, re), _mm_mul_pd(im, im));
+			if (mode == MAGNITUDE)
+				pwr = _mm_sqrt_pd(pwr);
+			_mm_storeu_pd(out + i, pwr);
+		}
+		return i;
+	}
+
+	static inline size_t
+	deinterleave_sse2(std::complex<float> const* in, float* re, float* im, size_t count)
+	{
+		float const* src = reinterpret_cast<float const*>(in);
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			const __m128 a = _mm_loadu_ps(src + 2*i);
+			const __m128 b = _mm_loadu_ps(src + 2*i + 4);
+			_mm_storeu_ps(re + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+			_mm_storeu_ps(im + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+		}
+		return i;
+	}
+
+	static inline size_t
+	deinterleave_sse2(std::complex<double> const* in, double* re, double* im, size_t count)
+	{
+		double const* src = reinterpret_cast<double const*>(in);
+		size_t i = 0;
+		for (; i + 2 <= count; i += 2) {
+			const __m128d a = _mm_loadu_pd(src + 2*i);
+			const __m128d b = _mm_loadu_pd(src + 2*i + 2);
+			_mm_storeu_pd(re + i, _mm_unpacklo_pd(a, b));
+			_mm_storeu_pd(im + i, _mm_unpackhi_pd(a, b));
+		}
+		return i;
+	}
+
+	static inline size_t
+	interleave_sse2(float const* re, float const* im, std::complex<float>* out, size_t count)
+	{
+		float* dst = reinterpret_cast<float*>(out);
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			const __m128 r = _mm_loadu_ps(re + i);
+			const __m128 m = _mm_loadu_ps(im + i);
+			_mm_storeu_ps(dst + 2*i, _mm_unpacklo_ps(r, m));
+			_mm_storeu_ps(dst + 2*i + 4, _mm_unpackhi_ps(r, m));
+		}
+		return i;
+	}
+
+	static inline size_t
+	interleave_sse2(double const* re, double const* im, std::complex<double>* out, size_t count)
+	{
+		double* dst = reinterpret_cast<double*>(out);
+		size_t i = 0;
+		for (; i + 2 <= count; i += 2) {
+			const __m128d r = _mm_loadu_pd(re + i);
+			const __m128d m = _mm_loadu_pd(im + i);
+			_mm_storeu_pd(dst + 2*i, _mm_unpacklo_pd(r, m));
+			_mm_storeu_pd(dst + 2*i + 2, _mm_unpackhi_pd(r, m));
+		}
+		return i;
+	}
+#endif
+
+#if CXXENVI_DISPATCH
+	// 256-bit versions of log_ps and atan2_ps
+	CXXENVI_TARGET("avx2,fma")
+	static inline __m256 log_ps256(__m256 x)
+	{
+		const __m256 one = _mm256_set1_ps(1.0f);
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 is_zero = _mm256_cmp_ps(x, zero, _CMP_EQ_OQ);
+		const __m256 invalid = _mm256_cmp_ps(x, zero, _CMP_NGE_UQ);
+
+		x = _mm256_max_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(0x00800000)));
+
+		__m256i emm0 = _mm256_srli_epi32(_mm256_castps_si256(x), 23);
+		x = _mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(~0x7f800000)));
+		x = _mm256_or_ps(x, _mm256_set1_ps(0.5f));
+		emm0 = _mm256_sub_epi32(emm0, _mm256_set1_epi32(0x7f));
+		__m256 e = _mm256_add_ps(_mm256_cvtepi32_ps(emm0), one);
+
+		const __m256 mask = _mm256_cmp_ps(x, _mm256_set1_ps(0.707106781186547524f), _CMP_LT_OQ);
+		const __m256 tmp = _mm256_and_ps(x, mask);
+		x = _mm256_sub_ps(x, one);
+		e = _mm256_sub_ps(e, _mm256_and_ps(one, mask));
+		x = _mm256_add_ps(x, tmp);
+
+		const __m256 z = _mm256_mul_ps(x, x);
+		__m256 y = _mm256_set1_ps(7.0376836292E-2f);
+		y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(-1.1514610310E-1f));
+		y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.1676998740E-1f));
+		y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(-1.2420140846E-1f));
+		y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.4249322787E-1f));
+		y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(-1.6668057665E-1f));
+		y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(2.0000714765E-1f));
+		y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(-2.4999993993E-1f));
+		y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(3.3333331174E-1f));
+		y = _mm256_mul_ps(_mm256_mul_ps(y, x), z);
+
+		y = _mm256_fmadd_ps(e, _mm256_set1_ps(-2.12194440e-4f), y);
+		y = _mm256_fnmadd_ps(z, _mm256_set1_ps(0.5f), y);
+		x = _mm256_add_ps(x, y);
+		x = _mm256_fmadd_ps(e, _mm256_set1_ps(0.693359375f), x);
+
+		x = _mm256_or_ps(x, invalid);
+		return _mm256_blendv_ps(x, _mm256_set1_ps(-HUGE_VALF), is_zero);
+	}
+
+	CXXENVI_TARGET("avx2,fma")
+	static inline __m256 atan2_ps256(__m256 y, __m256 x)
+	{
+		const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 ay = _mm256_andnot_ps(sign_mask, y);
+		const __m256 ax = _mm256_andnot_ps(sign_mask, x);
+		const __m256 both_zero = _mm256_and_ps(
+			_mm256_cmp_ps(ay, zero, _CMP_EQ_OQ), _mm256_cmp_ps(ax, zero, _CMP_EQ_OQ));
+
+		__m256 t = _mm256_div_ps(ay, ax);
+		const __m256 big = _mm256_cmp_ps(t, _mm256_set1_ps(2.414213562373095f), _CMP_GT_OQ);
+		const __m256 mid = _mm256_andnot_ps(big,
+			_mm256_cmp_ps(t, _mm256_set1_ps(0.4142135623730950f), _CMP_GT_OQ));
+		const __m256 one = _mm256_set1_ps(1.0f);
+		t = _mm256_blendv_ps(t, _mm256_div_ps(_mm256_sub_ps(t, one), _mm256_add_ps(t, one)), mid);
+		t = _mm256_blendv_ps(t, _mm256_div_ps(_mm256_set1_ps(-1.0f), t), big);
+		const __m256 y0 = _mm256_or_ps(
+			_mm256_and_ps(big, _mm256_set1_ps(1.5707963267948966f)),
+			_mm256_and_ps(mid, _mm256_set1_ps(0.7853981633974483f)));
+
+		const __m256 z = _mm256_mul_ps(t, t);
+		__m256 r = _mm256_set1_ps(8.05374449538e-2f);
+		r = _mm256_fmadd_ps(r, z, _mm256_set1_ps(-1.38776856032E-1f));
+		r = _mm256_fmadd_ps(r, z, _mm256_set1_ps(1.99777106478E-1f));
+		r = _mm256_fmadd_ps(r, z, _mm256_set1_ps(-3.33329491539E-1f));
+		r = _mm256_fmadd_ps(_mm256_mul_ps(r, z), t, t);
+		r = _mm256_add_ps(r, y0);
+		r = _mm256_andnot_ps(both_zero, r);
+
+		r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(3.14159265358979f), r), x);
+		return _mm256_or_ps(r, _mm256_and_ps(sign_mask, y));
+	}
+
+	template<ComplexReduction mode>
+	CXXENVI_TARGET("avx2,fma")
+	static inline __m256 reduce_ps256(__m256 re, __m256 im)
+	{
+		const __m256 pwr = _mm256_fmadd_ps(re, re, _mm256_mul_ps(im, im));
+		switch (mode) {
+		case MAGNITUDE: return _mm256_sqrt_ps(pwr);
+		case POWER:     return pwr;
+		case PHASE:     return atan2_ps256(im, re);
+		case POWER_DB:  return _mm256_mul_ps(log_ps256(pwr), _mm256_set1_ps(4.342944819032518f));
+		}
+		return pwr;
+	}
+
+	// Separate eight interleaved complex floats into their real and
+	// imaginary parts. The shuffles work within 128-bit lanes, so the
+	// 64-bit quarters have to be put back in order
+	CXXENVI_TARGET("avx2,fma")
+	static inline void split_ps256(float const* src, __m256 &re, __m256 &im)
+	{
+		const __m256 a = _mm256_loadu_ps(src);
+		const __m256 b = _mm256_loadu_ps(src + 8);
+		re = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(
+			_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0)));
+		im = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(
+			_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0)));
+	}
+
+	template<ComplexReduction mode>
+	CXXENVI_TARGET("avx2,fma")
+	static inline size_t
+	reduce_avx2(std::complex<float> const* in, float* out, size_t count)
+	{
+		float const* src = reinterpret_cast<float const*>(in);
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m256 re, im;
+			split_ps256(src + 2*i, re, im);
+			_mm256_storeu_ps(out + i, reduce_ps256<mode>(re, im));
+		}
+		return i;
+	}
+
+	template<ComplexReduction mode>
+	CXXENVI_TARGET("avx2,fma")
+	static inline size_t
+	reduce_avx2(std::complex<double> const* in, double* out, size_t count)
+	{
+		if (mode == PHASE || mode == POWER_DB)
+			return 0;
+		double const* src = reinterpret_cast<double const*>(in);
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			const __m256d a = _mm256_loadu_pd(src + 2*i);
+			const __m256d b = _mm256_loadu_pd(src + 2*i + 4);
+			const __m256d re = _mm256_permute4x64_pd(_mm256_unpacklo_pd(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+			const __m256d im = _mm256_permute4x64_pd(_mm256_unpackhi_pd(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+			__m256d pwr = _mm256_fmadd_pd(re, re, _mm256_mul_pd(im, im));
+			if (mode == MAGNITUDE)
+				pwr = _mm256_sqrt_pd(pwr);
+			_mm256_storeu_pd(out + i, pwr);
+		}
+		return i;
+	}
+
+	CXXENVI_TARGET("avx2,fma")
+	static inline size_t
+	deinterleave_avx2(std::complex<float> const* in, float* re, float* im, size_t count)
+	{
+		float const* src = reinterpret_cast<float const*>(in);
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m256 r, m;
+			split_ps256(src + 2*i, r, m);
+			_mm256_storeu_ps(re + i, r);
+			_mm256_storeu_ps(im + i, m);
+		}
+		return i;
+	}
+
+	CXXENVI_TARGET("avx2,fma")
+	static inline size_t
+	deinterleave_avx2(std::complex<double> const* in, double* re, double* im, size_t count)
+	{
+		double const* src = reinterpret_cast<double const*>(in);
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			const __m256d a = _mm256_loadu_pd(src + 2*i);
+			const __m256d b = _mm256_loadu_pd(src + 2*i + 4);
+			_mm256_storeu_pd(re + i, _mm256_permute4x64_pd(_mm256_unpacklo_pd(a, b), _MM_SHUFFLE(3, 1, 2, 0)));
+			_mm256_storeu_pd(im + i, _mm256_permute4x64_pd(_mm256_unpackhi_pd(a, b), _MM_SHUFFLE(3, 1, 2, 0)));
+		}
+		return i;
+	}
+
+	CXXENVI_TARGET("avx2,fma")
+	static inline size_t
+	interleave_avx2(float const* re, float const* im, std::complex<float>* out, size_t count)
+	{
+		float* dst = reinterpret_cast<float*>(out);
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			const __m256 r = _mm256_loadu_ps(re + i);
+			const __m256 m = _mm256_loadu_ps(im + i);
+			const __m256 lo = _mm256_unpacklo_ps(r, m);
+			const __m256 hi = _mm256_unpackhi_ps(r, m);
+			_mm256_storeu_ps(dst + 2*i, _mm256_permute2f128_ps(lo, hi, 0x20));
+			_mm256_storeu_ps(dst + 2*i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+		}
+		return i;
+	}
+
+	CXXENVI_TARGET("avx2,fma")
+	static inline size_t
+	interleave_avx2(double const* re, double const* im, std::complex<double>* out, size_t count)
+	{
+		double* dst = reinterpret_cast<double*>(out);
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			const __m256d r = _mm256_loadu_pd(re + i);
+			const __m256d m = _mm256_loadu_pd(im + i);
+			const __m256d lo = _mm256_unpacklo_pd(r, m);
+			const __m256d hi = _mm256_unpackhi_pd(r, m);
+			_mm256_storeu_pd(dst + 2*i, _mm256_permute2f128_pd(lo, hi, 0x20));
+			_mm256_storeu_pd(dst + 2*i + 4, _mm256_permute2f128_pd(lo, hi, 0x31));
+		}
+		return i;
+	}
+#endif
+
+	template<ComplexReduction mode, typename T>
+	static inline void
+	reduce_mode(std::complex<T> const* in, T* out, size_t count)
+	{
+		size_t i = 0;
+		switch (simd_level()) {
+#if CXXENVI_DISPATCH
+		case SIMD_AVX2:
+		case SIMD_AVX512:
+			i = reduce_avx2<mode>(in, out, count);
+			break;
+#endif
+#if CXXENVI_SSE2
+		case SIMD_SSE2:
+		case SIMD_SSE41:
+			i = reduce_sse2<mode>(in, out, count);
+			break;
+#endif
+		default:
+			break;
+		}
+		reduce_scalar<mode>(in + i, out + i, count - i);
+	}
+
+	// Vectorized (de)interleaving for the best available instruction set,
+	// returning the number of samples processed
+#if CXXENVI_SSE2
+	template<typename T>
+	static inline size_t
+	deinterleave_simd(std::complex<T> const* in, T* re, T* im, size_t count)
+	{
+		switch (simd_level()) {
+#if CXXENVI_DISPATCH
+		case SIMD_AVX2:
+		case SIMD_AVX512:
+			return deinterleave_avx2(in, re, im, count);
+#endif
+		case SIMD_SSE2:
+		case SIMD_SSE41:
+			return deinterleave_sse2(in, re, im, count);
+		default:
+			return 0;
+		}
+	}
+
+	template<typename T>
+	static inline size_t
+	interleave_simd(T const* re, T const* im, std::complex<T>* out, size_t count)
+	{
+		switch (simd_level()) {
+#if CXXENVI_DISPATCH
+		case SIMD_AVX2:
+		case SIMD_AVX512:
+			return interleave_avx2(re, im, out, count);
+#endif
+		case SIMD_SSE2:
+		case SIMD_SSE41:
+			return interleave_sse2(re, im, out, count);
+		default:
+			return 0;
+		}
+	}
+#else
+	template<typename T>
+	static inline size_t
+	deinterleave_simd(std::complex<T> const* /* in */, T* /* re */, T* /* im */, size_t /* count */)
+	{ return 0; }
+
+	template<typename T>
+	static inline size_t
+	interleave_simd(T const* /* re */, T const* /* im */, std::complex<T>* /* out */, size_t /* count */)
+	{ return 0; }
+#endif
+#endif
+
+	// Byte swapping of count elements of the given width (in bytes).
+	// The compilers recognize these shift patterns as bswap instructions
+	static inline uint16_t bswap(uint16_t v)
+	{ return uint16_t((v >> 8) | (v << 8)); }
+
+	static inline uint32_t bswap(uint32_t v)
+	{
+		return (v >> 24) | ((v >> 8) & 0x0000ff00u) |
+			((v << 8) & 0x00ff0000u) | (v << 24);
+	}
+
+	static inline uint64_t bswap(uint64_t v)
+	{ return (uint64_t(bswap(uint32_t(v))) << 32) | bswap(uint32_t(v >> 32)); }
+
+	template<typename U>
+	static inline void
+	swap_bytes_scalar(uint8_t* data, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i, data += sizeof(U)) {
+			U v;
+			std::memcpy(&v, data, sizeof(U));
+			v = bswap(v);
+			std::memcpy(data, &v, sizeof(U));
+		}
+	}
+
+	static inline void
+	swap_bytes_scalar(uint8_t* data, size_t count, size_t width)
+	{
+		switch (width) {
+		case 2: return swap_bytes_scalar<uint16_t>(data, count);
+		case 4: return swap_bytes_scalar<uint32_t>(data, count);
+		case 8: return swap_bytes_scalar<uint64_t>(data, count);
+		default:
+			for (size_t i = 0; i < count; ++i, data += width)
+				std::reverse(data, data + width);
+		}
+	}
+
+#if CXXENVI_SSE2
+	// SSE2 has no byte shuffle, but 16-bit swaps can be done with shifts
+	static inline size_t
+	swap_bytes_sse2(uint8_t* data, size_t count, size_t width)
+	{
+		if (width != 2)
+			return 0;
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m128i* ptr = reinterpret_cast<__m128i*>(data + 2*i);
+			const __m128i v = _mm_loadu_si128(ptr);
+			_mm_storeu_si128(ptr, _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+		}
+		return i;
+	}
+#endif
+
+#if CXXENVI_DISPATCH
+	// Shuffle control reversing the bytes of each element of the given
+	// width in a 128-bit lane
+	CXXENVI_TARGET("ssse3")
+	static inline __m128i swap_mask(size_t width)
+	{
+		switch (width) {
+		case 2: return _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+		case 4: return _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+		default: return _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+		}
+	}
+
+	CXXENVI_TARGET("ssse3")
+	static inline size_t
+	swap_bytes_ssse3(uint8_t* data, size_t count, size_t width)
+	{
+		const __m128i mask = swap_mask(width);
+		const size_t per_vec = 16/width;
+		size_t i = 0;
+		for (; i + per_vec <= count; i += per_vec) {
+			__m128i* ptr = reinterpret_cast<__m128i*>(data + width*i);
+			_mm_storeu_si128(ptr, _mm_shuffle_epi8(_mm_loadu_si128(ptr), mask));
+		}
+		return i;
+	}
+
+	CXXENVI_TARGET("avx2,fma")
+	static inline size_t
+	swap_bytes_avx2(uint8_t* data, size_t count, size_t width)
+	{
+		const __m256i mask = _mm256_broadcastsi128_si256(swap_mask(width));
+		const size_t per_vec = 32/width;
+		size_t i = 0;
+		for (; i + per_vec <= count; i += per_vec) {
+			__m256i* ptr = reinterpret_cast<__m256i*>(data + width*i);
+			_mm256_storeu_si256(ptr, _mm256_shuffle_epi8(_mm256_loadu_si256(ptr), mask));
+		}
+		return i;
+	}
+
+	CXXENVI_TARGET("avx512f,avx512bw")
+	static inline size_t
+	swap_bytes_avx512(uint8_t* data, size_t count, size_t width)
+	{
+		const __m512i mask = _mm512_broadcast_i32x4(swap_mask(width));
+		const size_t per_vec = 64/width;
+		size_t i = 0;
+		for (; i + per_vec <= count; i += per_vec) {
+			void* ptr = data + width*i;
+			_mm512_storeu_si512(ptr, _mm512_shuffle_epi8(_mm512_loadu_si512(ptr), mask));
+		}
+		return i;
+	}
+#endif
+
+	// Reverse the byte order of count elements of the given width,
+	// with the best available instruction set
+	static void swap_bytes(uint8_t* data, size_t count, size_t width);
+
+	// Accumulation of float samples into double sums, for the spectral
+	// engines: acc[i] += w*x[i] (multiply_add) and acc[i] += (x[i] - t)^2
+	// (square_distance_add). The SIMD versions return the number of
+	// samples they processed
+	template<bool distance>
+	static inline void
+	accumulate_scalar(float const* x, double w, double* acc, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i) {
+			const double d = distance ? x[i] - w : x[i];
+			acc[i] += distance ? d*d : w*d;
+		}
+	}
+
+#if CXXENVI_SSE2
+	template<bool distance>
+	static inline size_t
+	accumulate_sse2(float const* x, double w, double* acc, size_t count)
+	{
+		const __m128d vw = _mm_set1_pd(w);
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			const __m128 v = _mm_loadu_ps(x + i);
+			__m128d lo = _mm_cvtps_pd(v);
+			__m128d hi = _mm_cvtps_pd(_mm_movehl_ps(v, v));
+			if (distance) {
+				lo = _mm_sub_pd(lo, vw);
+				hi = _mm_sub_pd(hi, vw);
+				lo = _mm_mul_pd(lo, lo);
+				hi = _mm_mul_pd(hi, hi);
+			} else {
+				lo = _mm_mul_pd(lo, vw);
+				hi = _mm_mul_pd(hi, vw);
+			}
+			_mm_storeu_pd(acc + i, _mm_add_pd(_mm_loadu_pd(acc + i), lo));
+			_mm_storeu_pd(acc + i + 2, _mm_add_pd(_mm_loadu_pd(acc + i + 2), hi));
+		}
+		return i;
+	}
+#endif
+
+#if CXXENVI_DISPATCH
+	CXXENVI_TARGET("avx2,fma")
+	static inline size_t
+	accumulate_avx2(float const* x, double w, double* acc, size_t count, bool distance)
+	{
+		const __m256d vw = _mm256_set1_pd(w);
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			const __m256 v = _mm256_loadu_ps(x + i);
+			__m256d lo = _mm256_cvtps_pd(_mm256_castps256_ps128(v));
+			__m256d hi = _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1));
+			__m256d alo = _mm256_loadu_pd(acc + i), ahi = _mm256_loadu_pd(acc + i + 4);
+			if (distance) {
+				lo = _mm256_sub_pd(lo, vw);
+				hi = _mm256_sub_pd(hi, vw);
+				alo = _mm256_fmadd_pd(lo, lo, alo);
+				ahi = _mm256_fmadd_pd(hi, hi, ahi);
+			} else {
+				alo = _mm256_fmadd_pd(lo, vw, alo);
+				ahi = _mm256_fmadd_pd(hi, vw, ahi);
+			}
+			_mm256_storeu_pd(acc + i, alo);
+			_mm256_storeu_pd(acc + i + 4, ahi);
+		}
+		return i;
+	}
+
+	CXXENVI_TARGET("avx512f")
+	static inline size_t
+	accumulate_avx512(float const* x, double w, double* acc, size_t count, bool distance)
+	{
+		const __m512d vw = _mm512_set1_pd(w);
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			const __m512 v = _mm512_loadu_ps(x + i);
+			__m512d lo = _mm512_cvtps_pd(_mm512_castps512_ps256(v));
+			__m512d hi = _mm512_cvtps_pd(_mm256_castpd_ps(
+				_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1)));
+			__m512d alo = _mm512_loadu_pd(acc + i), ahi = _mm512_loadu_pd(acc + i + 8);
+			if (distance) {
+				lo = _mm512_sub_pd(lo, vw);
+				hi = _mm512_sub_pd(hi, vw);
+				alo = _mm512_fmadd_pd(lo, lo, alo);
+				ahi = _mm512_fmadd_pd(hi, hi, ahi);
+			} else {
+				alo = _mm512_fmadd_pd(lo, vw, alo);
+				ahi = _mm512_fmadd_pd(hi, vw, ahi);
+			}
+			_mm512_storeu_pd(acc + i, alo);
+			_mm512_storeu_pd(acc + i + 8, ahi);
+		}
+		return i;
+	}
+#endif
+
+	template<bool distance>
+	static inline void
+	accumulate(float const* x, double w, double* acc, size_t count)
+	{
+		size_t i = 0;
+		switch (simd_level()) {
+#if CXXENVI_DISPATCH
+		case SIMD_AVX512: i = accumulate_avx512(x, w, acc, count, distance); break;
+		case SIMD_AVX2:   i = accumulate_avx2(x, w, acc, count, distance); break;
+#endif
+#if CXXENVI_SSE2
+		case SIMD_SSE41:
+		case SIMD_SSE2:   i = accumulate_sse2<distance>(x, w, acc, count); break;
+#endif
+		default: break;
+		}
+		accumulate_scalar<distance>(x + i, w, acc + i, count - i);
+	}
+
+	// Running sums of a line of float samples, in double precision:
+	// out[i] = x[0] + ... + x[i]. The SIMD versions add pairs within a
+	// vector first (so the last bits differ from the scalar order), and
+	// return the number of samples processed and the sum so far in carry
+	static inline void
+	prefix_sum_scalar(float const* x, double* out, size_t count, double carry)
+	{
+		for (size_t i = 0; i < count; ++i)
+			out[i] = carry += x[i];
+	}
+
+#if CXXENVI_SSE2
+	static inline size_t
+	prefix_sum_sse2(float const* x, double* out, size_t count, double& carry)
+	{
+		const __m128d zero = _mm_setzero_pd();
+		__m128d c = _mm_set1_pd(carry);
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			const __m128 v = _mm_loadu_ps(x + i);
+			__m128d lo = _mm_cvtps_pd(v);
+			__m128d hi = _mm_cvtps_pd(_mm_movehl_ps(v, v));
+			lo = _mm_add_pd(_mm_add_pd(lo, _mm_unpacklo_pd(zero, lo)), c);
+			c = _mm_unpackhi_pd(lo, lo);
+			hi = _mm_add_pd(_mm_add_pd(hi, _mm_unpacklo_pd(zero, hi)), c);
+			c = _mm_unpackhi_pd(hi, hi);
+			_mm_storeu_pd(out + i, lo);
+			_mm_storeu_pd(out + i + 2, hi);
+		}
+		carry = _mm_cvtsd_f64(c);
+		return i;
+	}
+#endif
+
+#if CXXENVI_DISPATCH
+	CXXENVI_TARGET("avx2,fma")
+	static inline size_t
+	prefix_sum_avx2(float const* x, double* out, size_t count, double& carry)
+	{
+		const __m256d zero = _mm256_setzero_pd();
+		__m256d c = _mm256_set1_pd(carry);
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			__m256d v = _mm256_cvtps_pd(_mm_loadu_ps(x + i));
+			// (a, b, c, d) + (0, a, b, c) + (0, 0, a, a + b)
+			v = _mm256_add_pd(v, _mm256_blend_pd(
+				_mm256_permute4x64_pd(v, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x1));
+			v = _mm256_add_pd(v, _mm256_blend_pd(
+				_mm256_permute4x64_pd(v, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x3));
+			v = _mm256_add_pd(v, c);
+			c = _mm256_permute4x64_pd(v, _MM_SHUFFLE(3, 3, 3, 3));
+			_mm256_storeu_pd(out + i, v);
+		}
+		carry = _mm_cvtsd_f64(_mm256_castpd256_pd128(c));
+		return i;
+	}
+#endif
+
+	// Linear stretch of float samples to bytes, (x[i] - lo)*scale rounded
+	// and clamped to [0, 255], with NaNs going to 0. The SIMD versions
+	// return the number of samples they processed
+	static inline void
+	stretch_scalar(float const* x, float lo, float scale, uint8_t* out, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i) {
+			const float v = (x[i] - lo)*scale;
+			out[i] = v > 0 ? (v < 255 ? uint8_t(std::lrint(v)) : 255) : 0;
+		}
+	}
+
+#if CXXENVI_SSE2
+	static inline size_t
+	stretch_sse2(float const* x, float lo, float scale, uint8_t* out, size_t count)
+	{
+		const __m128 vlo = _mm_set1_ps(lo), vscale = _mm_set1_ps(scale);
+		const __m128 zero = _mm_setzero_ps(), top = _mm_set1_ps(255);
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			__m128i q[4];
+			for (size_t k = 0; k < 4; ++k) {
+				const __m128 v = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(x + i + 4*k), vlo), vscale);
+				// max gives its second operand for NaNs
+				q[k] = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(v, zero), top));
+			}
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(
+				_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3])));
+		}
+		return i;
+	}
+#endif
+
+#if CXXENVI_DISPATCH
+	CXXENVI_TARGET("avx2,fma")
+	static inline size_t
+	stretch_avx2(float const* x, float lo, float scale, uint8_t* out, size_t count)
+	{
+		const __m256 vlo = _mm256_set1_ps(lo), vscale = _mm256_set1_ps(scale);
+		const __m256 zero = _mm256_setzero_ps(), top = _mm256_set1_ps(255);
+		// the packs work within 128-bit lanes, this puts the groups of
+		// four bytes back in order
+		const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+		size_t i = 0;
+		for (; i + 32 <= count; i += 32) {
+			__m256i q[4];
+			for (size_t k = 0; k < 4; ++k) {
+				const __m256 v = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x + i + 8*k), vlo), vscale);
+				q[k] = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(v, zero), top));
+			}
+			const __m256i packed = _mm256_packus_epi16(
+				_mm256_packs_epi32(q[0], q[1]), _mm256_packs_epi32(q[2], q[3]));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+				_mm256_permutevar8x32_epi32(packed, order));
+		}
+		return i;
+	}
+#endif
+
+	// Affine transform of count points, x = c[0] + c[1]*u + c[2]*v and
+	// y = c[3] + c[4]*u + c[5]*v. The SIMD versions return the number of
+	// points they processed
+	static inline void
+	affine_scalar(double const* u, double const* v, double const* c,
+		double* x, double* y, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i) {
+			const double a = u[i], b = v[i];
+			x[i] = c[0] + c[1]*a + c[2]*b;
+			y[i] = c[3] + c[4]*a + c[5]*b;
+		}
+	}
+
+#if CXXENVI_SSE2
+	static inline size_t
+	affine_sse2(double const* u, double const* v, double const* c,
+		double* x, double* y, size_t count)
+	{
+		const __m128d c0 = _mm_set1_pd(c[0]), c1 = _mm_set1_pd(c[1]), c2 = _mm_set1_pd(c[2]);
+		const __m128d c3 = _mm_set1_pd(c[3]), c4 = _mm_set1_pd(c[4]), c5 = _mm_set1_pd(c[5]);
+		size_t i = 0;
+		for (; i + 2 <= count; i += 2) {
+			const __m128d a = _mm_loadu_pd(u + i), b = _mm_loadu_pd(v + i);
+			_mm_storeu_pd(x + i, _mm_add_pd(_mm_add_pd(c0, _mm_mul_pd(c1, a)), _mm_mul_pd(c2, b)));
+			_mm_storeu_pd(y + i, _mm_add_pd(_mm_add_pd(c3, _mm_mul_pd(c4, a)), _mm_mul_pd(c5, b)));
+		}
+		return i;
+	}
+#endif
+
+#if CXXENVI_DISPATCH
+	CXXENVI_TARGET("avx2,fma")
+	static inline size_t
+	affine_avx2(double const* u, double const* v, double const* c,
+		double* x, double* y, size_t count)
+	{
+		const __m256d c0 = _mm256_set1_pd(c[0]), c1 = _mm256_set1_pd(c[1]), c2 = _mm256_set1_pd(c[2]);
+		const __m256d c3 = _mm256_set1_pd(c[3]), c4 = _mm256_set1_pd(c[4]), c5 = _mm256_set1_pd(c[5]);
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			const __m256d a = _mm256_loadu_pd(u + i), b = _mm256_loadu_pd(v + i);
+			_mm256_storeu_pd(x + i, _mm256_fmadd_pd(c2, b, _mm256_fmadd_pd(c1, a, c0)));
+			_mm256_storeu_pd(y + i, _mm256_fmadd_pd(c5, b, _mm256_fmadd_pd(c4, a, c3)));
+		}
+		return i;
+	}
+#endif
+
+	// CRC-32C tables for slicing by 8: table[0] is the bytewise one,
+	// table[k] advances a byte through k more zero bytes
+	struct Crc32cTable
+	{
+		uint32_t table[8][256];
+
+		Crc32cTable()
+		{
+			for (uint32_t i = 0; i < 256; ++i) {
+				uint32_t c = i;
+				for (int k = 0; k < 8; ++k)
+					c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+				table[0][i] = c;
+			}
+			for (int t = 1; t < 8; ++t)
+				for (uint32_t i = 0; i < 256; ++i)
+					table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xFF];
+		}
+	};
+
+	// Update the (inverted) CRC-32C state crc with count bytes
+	static inline uint32_t
+	crc32c_scalar(uint32_t crc, uint8_t const* data, size_t count)
+	{
+		static const Crc32cTable tables;
+		auto const& t = tables.table;
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			const uint32_t lo = crc ^ (uint32_t(data[i]) | uint32_t(data[i + 1]) << 8 |
+				uint32_t(data[i + 2]) << 16 | uint32_t(data[i + 3]) << 24);
+			crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^
+				t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+				t[3][data[i + 4]] ^ t[2][data[i + 5]] ^
+				t[1][data[i + 6]] ^ t[0][data[i + 7]];
+		}
+		for (; i < count; ++i)
+			crc = (crc >> 8) ^ t[0][(crc ^ data[i]) & 0xFF];
+		return crc;
+	}
+
+#if CXXENVI_DISPATCH
+	// The crc32 instruction comes with SSE4.2, which not all the
+	// SSE4.1 processors have
+	static inline bool has_sse42()
+	{
+		static const bool supported = __builtin_cpu_supports("sse4.2");
+		return supported;
+	}
+
+	CXXENVI_TARGET("sse4.2")
+	static inline size_t
+	crc32c_sse42(uint32_t& crc, uint8_t const* data, size_t count)
+	{
+		size_t i = 0;
+#if defined(__x86_64__)
+		uint64_t c = crc;
+		for (; i + 8 <= count; i += 8) {
+			uint64_t word;
+			std::memcpy(&word, data + i, 8);
+			c = _mm_crc32_u64(c, word);
+		}
+		crc = uint32_t(c);
+#endif
+		for (; i + 4 <= count; i += 4) {
+			uint32_t word;
+			std::memcpy(&word, data + i, 4);
+			crc = _mm_crc32_u32(crc, word);
+		}
+		return i;
+	}
+#endif
+
+	// Comparison of count samples of a and b: a mismatch is a pair with
+	// |a - b| > atol + rtol*|b|, with only one NaN, or with an infinite
+	// |a - b| (different infinities, or one of them and a finite value,
+	// whatever the tolerance: 0*inf is NaN). The largest |a - b|
+	// (NaNs aside) goes into max_error, and the differences a - b (over
+	// |b| if relative) into diff unless it is null. The SIMD versions
+	// return the number of samples processed and add up mismatches
+	static inline size_t
+	compare_scalar(float const* a, float const* b, float atol, float rtol,
+		float* diff, bool relative, size_t count, float& max_error)
+	{
+		size_t mismatches = 0;
+		for (size_t i = 0; i < count; ++i) {
+			const float d = a[i] - b[i], e = std::fabs(d);
+			const bool nan_a = a[i] != a[i], nan_b = b[i] != b[i];
+			mismatches += (e > atol + rtol*std::fabs(b[i])) |
+				(e == std::numeric_limits<float>::infinity()) | (nan_a != nan_b);
+			max_error = e > max_error ? e : max_error;
+			if (diff)
+				diff[i] = relative ? d/std::fabs(b[i]) : d;
+		}
+		return mismatches;
+	}
+
+#if CXXENVI_SSE2
+	static inline size_t
+	compare_sse2(float const* a, float const* b, float atol, float rtol,
+		float* diff, bool relative, size_t count, float& max_error, size_t& mismatches)
+	{
+		const __m128 sign = _mm_set1_ps(-0.0f), vatol = _mm_set1_ps(atol), vrtol = _mm_set1_ps(rtol);
+		const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+		__m128 vmax = _mm_set1_ps(max_error);
+		__m128i counts = _mm_setzero_si128();
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			const __m128 va = _mm_loadu_ps(a + i), vb = _mm_loadu_ps(b + i);
+			const __m128 d = _mm_sub_ps(va, vb), e = _mm_andnot_ps(sign, d);
+			const __m128 abs_b = _mm_andnot_ps(sign, vb);
+			const __m128 bad = _mm_or_ps(_mm_or_ps(
+				_mm_cmpgt_ps(e, _mm_add_ps(vatol, _mm_mul_ps(vrtol, abs_b))),
+				_mm_cmpeq_ps(e, inf)),
+				_mm_xor_ps(_mm_cmpunord_ps(va, va), _mm_cmpunord_ps(vb, vb)));
+			// the masks are -1 where set
+			counts = _mm_sub_epi32(counts, _mm_castps_si128(bad));
+			// max gives its second operand for NaNs
+			vmax = _mm_max_ps(e, vmax);
+			if (diff)
+				_mm_storeu_ps(diff + i, relative ? _mm_div_ps(d, abs_b) : d);
+		}
+		float lanes[4];
+		_mm_storeu_ps(lanes, vmax);
+		uint32_t sums[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(sums), counts);
+		for (size_t k = 0; k < 4; ++k) {
+			max_error = std::max(max_error, lanes[k]);
+			mismatches += sums[k];
+		}
+		return i;
+	}
+#endif
+
+#if CXXENVI_DISPATCH
+	CXXENVI_TARGET("avx2,fma")
+	static inline size_t
+	compare_avx2(float const* a, float const* b, float atol, float rtol,
+		float* diff, bool relative, size_t count, float& max_error, size_t& mismatches)
+	{
+		const __m256 sign = _mm256_set1_ps(-0.0f), vatol = _mm256_set1_ps(atol), vrtol = _mm256_set1_ps(rtol);
+		const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+		__m256 vmax = _mm256_set1_ps(max_error);
+		__m256i counts = _mm256_setzero_si256();
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			const __m256 va = _mm256_loadu_ps(a + i), vb = _mm256_loadu_ps(b + i);
+			const __m256 d = _mm256_sub_ps(va, vb), e = _mm256_andnot_ps(sign, d);
+			const __m256 abs_b = _mm256_andnot_ps(sign, vb);
+			const __m256 bad = _mm256_or_ps(_mm256_or_ps(
+				_mm256_cmp_ps(e, _mm256_fmadd_ps(vrtol, abs_b, vatol), _CMP_GT_OQ),
+				_mm256_cmp_ps(e, inf, _CMP_EQ_OQ)),
+				_mm256_xor_ps(_mm256_cmp_ps(va, va, _CMP_UNORD_Q), _mm256_cmp_ps(vb, vb, _CMP_UNORD_Q)));
+			counts = _mm256_sub_epi32(counts, _mm256_castps_si256(bad));
+			vmax = _mm256_max_ps(e, vmax);
+			if (diff)
+				_mm256_storeu_ps(diff + i, relative ? _mm256_div_ps(d, abs_b) : d);
+		}
+		float lanes[8];
+		_mm256_storeu_ps(lanes, vmax);
+		uint32_t sums[8];
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(sums), counts);
+		for (size_t k = 0; k < 8; ++k) {
+			max_error = std::max(max_error, lanes[k]);
+			mismatches += sums[k];
+		}
+		return i;
+	}
+#endif
+
+	// The scalar component of a sample: byte order applies to the
+	// real and imaginary parts of complex samples separately
+	template<typename T>
+	struct component
+	{ typedef T type; };
+
+#if CXXENVI_COMPLEX
+	template<typename T>
+	struct component<std::complex<T>>
+	{ typedef T type; };
+#endif
+
+public:
+	// Convert count samples from in to out, with the same semantics
+	// as the assignment out[i] = in[i]
+	template<typename In, typename Out>
+	static inline void
+	convert(In const* in, Out* out, size_t count)
+	{
+		convert_impl(in, out, count,
+			std::integral_constant<bool, std::is_assignable<Out&, In const&>::value>());
+	}
+
+	// Convert count samples from in to out, using the given policy for
+	// conversions to integer types
+	template<typename In, typename Out>
+	static inline void
+	convert(In const* in, Out* out, size_t count, ConversionPolicy policy)
+	{
+		convert_dispatch(in, out, count, policy, policy_applies<In, Out>());
+	}
+
+	// acc[i] += w*x[i] for count samples. With FMA, the products are
+	// not rounded, so the last bits depend on the instruction set
+	static void multiply_add(float const* x, double w, double* acc, size_t count);
+
+	// acc[i] += (x[i] - t)^2 for count samples
+	static void square_distance_add(float const* x, double t, double* acc, size_t count);
+
+	// Running sums of count samples, out[i] = x[0] + ... + x[i]
+	static void prefix_sum(float const* x, double* out, size_t count);
+
+	// Compare count samples of a and b, returning the number of pairs
+	// with |a - b| > atol + rtol*|b|, a single NaN or an infinite
+	// difference (e.g. a finite a and an infinite b), and raising
+	// max_error to the largest |a - b|. The differences a - b, or
+	// (a - b)/|b| if relative, go to diff unless it is null. With FMA,
+	// the tolerance is not rounded before the comparison
+	static size_t compare(float const* a, float const* b, float atol, float rtol,
+		float* diff, bool relative, size_t count, float& max_error);
+
+	// Update the CRC-32C (Castagnoli) checksum crc, 0 to start, with
+	// count bytes, using the crc32 instruction where available
+	static uint32_t crc32c(uint32_t crc, void const* data, size_t count);
+
+	// Affine transform of count points (u, v) to (x, y), with
+	// x = c[0] + c[1]*u + c[2]*v and y = c[3] + c[4]*u + c[5]*v
+	static void affine(double const* u, double const* v, double const* c,
+		double* x, double* y, size_t count);
+
+	// Stretch count samples linearly to bytes, out[i] = (x[i] - lo)*scale
+	// rounded and clamped to [0, 255]; NaNs give 0
+	static void stretch(float const* x, float lo, float scale, uint8_t* out, size_t count);
+
+	// Reverse the byte order of count samples
+	template<typename T>
+	static inline void
+	byteswap(T* data, size_t count)
+	{
+		typedef typename component<T>::type C;
+		swap_bytes(reinterpret_cast<uint8_t*>(data), count*(sizeof(T)/sizeof(C)), sizeof(C));
+	}
+
+#if CXXENVI_COMPLEX
+	// Reduce count complex samples from in to real values in out
+	static void reduce(std::complex<float> const* in, float* out, size_t count, ComplexReduction mode);
+	static void reduce(std::complex<double> const* in, double* out, size_t count, ComplexReduction mode);
+
+	// Split count interleaved complex samples into separate (planar)
+	// real and imaginary parts
+	template<typename T, typename Out>
+	static inline void
+	deinterleave(std::complex<T> const* in, Out* re, Out* im, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i) {
+			re[i] = in[i].real();
+			im[i] = in[i].imag();
+		}
+	}
+
+	static void deinterleave(std::complex<float> const* in, float* re, float* im, size_t count);
+	static void deinterleave(std::complex<double> const* in, double* re, double* im, size_t count);
+
+	// Merge count planar real and imaginary parts into interleaved
+	// complex samples
+	template<typename In, typename T>
+	static inline void
+	interleave(In const* re, In const* im, std::complex<T>* out, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i)
+			out[i] = std::complex<T>(re[i], im[i]);
+	}
+
+	static void interleave(float const* re, float const* im, std::complex<float>* out, size_t count);
+	static void interleave(double const* re, double const* im, std::complex<double>* out, size_t count);
+#endif
+};
+
+/*
+ * Kernel entry points: these are compiled once in the library
+ */
+
+#if CXXENVI_DEFINITIONS
+#if CXXENVI_SSE2
+#define CXXENVI_CONVERT_HEAD(Out) \
+	CXXENVI_INLINE size_t \
+	ENVI::Kernels::convert_head(float const* in, Out* out, size_t count, ConversionPolicy policy) \
+	{ return convert_float(in, out, count, policy); }
+
+CXXENVI_CONVERT_HEAD(int8_t)
+CXXENVI_CONVERT_HEAD(int16_t)
+CXXENVI_CONVERT_HEAD(uint16_t)
+CXXENVI_CONVERT_HEAD(int32_t)
+
+#undef CXXENVI_CONVERT_HEAD
+#endif
+
+CXXENVI_INLINE void
+ENVI::Kernels::swap_bytes(uint8_t* data, size_t count, size_t width)
+{
+	if (width < 2)
+		return;
+	size_t i = 0;
+	switch (simd_level()) {
+#if CXXENVI_DISPATCH
+	case SIMD_AVX512: i = swap_bytes_avx512(data, count, width); break;
+	case SIMD_AVX2:   i = swap_bytes_avx2(data, count, width); break;
+	case SIMD_SSE41:  i = swap_bytes_ssse3(data, count, width); break;
+#endif
+#if CXXENVI_SSE2
+	case SIMD_SSE2:   i = swap_bytes_sse2(data, count, width); break;
+#endif
+	default: break;
+	}
+	swap_bytes_scalar(data + i*width, count - i, width);
+}
+
+CXXENVI_INLINE void
+ENVI::Kernels::multiply_add(float const* x, double w, double* acc, size_t count)
+{
+	accumulate<false>(x, w, acc, count);
+}
+
+CXXENVI_INLINE void
+ENVI::Kernels::square_distance_add(float const* x, double t, double* acc, size_t count)
+{
+	accumulate<true>(x, t, acc, count);
+}
+
+CXXENVI_INLINE void
+ENVI::Kernels::prefix_sum(float const* x, double* out, size_t count)
+{
+	double carry = 0;
+	size_t i = 0;
+	switch (simd_level()) {
+#if CXXENVI_DISPATCH
+	case SIMD_AVX512:
+	case SIMD_AVX2:   i = prefix_sum_avx2(x, out, count, carry); break;
+#endif
+#if CXXENVI_SSE2
+	case SIMD_SSE41:
+	case SIMD_SSE2:   i = prefix_sum_sse2(x, out, count, carry); break;
+#endif
+	default: break;
+	}
+	prefix_sum_scalar(x + i, out + i, count - i, carry);
+}
+
+CXXENVI_INLINE void
+ENVI::Kernels::stretch(float const* x, float lo, float scale, uint8_t* out, size_t count)
+{
+	size_t i = 0;
+	switch (simd_level()) {
+#if CXXENVI_DISPATCH
+	case SIMD_AVX512:
+	case SIMD_AVX2:   i = stretch_avx2(x, lo, scale, out, count); break;
+#endif
+#if CXXENVI_SSE2
+	case SIMD_SSE41:
+	case SIMD_SSE2:   i = stretch_sse2(x, lo, scale, out, count); break;
+#endif
+	default: break;
+	}
+	stretch_scalar(x + i, lo, scale, out + i, count - i);
+}
+
+CXXENVI_INLINE uint32_t
+ENVI::Kernels::crc32c(uint32_t crc, void const* data, size_t count)
+{
+	uint8_t const* bytes = static_cast<uint8_t const*>(data);
+	size_t i = 0;
+	crc = ~crc;
+	switch (simd_level()) {
+#if CXXENVI_DISPATCH
+	case SIMD_AVX512:
+	case SIMD_AVX2:
+	case SIMD_SSE41:
+		if (has_sse42())
+			i = crc32c_sse42(crc, bytes, count);
+		break;
+#endif
+	default: break;
+	}
+	return ~crc32c_scalar(crc, bytes + i, count - i);
+}
+
+CXXENVI_INLINE size_t
+ENVI::Kernels::compare(float const* a, float const* b, float atol, float rtol,
+	float* diff, bool relative, size_t count, float& max_error)
+{
+	size_t i = 0, mismatches = 0;
+	switch (simd_level()) {
+#if CXXENVI_DISPATCH
+	case SIMD_AVX512:
+	case SIMD_AVX2:
+		i = compare_avx2(a, b, atol, rtol, diff, relative, count, max_error, mismatches);
+		break;
+#endif
+#if CXXENVI_SSE2
+	case SIMD_SSE41:
+	case SIMD_SSE2:
+		i = compare_sse2(a, b, atol, rtol, diff, relative, count, max_error, mismatches);
+		break;
+#endif
+	default: break;
+	}
+	return mismatches + compare_scalar(a + i, b + i, atol, rtol,
+		diff ? diff + i : diff, relative, count - i, max_error);
+}
+
+CXXENVI_INLINE void
+ENVI::Kernels::affine(double const* u, double const* v, double const* c,
+	double* x, double* y, size_t count)
+{
+	size_t i = 0;
+	switch (simd_level()) {
+#if CXXENVI_DISPATCH
+	case SIMD_AVX512:
+	case SIMD_AVX2:   i = affine_avx2(u, v, c, x, y, count); break;
+#endif
+#if CXXENVI_SSE2
+	case SIMD_SSE41:
+	case SIMD_SSE2:   i = affine_sse2(u, v, c, x, y, count); break;
+#endif
+	default: break;
+	}
+	affine_scalar(u + i, v + i, c, x + i, y + i, count - i);
+}
+
+#if CXXENVI_COMPLEX
+#define CXXENVI_COMPLEX_KERNELS(T) \
+	CXXENVI_INLINE void \
+	ENVI::Kernels::reduce(std::complex<T> const* in, T* out, size_t count, ComplexReduction mode) \
+	{ \
+		switch (mode) { \
+		case MAGNITUDE: return reduce_mode<MAGNITUDE>(in, out, count); \
+		case POWER:     return reduce_mode<POWER>(in, out, count); \
+		case PHASE:     return reduce_mode<PHASE>(in, out, count); \
+		case POWER_DB:  return reduce_mode<POWER_DB>(in, out, count); \
+		} \
+		raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("unknown complex reduction")); \
+	} \
+	\
+	CXXENVI_INLINE void \
+	ENVI::Kernels::deinterleave(std::complex<T> const* in, T* re, T* im, size_t count) \
+	{ \
+		const size_t i = deinterleave_simd(in, re, im, count); \
+		deinterleave<T, T>(in + i, re + i, im + i, count - i); \
+	} \
+	\
+	CXXENVI_INLINE void \
+	ENVI::Kernels::interleave(T const* re, T const* im, std::complex<T>* out, size_t count) \
+	{ \
+		const size_t i = interleave_simd(re, im, out, count); \
+		interleave<T, T>(re + i, im + i, out + i, count - i); \
+	}
+
+CXXENVI_COMPLEX_KERNELS(float)
+CXXENVI_COMPLEX_KERNELS(double)
+
+#undef CXXENVI_COMPLEX_KERNELS
+#endif
+#endif // CXXENVI_DEFINITIONS
+#if CXXENVI_DISPATCH && defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+
+// The 'map info' of a header: the map coordinates of a reference pixel,
+// the pixel size and the rotation of the image (counterclockwise, in
+// degrees). Pixel coordinates are (sample, line) with (0, 0) at the upper
+// left corner of the first pixel, so pixel centres are at .5; the
+// reference pixel is 1-based, as in the header
+struct ENVI::GeoTransform
+{
+	std::string projection;
+	double ref_sample, ref_line;
+	double ref_x, ref_y;
+	double pixel_x, pixel_y;
+	double rotation;
+	// the fields after the pixel size (zone, datum, units, ...) except
+	// the rotation, as in the header
+	std::vector<std::string> extra;
+
+	GeoTransform() :
+		ref_sample(1), ref_line(1), ref_x(0), ref_y(0),
+		pixel_x(1), pixel_y(1), rotation(0)
+	{}
+
+	// Parse the fields of a 'map info', returning false if they are
+	// malformed
+	bool parse(std::vector<std::string> const& fields)
+	{
+		if (fields.size() < 7)
+			return false;
+		double values[6];
+		for (size_t i = 0; i < 6; ++i) {
+			char* end = nullptr;
+			values[i] = std::strtod(fields[i + 1].c_str(), &end);
+			if (end == fields[i + 1].c_str())
+				return false;
+		}
+		projection = fields[0];
+		ref_sample = values[0];
+		ref_line = values[1];
+		ref_x = values[2];
+		ref_y = values[3];
+		pixel_x = values[4];
+		pixel_y = values[5];
+		rotation = 0;
+		extra.clear();
+		for (size_t i = 7; i < fields.size(); ++i) {
+			const size_t eq = fields[i].find('=');
+			std::string key = fields[i].substr(0, eq);
+			trim(key);
+			if (key == "rotation" && eq != std::string::npos)
+				rotation = std::strtod(fields[i].c_str() + eq + 1, nullptr);
+			else
+				extra.push_back(fields[i]);
+		}
+		return pixel_x != 0 && pixel_y != 0;
+	}
+
+	// The fields of the 'map info' of this transform, for add_meta()
+	std::vector<std::string> fields() const
+	{
+		std::vector<std::string> ret(1, projection);
+		const double values[6] = { ref_sample, ref_line, ref_x, ref_y, pixel_x, pixel_y };
+		for (double v : values) {
+			std::ostringstream ss;
+			ss.precision(16);
+			ss << v;
+			ret.push_back(ss.str());
+		}
+		ret.insert(ret.end(), extra.begin(), extra.end());
+		if (rotation != 0) {
+			std::ostringstream ss;
+			ss.precision(16);
+			ss << "rotation=" << rotation;
+			ret.push_back(ss.str());
+		}
+		return ret;
+	}
+
+	// The coefficients of the map coordinates of pixel coordinates:
+	// x = c[0] + c[1]*sample + c[2]*line, y = c[3] + c[4]*sample + c[5]*line
+	void coefficients(double* c) const
+	{
+		const double angle = rotation*3.14159265358979323846/180;
+		const double cs = std::cos(angle), sn = std::sin(angle);
+		// lines go down (south) before rotation
+		c[1] = pixel_x*cs;
+		c[2] = pixel_y*sn;
+		c[4] = pixel_x*sn;
+		c[5] = -pixel_y*cs;
+		const double u = ref_sample - 1, v = ref_line - 1;
+		c[0] = ref_x - c[1]*u - c[2]*v;
+		c[3] = ref_y - c[4]*u - c[5]*v;
+	}
+
+	// The coefficients of the inverse transform, from map to pixel
+	// coordinates
+	void inverse_coefficients(double* c) const
+	{
+		double f[6];
+		coefficients(f);
+		const double det = f[1]*f[5] - f[2]*f[4];
+		c[1] = f[5]/det;
+		c[2] = -f[2]/det;
+		c[4] = -f[4]/det;
+		c[5] = f[1]/det;
+		c[0] = -c[1]*f[0] - c[2]*f[3];
+		c[3] = -c[4]*f[0] - c[5]*f[3];
+	}
+
+	// Map coordinates of count pixel coordinates
+	void pixel_to_map(double const* samples, double const* lines,
+		double* x, double* y, size_t count) const
+	{
+		double c[6];
+		coefficients(c);
+		Kernels::affine(samples, lines, c, x, y, count);
+	}
+
+	// Pixel coordinates of count map coordinates
+	void map_to_pixel(double const* x, double const* y,
+		double* samples, double* lines, size_t count) const
+	{
+		double c[6];
+		inverse_coefficients(c);
+		Kernels::affine(x, y, c, samples, lines, count);
+	}
+
+	// The transform of the window of an image starting at pixel
+	// (line, sample)
+	GeoTransform crop(size_t line, size_t sample) const
+	{
+		GeoTransform ret = *this;
+		const double u = double(sample), v = double(line);
+		pixel_to_map(&u, &v, &ret.ref_x, &ret.ref_y, 1);
+		ret.ref_sample = ret.ref_line = 1;
+		return ret;
+	}
+
+	// The smallest window of pixels of a lines x samples image covering
+	// the map rectangle between (x0, y0) and (x1, y1), empty if they do
+	// not overlap
+	Window window(double x0, double y0, double x1, double y1,
+		size_t lines, size_t samples) const
+	{
+		const double x[4] = { x0, x1, x0, x1 }, y[4] = { y0, y0, y1, y1 };
+		double u[4], v[4];
+		map_to_pixel(x, y, u, v, 4);
+		const double u0 = std::max(0.0, std::floor(*std::min_element(u, u + 4)));
+		const double v0 = std::max(0.0, std::floor(*std::min_element(v, v + 4)));
+		const double u1 = std::min(double(samples), std::ceil(*std::max_element(u, u + 4)));
+		const double v1 = std::min(double(lines), std::ceil(*std::max_element(v, v + 4)));
+		Window ret = { 0, 0, 0, 0 };
+		if (!(u1 > u0 && v1 > v0))
+			return ret;
+		ret.line = size_t(v0);
+		ret.sample = size_t(u0);
+		ret.lines = size_t(v1 - v0);
+		ret.samples = size_t(u1 - u0);
+		return ret;
+	}
+};
+
+
+// CRC-32C checksums of the raw data of each channel, a chunk of lines at a
+// time. Writers add the bytes at each offset as they go, in any order, and
+// get a checksum for each chunk written in full; readers check the chunks
+// that they read in full, in order
+class ENVI::Checksums
+{
+	// A hashed range of a chunk, in bytes from its start
+	struct Segment
+	{
+		uint64_t begin, end;
+		uint32_t crc;
+	};
+
+	uint64_t band_bytes, chunk_bytes;
+	size_t lines_per_chunk, chunks_per_band;
+	// what a writer has hashed, per chunk
+	std::vector<std::vector<Segment>> segments;
+	// what a reader expects, per chunk (unknown if not known[])
+	std::vector<uint32_t> expected;
+	std::vector<char> known;
+	// the chunk being checked by a reader, the bytes of it hashed so
+	// far, and where its next read is expected
+	size_t current;
+	uint64_t done, next;
+	uint32_t crc;
+
+	// Multiply the 32x32 matrix mat over GF(2) by vec
+	static uint32_t gf2_times(uint32_t const* mat, uint32_t vec)
+	{
+		uint32_t sum = 0;
+		for (; vec; vec >>= 1, ++mat)
+			if (vec & 1)
+				sum ^= *mat;
+		return sum;
+	}
+
+	static void gf2_square(uint32_t* square, uint32_t const* mat)
+	{
+		for (int n = 0; n < 32; ++n)
+			square[n] = gf2_times(mat, mat[n]);
+	}
+
+	// Find the chunk of offset, and the offset within it
+	size_t locate(uint64_t offset, uint64_t& within, uint64_t& length) const
+	{
+		const uint64_t band = offset/band_bytes, in_band = offset%band_bytes;
+		const uint64_t k = in_band/chunk_bytes;
+		within = in_band - k*chunk_bytes;
+		length = std::min(chunk_bytes, band_bytes - k*chunk_bytes);
+		return size_t(band*chunks_per_band + k);
+	}
+
+	// Record a hashed range of chunk, replacing any it overlaps
+	void insert(size_t chunk, Segment seg)
+	{
+		if (segments.size() <= chunk)
+			segments.resize(chunk + 1);
+		std::vector<Segment>& list = segments[chunk];
+		list.erase(std::remove_if(list.begin(), list.end(), [&](Segment const& o) {
+			return o.begin < seg.end && seg.begin < o.end;
+		}), list.end());
+		for (auto& o : list)
+			if (o.end == seg.begin) {
+				o.crc = combine(o.crc, seg.crc, seg.end - seg.begin);
+				o.end = seg.end;
+				return;
+			}
+		list.push_back(seg);
+	}
+
+public:
+	Checksums() : band_bytes(0), chunk_bytes(0), lines_per_chunk(0),
+		chunks_per_band(0), current(SIZE_MAX), done(0), next(0), crc(0)
+	{}
+
+	// Chunks of chunk_lines lines (whole channels if 0) of channels of
+	// lines x samples samples of sample_size bytes
+	Checksums(size_t lines, size_t samples, size_t sample_size, size_t chunk_lines) :
+		Checksums()
+	{
+		lines_per_chunk = chunk_lines ? std::min(chunk_lines, lines) : lines;
+		band_bytes = uint64_t(lines)*samples*sample_size;
+		chunk_bytes = uint64_t(lines_per_chunk)*samples*sample_size;
+		chunks_per_band = lines_per_chunk ? (lines + lines_per_chunk - 1)/lines_per_chunk : 0;
+	}
+
+	// The checksum of the concatenation of data with checksum crc1 and
+	// data of length bytes with checksum crc2, as in zlib
+	static uint32_t combine(uint32_t crc1, uint32_t crc2, uint64_t length)
+	{
+		if (!length)
+			return crc1;
+		uint32_t even[32], odd[32];
+		// the operator for one zero bit, then two and four
+		odd[0] = 0x82F63B78u;
+		for (int n = 1; n < 32; ++n)
+			odd[n] = uint32_t(1) << (n - 1);
+		gf2_square(even, odd);
+		gf2_square(odd, even);
+		// apply length zero bytes to crc1
+		do {
+			gf2_square(even, odd);
+			if (length & 1)
+				crc1 = gf2_times(even, crc1);
+			length >>= 1;
+			if (!length)
+				break;
+			gf2_square(odd, even);
+			if (length & 1)
+				crc1 = gf2_times(odd, crc1);
+			length >>= 1;
+		} while (length);
+		return crc1 ^ crc2;
+	}
+
+	size_t chunk_lines() const
+	{ return lines_per_chunk; }
+
+	size_t chunks_per_channel() const
+	{ return chunks_per_band; }
+
+	// Hash count bytes written at offset (from the start of the data)
+	void add(uint64_t offset, void const* data, uint64_t count)
+	{
+		uint8_t const* bytes = static_cast<uint8_t const*>(data);
+		while (count && band_bytes) {
+			uint64_t within, length;
+			const size_t chunk = locate(offset, within, length);
+			const uint64_t n = std::min(count, length - within);
+			const Segment seg = { within, within + n, Kernels::crc32c(0, bytes, size_t(n)) };
+			insert(chunk, seg);
+			offset += n;
+			bytes += n;
+			count -= n;
+		}
+	}
+
+	// The checksums of the chunks of the first channels, as hex strings,
+	// "-" for those not written in full
+	std::vector<std::string> values(size_t channels) const
+	{
+		std::vector<std::string> ret;
+		for (size_t chunk = 0; chunk < channels*chunks_per_band; ++chunk) {
+			std::vector<Segment> list = chunk < segments.size() ? segments[chunk] : std::vector<Segment>();
+			std::sort(list.begin(), list.end(), [](Segment const& a, Segment const& b) {
+				return a.begin < b.begin;
+			});
+			const uint64_t start = uint64_t(chunk%chunks_per_band)*chunk_bytes;
+			const uint64_t length = std::min(chunk_bytes, band_bytes - start);
+			uint64_t end = 0;
+			uint32_t sum = 0;
+			for (auto const& seg : list) {
+				if (seg.begin != end)
+					break;
+				sum = combine(sum, seg.crc, seg.end - seg.begin);
+				end = seg.end;
+			}
+			char hex[9];
+			std::snprintf(hex, sizeof(hex), "%08x", unsigned(sum));
+			ret.push_back(end == length ? hex : "-");
+		}
+		return ret;
+	}
+
+	// Set the checksums expected by a reader, returning false unless
+	// there is one per chunk of each of channels
+	bool expect(std::vector<std::string> const& vals, size_t channels)
+	{
+		if (!band_bytes || vals.size() != channels*chunks_per_band)
+			return false;
+		expected.assign(vals.size(), 0);
+		known.assign(vals.size(), 0);
+		for (size_t k = 0; k < vals.size(); ++k) {
+			if (vals[k] == "-")
+				continue;
+			char* end = nullptr;
+			expected[k] = uint32_t(std::strtoul(vals[k].c_str(), &end, 16));
+			known[k] = vals[k].size() == 8 && !*end;
+		}
+		current = SIZE_MAX;
+		return true;
+	}
+
+	bool empty() const
+	{ return expected.empty(); }
+
+	// Whether chunk has the checksum sum, if it is known
+	bool matches(size_t chunk, uint32_t sum) const
+	{ return !known[chunk] || expected[chunk] == sum; }
+
+	// Check count bytes read at offset, returning the first chunk that
+	// they complete with the wrong checksum, or SIZE_MAX. Chunks are
+	// only checked if they are read from their start without gaps
+	size_t check(uint64_t offset, void const* data, uint64_t count)
+	{
+		uint8_t const* bytes = static_cast<uint8_t const*>(data);
+		size_t bad = SIZE_MAX;
+		if (offset != next)
+			current = SIZE_MAX;
+		next = offset + count;
+		while (count && !expected.empty()) {
+			uint64_t within, length;
+			const size_t chunk = locate(offset, within, length);
+			const uint64_t n = std::min(count, length - within);
+			if (chunk != current && !within) {
+				current = chunk;
+				done = 0;
+				crc = 0;
+			}
+			if (chunk == current && chunk < expected.size()) {
+				crc = Kernels::crc32c(crc, bytes, size_t(n));
+				done += n;
+				if (done == length) {
+					current = SIZE_MAX;
+					if (!matches(chunk, crc) && bad == SIZE_MAX)
+						bad = chunk;
+				}
+			}
+			offset += n;
+			bytes += n;
+			count -= n;
+		}
+		return bad;
+	}
+
+	// Write a manifest of the checksums of the first channels: a line
+	// with the chunk size, then one per channel
+	void save(std::string const& fname, size_t channels) const
+	{
+		std::ofstream out(fname);
+		out << "ENVI checksums crc32c " << lines_per_chunk << '\n';
+		const std::vector<std::string> vals = values(channels);
+		for (size_t ch = 0; ch < channels; ++ch) {
+			for (size_t k = 0; k < chunks_per_band; ++k)
+				out << (k ? " " : "") << vals[ch*chunks_per_band + k];
+			out << '\n';
+		}
+		if (!out)
+			raise(STATUS_WRITE_FAILED, std::runtime_error("cannot write " + fname));
+	}
+
+	// Read a manifest written by save(), returning the chunk size and
+	// the checksums
+	static std::pair<size_t, std::vector<std::string>> load(std::string const& fname)
+	{
+		std::pair<size_t, std::vector<std::string>> ret(0, std::vector<std::string>());
+		std::ifstream in(fname);
+		std::string line;
+		ENVI::getline(in, line);
+		const std::string magic = "ENVI checksums crc32c ";
+		if (line.compare(0, magic.size(), magic)) {
+			raise(STATUS_INVALID_HEADER, std::runtime_error("not a checksum manifest: " + fname));
+			return ret;
+		}
+		ret.first = std::strtoul(line.c_str() + magic.size(), nullptr, 10);
+		while (in) {
+			if (!ENVI::getline(in, line))
+				continue;
+			std::istringstream ss(line);
+			std::string val;
+			while (ss >> val)
+				ret.second.push_back(val);
+		}
+		return ret;
+	}
+};
+
+// The ENVI::Output() template class, encapsulating writing to an ENVI file.
+template<typename OutputDataType, typename StreamType>
+class ENVI::Output
+{
+	Metadata meta;
+	const std::string description;
+	const size_t lines, samples, pixels;
+	std::vector<std::string> channels;
+	StreamType data;
+	StreamType hdr;
+	// Did we open data and hdr ourselves?
+	bool need_closing;
+	// How to convert data from other types to OutputDataType
+	ConversionPolicy conversion;
+	// Bounce buffer for the converted data
+	std::vector<OutputDataType> buffer;
+	// I/O statistics
+	Profiler profile;
+	// Progress and cancellation
+	Monitor monitor;
+	// Current offset in the data stream, in bytes
+	uint64_t position;
+	// Checksums of the data written, if enabled, and the manifest to
+	// save them into too
+	bool checksumming;
+	Checksums sums;
+	std::string manifest;
+
+	// Get the bounce buffer, with room for at least count samples
+	OutputDataType *get_buffer(size_t count)
+	{
+		if (buffer.size() < count)
+			buffer.resize(count);
+		return buffer.data();
+	}
+
+	// Write out channel data, of type InputDataType.
+	// The generic version converts from InputDataType to OutputDataType
+	// a chunk at a time, through the bounce buffer
+	template<typename InputDataType>
+	void write_channel_data(InputDataType const *ptr, size_t count)
+	{
+		const size_t chunk = std::min(count, chunk_samples<OutputDataType>());
+		OutputDataType *buf = get_buffer(chunk);
+		for (size_t p = 0; p < count && !failed(); p += chunk) {
+			const size_t n = std::min(chunk, count - p);
+			const Profiler::Timer timer;
+			Kernels::convert(ptr + p, buf, n, conversion);
+			profile.count_convert(timer);
+			write_data(buf, n);
+		}
+	}
+
+	// Specialization of write_channel_data when no conversion is needed.
+	// The data is still written a chunk at a time, to monitor progress
+	void write_channel_data(OutputDataType const *ptr, size_t count)
+	{
+		const size_t chunk = chunk_samples<OutputDataType>();
+		for (size_t p = 0; p < count && !failed(); p += chunk)
+			write_data(ptr + p, std::min(chunk, count - p));
+	}
+
+	// Write count samples to the data stream
+	void write_data(OutputDataType const *ptr, size_t count)
+	{
+		const Profiler::Timer timer;
+		data.write((const char*)ptr, count*sizeof(*ptr));
+		profile.count_write(count*sizeof(*ptr), timer);
+		if (!data)
+			return raise(STATUS_WRITE_FAILED, std::runtime_error("error writing channel data"));
+		// hashed while still in cache
+		if (checksumming)
+			sums.add(position, ptr, count*sizeof(*ptr));
+		position += count*sizeof(*ptr);
+		monitor.advance(count*sizeof(*ptr));
+	}
+
+	// Move to the given offset of the data stream, if not there already
+	void seek_data(uint64_t offset)
+	{
+		if (offset == position)
+			return;
+		const Profiler::Timer timer;
+		data.seekp(offset);
+		profile.count_seek(timer);
+		position = offset;
+	}
+
+	// Offset of line l of channel ch in the data stream
+	uint64_t data_offset(size_t ch, size_t l = 0) const
+	{ return (uint64_t(ch)*pixels + uint64_t(l)*samples)*sizeof(OutputDataType); }
+
+	// Write a new channel with the given writer, returning its index.
+	// If it gets cancelled, rewind to the start of the channel, so that
+	// the next one overwrites it
+	template<typename Writer>
+	size_t write_new_channel(std::string const& ch_name, Writer&& writer)
+	{
+		const uint64_t start = data_offset(channels.size());
+		seek_data(start);
+		monitor.begin(pixels*sizeof(OutputDataType));
+#if CXXENVI_EXCEPTIONS
+		try {
+			writer();
+		} catch (OperationCancelled const&) {
+			seek_data(start);
+			throw;
+		}
+#else
+		if (!failed())
+			writer();
+		if (failed()) {
+			seek_data(start);
+			return SIZE_MAX;
+		}
+#endif
+		channels.push_back(ch_name);
+		return channels.size() - 1;
+	}
+
+	// Write out a whole channel, from data stored at ptr
+	template<typename InputDataType>
+	void write_channel(InputDataType const *ptr)
+	{
+		write_channel_data(ptr, pixels);
+	}
+
+#if CXXENVI_COMPLEX
+	// Write out a whole complex channel from separate (planar) real
+	// and imaginary parts, interleaving them a chunk at a time
+	template<typename InputDataType>
+	void write_planar_channel(InputDataType const *re, InputDataType const *im)
+	{
+		static_assert(!std::is_arithmetic<OutputDataType>::value,
+			"planar channels can only be written to complex files");
+		const size_t chunk = std::min(pixels, chunk_samples<OutputDataType>());
+		OutputDataType *buf = get_buffer(chunk);
+		for (size_t p = 0; p < pixels && !failed(); p += chunk) {
+			const size_t n = std::min(chunk, pixels - p);
+			const Profiler::Timer timer;
+			Kernels::interleave(re + p, im + p, buf, n);
+			profile.count_convert(timer);
+			write_data(buf, n);
+		}
+	}
+#endif
+
+	// Write out a whole channel, from data stored at ptr, assuming
+	// that consecutive lines are at stride elements of each other.
+	// (For example, because we are only storing a subset of the data,
+	// or because lines of in-memory data were allocated with a larger
+	// pitch than needed for alignment reasons or whatever.)
+	template<typename InputDataType>
+	void write_strided_channel(InputDataType const *ptr, size_t stride)
+	{
+		for (size_t l = 0; l < lines && !failed(); ++l) {
+			InputDataType const *line = ptr + l*stride;
+			write_channel_data(line, samples);
+		}
+	}
+
+	// Write out a whole channel from a view with the image size
+	template<typename InputDataType>
+	void write_view(ImageView<InputDataType> const& view)
+	{
+		if (view.contiguous())
+			return write_channel(view.data);
+		if (view.sample_stride == 1)
+			return write_strided_channel(view.data, view.line_stride);
+		// gather a line at a time
+		std::vector<typename std::remove_const<InputDataType>::type> line(samples);
+		for (size_t l = 0; l < lines && !failed(); ++l) {
+			for (size_t c = 0; c < samples; ++c)
+				line[c] = view(l, c);
+			write_channel_data(line.data(), samples);
+		}
+	}
+
+	// Write out a whole channel, from data provided by a function
+	// (or functor) that takes the current row, col as argument
+	// and returns the value. Values are collected a line at a time,
+	// and converted like any other channel data
+	template<typename Func, typename ...Args>
+	void write_channel_function(Func&& func, Args&& ... args)
+	{
+		typedef typename std::decay<
+			decltype(std::bind(func, args..., size_t(), size_t())())
+			>::type ResultType;
+		// numbers go through the conversion kernels, as bytes for bool
+		// (vector<bool> has no data()); anything else is converted to
+		// OutputDataType as it is stored
+		typedef typename std::conditional<std::is_same<ResultType, bool>::value, uint8_t,
+			typename std::conditional<std::is_arithmetic<ResultType>::value,
+				ResultType, OutputDataType>::type>::type LineType;
+		std::vector<LineType> line(samples);
+		for (size_t l = 0; l < lines && !failed(); ++l) {
+			for (size_t c = 0; c < samples; ++c)
+				line[c] = std::bind(func, args..., l, c)();
+			write_channel_data(line.data(), samples);
+		}
+	}
+
+	// Write channel names in the header: one per line if there's
+	// more than one, space-wrapped if there's only one
+	void write_channel_names()
+	{
+		size_t num = channels.size();
+		if (!num)
+			return;
+		hdr << (num > 1 ? "\n" : " ");
+		for (size_t c = 0; c < num - 1; ++c)
+			hdr << channels[c] << ",\n";
+		hdr << channels.back();
+		hdr << (num > 1 ? "\n" : " ");
+	}
+
+	// Write out the whole header
+	void write_header()
+	{
+		hdr << "ENVI\n";
+		hdr << "description = { " << description << " }\n";
+		hdr << "samples = " << samples << "\n";
+		hdr << "lines = " << lines << "\n";
+		hdr << "bands = " << channels.size() << "\n";
+		hdr << "data type = " << TypeCode<OutputDataType>() << "\n";
+		hdr << "interleave = bsq\n"; // TODO user choice
+		hdr << "header offset = 0\n" ;
+		hdr << "byte order = "
+			<< endianness() // TODO user choice:
+			<< "\n" ;
+		hdr << "band names = {" ;
+		write_channel_names();
+		hdr << "}\n";
+
+		for (size_t i = 0; i < meta.size(); ++i)
+		{
+			hdr << meta.key(i) << " = " << meta.value(i) << "\n";
+		}
+
+		if (checksumming && !channels.empty()) {
+			const std::vector<std::string> vals = sums.values(channels.size());
+			hdr << "checksum type = crc32c\n";
+			hdr << "checksum lines = " << sums.chunk_lines() << "\n";
+			hdr << "checksums = {";
+			for (size_t k = 0; k < vals.size(); ++k)
+				hdr << (k ? ", " : " ") << vals[k];
+			hdr << " }\n";
+		}
+	}
+
+	void prepare_writing()
+	{
+		const CallScope call;
+		if (!data || !hdr)
+			return raise(STATUS_OPEN_FAILED, std::runtime_error("cannot open output files"));
+#if CXXENVI_EXCEPTIONS
+		data.exceptions(std::ios::failbit | std::ios::badbit);
+		hdr.exceptions(std::ios::failbit | std::ios::badbit);
+#endif
+	}
+
+	void flush()
+	{
+		const CallScope call;
+		data.flush();
+		const Profiler::Timer timer;
+		write_header();
+		hdr.flush();
+		profile.count_header(timer);
+		if (checksumming && !manifest.empty())
+			sums.save(manifest, channels.size());
+	}
+
+	void close()
+	{
+		close_stream(data, 0);
+		close_stream(hdr, 0);
+	}
+public:
+	// Create output, with given data and header streams,
+	// description, and number of lines and samples
+	Output( StreamType&& data_stream,
+		StreamType&& hdr_stream,
+		std::string const& _desc,
+		size_t _lines, size_t _samples) :
+		description(_desc),
+		lines(_lines),
+		samples(_samples),
+		pixels(lines*samples),
+		channels(),
+		data(std::move(data_stream)),
+		hdr(std::move(hdr_stream)),
+		need_closing(false),
+		conversion(TRUNCATE),
+		position(0),
+		checksumming(false)
+	{
+		prepare_writing();
+	}
+
+	// Create output, with given name, header file name, description
+	// and number of lines and samples (columns).
+	Output(std::string const& fname,
+		std::string const& fname_hdr,
+		std::string const& _desc,
+		size_t _lines, size_t _samples) :
+		description(_desc),
+		lines(_lines),
+		samples(_samples),
+		pixels(lines*samples),
+		channels(),
+		data(StreamType(fname)),
+		hdr(StreamType(fname_hdr)),
+		need_closing(true),
+		conversion(TRUNCATE),
+		position(0),
+		checksumming(false)
+	{
+		prepare_writing();
+	}
+
+
+	// Create output, with given name, description
+	// and number of lines and samples (columns).
+	// The header file will have the extension replaced by
+	// '.hdr' (or hdr appended) automatically
+	Output(std::string const& fname,
+		std::string const& _desc,
+		size_t _lines, size_t _samples) :
+		description(_desc),
+		lines(_lines),
+		samples(_samples),
+		pixels(lines*samples),
+		channels(),
+		data(StreamType(fname)),
+		hdr(StreamType(hdr_name(fname))),
+		need_closing(true),
+		conversion(TRUNCATE),
+		position(0),
+		checksumming(false)
+	{
+		prepare_writing();
+	}
+
+	~Output()
+	{
+		// Finalize the files on closure, but only if they are valid
+		// otherwise we might get an exception thrown during stack
+		// unwinding
+#if CXXENVI_EXCEPTIONS
+		if (data && hdr) try {
+			flush();
+			if (need_closing)
+				close();
+		} catch (std::exception &e) {
+			// nothing we can do in a destructor anyway
+		}
+#else
+		if (data && hdr) {
+			flush();
+			if (need_closing)
+				close();
+		}
+#endif
+	}
+
+	// Set the policy used to convert channel data of a different type
+	// to OutputDataType (default: TRUNCATE)
+	void set_conversion(ConversionPolicy policy)
+	{ conversion = policy; }
+
+	ConversionPolicy get_conversion() const
+	{ return conversion; }
+
+	// Compute a CRC-32C checksum of each chunk of chunk_lines lines of
+	// each channel (of whole channels if 0) while writing it, and store
+	// them in the header, and in the manifest file too if one is named.
+	// Must be called before the first channel is added
+	void set_checksums(size_t chunk_lines = 0, std::string const& manifest_fname = std::string())
+	{
+		const CallScope call;
+		if (!channels.empty())
+			return raise(STATUS_INVALID_ARGUMENT, std::logic_error("checksums enabled after adding channels"));
+		checksumming = true;
+		sums = Checksums(lines, samples, sizeof(OutputDataType), chunk_lines);
+		manifest = manifest_fname;
+	}
+
+	// I/O statistics of this output (all zero without CXXENVI_PROFILE)
+	IOStats const& stats() const
+	{ return profile.stats(); }
+
+	// Call cb with the progress of each channel write (pass an empty
+	// function to stop)
+	void set_progress(ProgressCallback const& cb)
+	{ monitor.set_callback(cb); }
+
+	// Stop channel writes once token is cancelled. The cancelled channel
+	// is not added, and the next one will overwrite its partial data
+	void set_cancel(std::shared_ptr<CancelToken const> const& token)
+	{ monitor.set_token(token); }
+
+	// Add a channel
+	template<typename InputDataType>
+	size_t add_channel(std::string const& ch_name,
+		InputDataType const* ptr)
+	{
+		const CallScope call;
+		return write_new_channel(ch_name, [&]() { write_channel(ptr); });
+	}
+
+	template<typename InputDataType>
+	size_t add_channel(std::string const& ch_name,
+		std::vector<InputDataType> const& vec)
+	{
+		const CallScope call;
+		if (vec.size() != lines*samples) {
+			raise(STATUS_INVALID_ARGUMENT, std::runtime_error("wrong number of pixels in channel " + ch_name));
+			return SIZE_MAX;
+		}
+		return add_channel(ch_name, &vec.front());
+	}
+
+#if CXXENVI_COMPLEX
+	// Add a complex channel from separate (planar) real and
+	// imaginary parts
+	template<typename InputDataType>
+	size_t add_channel(std::string const& ch_name,
+		InputDataType const* re, InputDataType const* im)
+	{
+		const CallScope call;
+		return write_new_channel(ch_name, [&]() { write_planar_channel(re, im); });
+	}
+
+	template<typename InputDataType>
+	size_t add_channel(std::string const& ch_name,
+		std::vector<InputDataType> const& re,
+		std::vector<InputDataType> const& im)
+	{
+		const CallScope call;
+		if (re.size() != lines*samples || im.size() != lines*samples) {
+			raise(STATUS_INVALID_ARGUMENT, std::runtime_error("wrong number of pixels in channel " + ch_name));
+			return SIZE_MAX;
+		}
+		return add_channel(ch_name, re.data(), im.data());
+	}
+#endif
+
+	// Add a channel of count elements at ptr (which must be at least
+	// the image size)
+	template<typename InputDataType>
+	size_t add_channel(std::string const& ch_name,
+		InputDataType const* ptr, size_t count)
+	{
+		const CallScope call;
+		if (count < pixels) {
+			raise(STATUS_INVALID_ARGUMENT, std::runtime_error("too few pixels in channel " + ch_name));
+			return SIZE_MAX;
+		}
+		return add_channel(ch_name, ptr);
+	}
+
+	// Add a channel from a view, of any layout, with the image size
+	template<typename InputDataType>
+	size_t add_channel(std::string const& ch_name,
+		ImageView<InputDataType> const& view)
+	{
+		const CallScope call;
+		if (view.lines != lines || view.samples != samples) {
+			raise(STATUS_INVALID_ARGUMENT, std::runtime_error("wrong view size for channel " + ch_name));
+			return SIZE_MAX;
+		}
+		return write_new_channel(ch_name, [&]() { write_view(view); });
+	}
+
+	// Add a channel from a linearized array with the given
+	// stride (in elements), starting from the given row and column
+	template<typename InputDataType>
+	size_t add_channel_rect(std::string const& ch_name,
+		InputDataType const* ptr, size_t stride,
+		size_t row=0, size_t col=0)
+	{
+		const CallScope call;
+		if (stride < samples + col) {
+			raise(STATUS_INVALID_ARGUMENT, std::runtime_error("data stride too small in channel " + ch_name));
+			return SIZE_MAX;
+		}
+		return write_new_channel(ch_name, [&]() { write_strided_channel(ptr + row*stride + col, stride); });
+	}
+
+	template<typename InputDataType>
+	size_t add_channel_rect(std::string const& ch_name,
+		std::vector<InputDataType> const& vec, size_t stride,
+		size_t row=0, size_t col=0)
+	{
+		const CallScope call;
+		if (lines && vec.size() < (row + lines - 1)*stride + col + samples) {
+			raise(STATUS_INVALID_ARGUMENT, std::runtime_error("vector too small for channel " + ch_name));
+			return SIZE_MAX;
+		}
+		return add_channel_rect(ch_name, &vec.front(), stride, row, col);
+	}
+
+	// Add a channel defined by applying a function to (row, column) pairs
+	template<typename Func, typename ...Args>
+	size_t add_channel_func(std::string const& ch_name, Func&& func, Args&& ... args)
+	{
+		const CallScope call;
+		return write_new_channel(ch_name, [&]() { write_channel_function(func, args...); });
+	}
+
+	// Non-throwing add_channel() and add_channel_rect(), returning the
+	// index of the new channel
+	template<typename InputDataType>
+	Result<size_t> try_add_channel(std::string const& ch_name,
+		InputDataType const* ptr) noexcept
+	{
+		Result<size_t> ret;
+		ret.status = capture(STATUS_WRITE_FAILED, [&]() {
+			ret.value = add_channel(ch_name, ptr);
+		});
+		return ret;
+	}
+
+	template<typename InputDataType>
+	Result<size_t> try_add_channel(std::string const& ch_name,
+		std::vector<InputDataType> const& vec) noexcept
+	{
+		Result<size_t> ret;
+		if (vec.size() != lines*samples)
+			ret.status = Status(STATUS_INVALID_ARGUMENT, "wrong number of pixels in channel " + ch_name);
+		else
+			ret = try_add_channel(ch_name, vec.data());
+		return ret;
+	}
+
+	template<typename InputDataType>
+	Result<size_t> try_add_channel_rect(std::string const& ch_name,
+		InputDataType const* ptr, size_t stride,
+		size_t row=0, size_t col=0) noexcept
+	{
+		Result<size_t> ret;
+		ret.status = capture(STATUS_WRITE_FAILED, [&]() {
+			ret.value = add_channel_rect(ch_name, ptr, stride, row, col);
+		});
+		return ret;
+	}
+
+	std::pair<size_t, size_t> extent() const
+	{ return std::make_pair(lines, samples); }
+
+	// Add a channel whose data will be written, in any order, with
+	// write_lines(), returning its index. Reserved channels are
+	// expected to be fully written before closing
+	size_t reserve_channel(std::string const& ch_name)
+	{
+		channels.push_back(ch_name);
+		return channels.size() - 1;
+	}
+
+	// Write count lines of channel ch, starting from first_line, from
+	// data stored at ptr. Writing out of order needs a seekable stream
+	template<typename InputDataType>
+	void write_lines(size_t ch, size_t first_line, InputDataType const* ptr, size_t count)
+	{
+		const CallScope call;
+		if (ch >= channels.size())
+			return raise(STATUS_NO_CHANNEL, std::invalid_argument("channel number too high"));
+		if (first_line > lines || count > lines - first_line)
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("lines out of range"));
+		seek_data(data_offset(ch, first_line));
+		monitor.begin(count*samples*sizeof(OutputDataType));
+		write_channel_data(ptr, count*samples);
+	}
+
+	// Add a single-valued meta key
+	template<typename T>
+	void add_meta(std::string const& key, T const& value)
+	{
+		const CallScope call;
+		meta.add(key, value);
+	}
+
+	// Add a multi-valued meta key
+	template<typename ...T>
+	void add_meta(std::string const& key, T const& ... value)
+	{
+		const CallScope call;
+		meta.add_multi(key, value...);
+	}
+
+	// Add a meta key with the values of a vector
+	template<typename T>
+	void add_meta(std::string const& key, std::vector<T> const& values)
+	{
+		const CallScope call;
+		meta.add_multi(key, values);
+	}
+};
+
+// Class to manage input from 'arbitrary' istreams
+// TODO expose metadata
+// TODO allow reading of all channels at once
+template<typename StreamType>
+class ENVI::BasicInput
+{
+protected:
+	Metadata meta;
+	std::string description;
+	size_t lines, samples, pixels;
+	size_t data_offset;
+	DataTypeEnum input_data_type;
+	std::vector<std::string> channels;
+	// The 'bands' of the header, 0 if not seen yet
+	size_t header_bands;
+	StreamType data;
+	StreamType hdr;
+	bool need_closing;
+	// How to convert the data to the requested type
+	ConversionPolicy conversion;
+	// Is the data stored with a different byte order than ours?
+	bool swap_bytes;
+	// I/O statistics
+	Profiler profile;
+	// Progress and cancellation
+	Monitor monitor;
+	// Wavelengths (nm) parsed from the header, the channels sorted by
+	// wavelength, and the 'bbl' flags (non-zero for bad bands)
+	std::vector<double> band_wavelengths;
+	std::vector<size_t> wavelength_order;
+	std::vector<char> bad_bands;
+	// The parsed 'map info', if valid
+	GeoTransform geo;
+	bool has_geo;
+	// The checksums of the header or of a manifest, whether reads are
+	// checked against them, and the offset of the next read
+	Checksums sums;
+	bool verifying;
+	uint64_t read_pos;
+
+	// We assume that each key = value is in a separate line,
+	// except for array/string values, that begin with '{' and end
+	// with '}' (followed by a newline). So if an input contains a
+	// { we keep reading lines until we find the closing }
+	// TODO return information on whether it was in {} or not
+	inline void read_keyval(std::string &key, std::string &val)
+	{
+		std::string keyval;
+		std::string line;
+
+		key.clear();
+		val.clear();
+		while (line.empty())
+		{
+			ENVI::getline(hdr, line);
+			if (!hdr)
+				return; // nothing else to read
+		}
+
+		keyval = line;
+		size_t open = keyval.find('{');
+		size_t close = keyval.find('}');
+
+		// if there was no closing '}', keep reading until one is
+		// found 
+		if ( open != keyval.npos && close == keyval.npos)
+		{
+			while (close == keyval.npos)
+			{
+				ENVI::getline(hdr, line);
+				keyval += line;
+				if (hdr.fail())
+					return raise(STATUS_INVALID_HEADER, std::runtime_error("missing '}'"));
+				close = keyval.find('}');
+			}
+		}
+
+		// the key is up to the =, excluding it
+		size_t eq = keyval.find('=');
+		if (eq == keyval.npos || eq > open)
+			return raise(STATUS_INVALID_HEADER, std::runtime_error("missing '='"));
+
+		// for the key, just trim whitespace
+		key = keyval.substr(0, eq);
+		trim(key);
+
+		// for the val, get between open and close if they are npos,
+		// or everything past the equal sign otherwise
+		size_t val_start = (open != keyval.npos ? open : eq)+1;
+		size_t val_len = (open != keyval.npos ? close - open-1 : keyval.npos);
+		val = keyval.substr(val_start, val_len);
+		trim(val);
+	}
+
+	void process_keyval(std::string const& key, std::string const& val)
+	{
+		if (key == "description") {
+			description = val;
+		} else if (key == "samples") {
+			samples = atol(val.c_str());
+		} else if (key == "lines") {
+			lines = atol(val.c_str());
+		} else if (key == "bands") {
+			header_bands = atol(val.c_str());
+			if (channels.size() > 0 && header_bands != channels.size())
+				return raise(STATUS_INVALID_HEADER, std::runtime_error("inconsistent bands and band names"));
+			channels.reserve(header_bands);
+		} else if (key == "data type") {
+			long type = atol(val.c_str());
+			if (!valid_type(type))
+				return raise(STATUS_UNSUPPORTED, std::invalid_argument("unknown ENVI type '" + val + "'"));
+			input_data_type = (DataTypeEnum)type;
+		} else if (key == "interleave") {
+			if (val != "bsq")
+				return raise(STATUS_UNSUPPORTED, std::invalid_argument("interleave '" + val + "' not supported"));
+		} else if (key == "header offset") {
+			data_offset = atol(val.c_str());
+		} else if (key == "byte order") {
+			size_t bo = atol(val.c_str());
+			if (bo != LITTLE && bo != BIG)
+				return raise(STATUS_UNSUPPORTED, std::invalid_argument("unsupported byte order '" + val + "'"));
+			swap_bytes = (bo != endianness());
+		} else if (key == "band names") {
+			// if we read a 'bands', we expect as many names as there were bands
+			const size_t expected = header_bands;
+			if (channels.size() > 0)
+				return raise(STATUS_INVALID_HEADER, std::invalid_argument("'band names' seen twice"));
+
+			// comma separated list
+			size_t prev = 0, found = 0;
+			while ((found = val.find(',', prev)) != val.npos) {
+				std::string sec = val.substr(prev, found-prev);
+				channels.push_back(trim(sec));
+				prev = found+1;
+			}
+			// push the part after the last comma, if not empty
+			std::string rem = val.substr(prev, val.npos);
+			trim(rem);
+			if (!rem.empty())
+				channels.push_back(rem);
+
+			if (expected && channels.size() != expected)
+				return raise(STATUS_INVALID_HEADER, std::runtime_error("inconsistent band names and bands"));
+		} else {
+			meta.add(key, val);
+		}
+	}
+
+	// The values of a key in 'wavelength units', converted to nm
+	std::vector<double> wavelength_values(std::string const& key) const
+	{
+		std::vector<double> ret;
+		for (auto const& str : meta.get_values(key))
+			ret.push_back(std::strtod(str.c_str(), nullptr));
+
+		std::string units = meta.get("wavelength units");
+		std::transform(units.begin(), units.end(), units.begin(), ::tolower);
+		const double scale =
+			(units == "micrometers" || units == "um") ? 1e3 :
+			(units == "millimeters" || units == "mm") ? 1e6 : 1;
+		for (auto& w : ret)
+			w *= scale;
+		return ret;
+	}
+
+	void read_header()
+	{
+		std::string line;
+		ENVI::getline(hdr, line);
+		if (line != "ENVI")
+			return raise(STATUS_INVALID_HEADER, std::runtime_error("missing 'ENVI' in header"));
+
+		std::string key, val;
+
+		do {
+			read_keyval(key, val);
+			if (key.empty() || failed())
+				break;
+
+#if CXXENVI_DEBUG
+			std::clog << "KEY: '" << key << "', VAL: '" << val << "'" << std::endl;
+#endif
+
+			process_keyval(key, val);
+		} while (hdr && !failed());
+
+		pixels = lines*samples;
+
+		// without band names, name the bands like ENVI does
+		if (channels.empty()) {
+			for (size_t b = 0; b < header_bands; ++b)
+				channels.push_back("Band " + std::to_string(b + 1));
+		}
+		// TODO other consistency checks etc
+
+		index_bands();
+		has_geo = meta.has_key("map info") && geo.parse(meta.get_values("map info"));
+		if (meta.get("checksum type") == "crc32c")
+			expect_checksums(meta.get<size_t>("checksum lines", 0), meta.get_values("checksums"));
+	}
+
+	// Use the given checksums, if there is one per chunk of each channel
+	void expect_checksums(size_t chunk_lines, std::vector<std::string> const& vals)
+	{
+		sums = Checksums(lines, samples, type_size(input_data_type), chunk_lines);
+		if (!sums.expect(vals, channels.size()))
+			sums = Checksums();
+	}
+
+	// Parse the wavelengths and bad band list once. The wavelength
+	// index only exists if there is one wavelength per channel (spectral
+	// libraries have them per sample instead); a 'bbl' of the wrong size
+	// is ignored
+	void index_bands()
+	{
+		band_wavelengths = wavelength_values("wavelength");
+		wavelength_order.clear();
+		if (band_wavelengths.size() == channels.size()) {
+			wavelength_order.resize(channels.size());
+			for (size_t ch = 0; ch < channels.size(); ++ch)
+				wavelength_order[ch] = ch;
+			std::stable_sort(wavelength_order.begin(), wavelength_order.end(),
+				[this](size_t a, size_t b) { return band_wavelengths[a] < band_wavelengths[b]; });
+		}
+
+		bad_bands.assign(channels.size(), 0);
+		std::vector<std::string> const bbl = meta.get_values("bbl");
+		if (bbl.size() == channels.size())
+			for (size_t ch = 0; ch < channels.size(); ++ch)
+				bad_bands[ch] = std::strtod(bbl[ch].c_str(), nullptr) == 0;
+	}
+
+	// Read count samples from the current position of the data stream,
+	// fixing their byte order if needed
+	template<typename T>
+	void read_samples(T *buf, size_t count)
+	{
+		const uint64_t offset = read_pos;
+		read_bytes(reinterpret_cast<char*>(buf), count*sizeof(T));
+		if (failed())
+			return;
+		if (verifying && offset >= data_offset) {
+			const size_t chunk = sums.check(offset - data_offset, buf, count*sizeof(T));
+			if (chunk != SIZE_MAX) {
+				const size_t per_channel = sums.chunks_per_channel();
+				return raise(STATUS_READ_FAILED, std::runtime_error("checksum mismatch in channel " +
+					channels[chunk/per_channel] + " from line " +
+					std::to_string(chunk%per_channel*sums.chunk_lines())));
+			}
+		}
+		if (swap_bytes) {
+			const Profiler::Timer swap_timer;
+			Kernels::byteswap(buf, count);
+			profile.count_convert(swap_timer);
+		}
+	}
+
+	// Read count raw bytes from the current position of the data stream
+	void read_bytes(char *buf, size_t count)
+	{
+		const Profiler::Timer timer;
+		data.read(buf, count);
+		profile.count_read(count, timer);
+		if (size_t(data.gcount()) != count) {
+			data.clear();
+			return raise(STATUS_READ_FAILED, std::runtime_error("short read of channel data"));
+		}
+		read_pos += count;
+		monitor.advance(count);
+	}
+
+	// Move to the given offset of the data stream, to start reading
+	// bytes bytes from there
+	void seek(size_t offset, size_t bytes)
+	{
+		monitor.begin(bytes);
+		reposition(offset);
+	}
+
+	// Move to another offset while reading the bytes given to seek()
+	void reposition(size_t offset)
+	{
+		const Profiler::Timer timer;
+		data.seekg(offset);
+		profile.count_seek(timer);
+		read_pos = offset;
+	}
+
+	void prepare_reading()
+	{
+		const CallScope call;
+		if (!data || !hdr)
+			return raise(STATUS_OPEN_FAILED, std::runtime_error("cannot open input files"));
+#if CXXENVI_EXCEPTIONS
+		data.exceptions(std::ios::badbit);
+		hdr.exceptions(std::ios::badbit);
+#endif
+		const Profiler::Timer timer;
+		read_header();
+		profile.count_header(timer);
+	}
+
+
+	void close()
+	{
+		close_stream(data, 0);
+		close_stream(hdr, 0);
+	}
+
+	// Destination of a load of count lines starting from first
+	template<typename OutputType>
+	struct LineRange
+	{
+		OutputType *data;
+		size_t first;
+		size_t count;
+	};
+
+	// Destination of a load of a window of the image
+	template<typename OutputType>
+	struct WindowRange
+	{
+		OutputType *data;
+		Window window;
+	};
+
+	// Destination of a decimated load: every step-th sample of every
+	// step-th line, starting from the first
+	template<typename OutputType>
+	struct Decimation
+	{
+		OutputType *data;
+		size_t step;
+	};
+
+	// Loader template class. Since we need runtime switching based off the
+	// type specified in the header, this will recursively call itself until
+	// matching the required data type
+	template<DataTypeEnum input_type = CHAR>
+	struct Loader
+	{
+		typedef typename CodeType<input_type>::type InputType;
+
+		// Read count samples, converting them to OutputType. The raw data
+		// is read in chunks through a bounce buffer, so that the conversion
+		// kernels can work on contiguous runs of samples
+		template<typename OutputType>
+		static inline void
+		undump(BasicInput *in, size_t count, OutputType *o_data)
+		{
+			const size_t chunk = std::min(count, chunk_samples<InputType>());
+			std::vector<InputType> buf(chunk);
+			for (size_t px = 0; px < count && !failed(); px += chunk) {
+				const size_t n = std::min(chunk, count - px);
+				in->read_samples(buf.data(), n);
+				const Profiler::Timer timer;
+				Kernels::convert(buf.data(), o_data + px, n, in->conversion);
+				in->profile.count_convert(timer);
+			}
+		}
+
+		// Specialization for matching type. The data is still read a
+		// chunk at a time, to monitor progress
+		static inline void
+		undump(BasicInput *in, size_t count, InputType *o_data)
+		{
+			const size_t chunk = chunk_samples<InputType>();
+			for (size_t px = 0; px < count && !failed(); px += chunk)
+				in->read_samples(o_data + px, std::min(chunk, count - px));
+		}
+
+#if CXXENVI_COMPLEX
+		// Read count complex samples, reducing them to real values.
+		// Only instantiated for the complex types
+		template<typename OutputType>
+		static inline void
+		undump(BasicInput *in, size_t count, OutputType *o_data,
+			ComplexReduction mode)
+		{
+			typedef typename InputType::value_type RealType;
+			const size_t chunk = std::min(count, chunk_samples<InputType>());
+			std::vector<InputType> buf(chunk);
+			std::vector<RealType> reduced(std::is_same<OutputType, RealType>::value ? 0 : chunk);
+			for (size_t px = 0; px < count && !failed(); px += chunk) {
+				const size_t n = std::min(chunk, count - px);
+				in->read_samples(buf.data(), n);
+				const Profiler::Timer timer;
+				reduce_into(buf.data(), o_data + px, reduced.data(), n, mode, in->conversion);
+				in->profile.count_convert(timer);
+			}
+		}
+
+		// Reduce straight into the output when it has the matching
+		// real type ...
+		template<typename RealType>
+		static inline void
+		reduce_into(InputType const* src, RealType *dst, RealType * /* tmp */,
+			size_t count, ComplexReduction mode, ConversionPolicy /* policy */)
+		{
+			Kernels::reduce(src, dst, count, mode);
+		}
+
+		// ... or go through a temporary buffer otherwise
+		template<typename OutputType, typename RealType>
+		static inline void
+		reduce_into(InputType const* src, OutputType *dst, RealType *tmp,
+			size_t count, ComplexReduction mode, ConversionPolicy policy)
+		{
+			Kernels::reduce(src, tmp, count, mode);
+			Kernels::convert(tmp, dst, count, policy);
+		}
+
+		template<typename OutputType>
+		static inline void
+		prep_load(BasicInput *in, size_t chnum, OutputType *o_data,
+			ComplexReduction mode)
+		{
+			size_t raw_offset = in->data_offset + chnum*in->pixels*sizeof(InputType);
+			in->seek(raw_offset, in->pixels*sizeof(InputType));
+
+			undump(in, in->pixels, o_data, mode);
+		}
+
+		// Read count complex samples, splitting them into planar real
+		// and imaginary parts. Only instantiated for the complex types
+		template<typename OutputType>
+		static inline void
+		undump(BasicInput *in, size_t count, OutputType *o_re, OutputType *o_im)
+		{
+			const size_t chunk = std::min(count, chunk_samples<InputType>());
+			std::vector<InputType> buf(chunk);
+			for (size_t px = 0; px < count && !failed(); px += chunk) {
+				const size_t n = std::min(chunk, count - px);
+				in->read_samples(buf.data(), n);
+				const Profiler::Timer timer;
+				Kernels::deinterleave(buf.data(), o_re + px, o_im + px, n);
+				in->profile.count_convert(timer);
+			}
+		}
+
+		template<typename OutputType>
+		static inline void
+		prep_load(BasicInput *in, size_t chnum, OutputType *o_re, OutputType *o_im)
+		{
+			size_t raw_offset = in->data_offset + chnum*in->pixels*sizeof(InputType);
+			in->seek(raw_offset, in->pixels*sizeof(InputType));
+
+			undump(in, in->pixels, o_re, o_im);
+		}
+#endif
+
+		template<typename OutputType>
+		static inline void
+		prep_load(BasicInput *in, size_t chnum, OutputType *o_data)
+		{
+			size_t raw_offset = in->data_offset + chnum*in->pixels*sizeof(InputType);
+			in->seek(raw_offset, in->pixels*sizeof(InputType));
+
+			undump(in, in->pixels, o_data);
+		}
+
+		// Read a whole channel into a view with the image size, a chunk
+		// of lines at a time
+		template<typename OutputType>
+		static inline void
+		undump_lines(BasicInput *in, ImageView<OutputType> const& view)
+		{
+			const size_t samples = in->samples;
+			const size_t chunk = std::max(size_t(1), chunk_samples<InputType>()/samples);
+			std::vector<InputType> buf(std::min(chunk, in->lines)*samples);
+			std::vector<OutputType> line(view.sample_stride == 1 ? 0 : samples);
+			for (size_t l = 0; l < in->lines && !failed(); l += chunk) {
+				const size_t n = std::min(chunk, in->lines - l);
+				in->read_samples(buf.data(), n*samples);
+				const Profiler::Timer timer;
+				for (size_t k = 0; k < n; ++k) {
+					InputType const* src = buf.data() + k*samples;
+					if (view.sample_stride == 1) {
+						Kernels::convert(src, view.line(l + k), samples, in->conversion);
+					} else {
+						Kernels::convert(src, line.data(), samples, in->conversion);
+						for (size_t c = 0; c < samples; ++c)
+							view(l + k, c) = line[c];
+					}
+				}
+				in->profile.count_convert(timer);
+			}
+		}
+
+		template<typename OutputType>
+		static inline void
+		undump(BasicInput *in, ImageView<OutputType> const& view)
+		{
+			undump_lines(in, view);
+		}
+
+		// Specialization for matching type: read straight into the lines
+		static inline void
+		undump(BasicInput *in, ImageView<InputType> const& view)
+		{
+			if (view.sample_stride != 1)
+				return undump_lines(in, view);
+			for (size_t l = 0; l < in->lines && !failed(); ++l)
+				in->read_samples(view.line(l), in->samples);
+		}
+
+		template<typename OutputType>
+		static inline void
+		prep_load(BasicInput *in, size_t chnum, ImageView<OutputType> const& view)
+		{
+			size_t raw_offset = in->data_offset + chnum*in->pixels*sizeof(InputType);
+			in->seek(raw_offset, in->pixels*sizeof(InputType));
+
+			if (view.contiguous())
+				return undump(in, in->pixels, view.data);
+			undump(in, view);
+		}
+
+		template<typename OutputType>
+		static inline void
+		prep_load(BasicInput *in, size_t chnum, LineRange<OutputType> const& range)
+		{
+			const size_t count = range.count*in->samples;
+			size_t raw_offset = in->data_offset +
+				(chnum*in->pixels + range.first*in->samples)*sizeof(InputType);
+			in->seek(raw_offset, count*sizeof(InputType));
+
+			undump(in, count, range.data);
+		}
+
+		// Windows as wide as the image are read in one go, others a
+		// line at a time
+		template<typename OutputType>
+		static inline void
+		prep_load(BasicInput *in, size_t chnum, WindowRange<OutputType> const& range)
+		{
+			Window const& w = range.window;
+			const size_t raw_offset = in->data_offset +
+				(chnum*in->pixels + w.line*in->samples + w.sample)*sizeof(InputType);
+			in->seek(raw_offset, w.lines*w.samples*sizeof(InputType));
+			if (w.samples == in->samples)
+				return undump(in, w.lines*w.samples, range.data);
+			for (size_t l = 0; l < w.lines && !failed(); ++l) {
+				if (l)
+					in->reposition(raw_offset + l*in->samples*sizeof(InputType));
+				undump(in, w.samples, range.data + l*w.samples);
+			}
+		}
+
+		// Only the span of each line up to its last kept sample is read
+		template<typename OutputType>
+		static inline void
+		prep_load(BasicInput *in, size_t chnum, Decimation<OutputType> const& dec)
+		{
+			const size_t step = dec.step;
+			const size_t out_lines = (in->lines + step - 1)/step;
+			const size_t out_samples = (in->samples + step - 1)/step;
+			if (!out_lines || !out_samples)
+				return;
+			const size_t span = (out_samples - 1)*step + 1;
+			const size_t raw_offset = in->data_offset + chnum*in->pixels*sizeof(InputType);
+			in->seek(raw_offset, out_lines*span*sizeof(InputType));
+
+			std::vector<InputType> buf(span), kept(step == 1 ? 0 : out_samples);
+			for (size_t l = 0; l < out_lines && !failed(); ++l) {
+				if (l)
+					in->reposition(raw_offset + l*step*in->samples*sizeof(InputType));
+				in->read_samples(buf.data(), span);
+				if (failed())
+					return;
+				const Profiler::Timer timer;
+				InputType const* src = buf.data();
+				if (step != 1) {
+					for (size_t s = 0; s < out_samples; ++s)
+						kept[s] = buf[s*step];
+					src = kept.data();
+				}
+				Kernels::convert(src, dec.data + l*out_samples, out_samples, in->conversion);
+				in->profile.count_convert(timer);
+			}
+		}
+
+		// Load channel chnum into dest (an output pointer, view or line range)
+		template<typename Dest>
 		static inline void
-		load(DataTypeEnum req, Input *in, size_t chnum, std::vector<OutputType>& o_data)
+		load(DataTypeEnum req, BasicInput *in, size_t chnum, Dest dest)
+		{
+			if (req == input_type)
+				return prep_load(in, chnum, dest);
+			// this shouldn't happen:
+			if (input_type == UINT64)
+				return raise(STATUS_UNSUPPORTED, std::invalid_argument("invalid input type"));
+			Loader<next_type(input_type)>::load(req, in, chnum, dest);
+		}
+	};
+
+	template<DataTypeEnum input_type>
+	friend struct Loader;
+
+public:
+	BasicInput(StreamType&& _data, StreamType&& _hdr) :
+		description(),
+		lines(0),
+		samples(0),
+		pixels(0),
+		data_offset(0),
+		channels(),
+		header_bands(0),
+		data(std::move(_data)),
+		hdr(std::move(_hdr)),
+		need_closing(false),
+		conversion(TRUNCATE),
+		swap_bytes(false),
+		has_geo(false),
+		verifying(false),
+		read_pos(0)
+	{
+		prepare_reading();
+	}
+
+	BasicInput(std::string const& fname) :
+		description(),
+		lines(0),
+		samples(0),
+		pixels(0),
+		data_offset(0),
+		channels(),
+		header_bands(0),
+		data(StreamType(fname)),
+		hdr(StreamType(hdr_name(fname))),
+		conversion(TRUNCATE),
+		swap_bytes(false),
+		has_geo(false),
+		verifying(false),
+		read_pos(0)
+	{
+		if (!hdr.good()) {
+			hdr = StreamType(fname + ".hdr");
+		}
+		need_closing = true;
+
+		prepare_reading();
+	}
+
+	std::pair<size_t, size_t> extent() const
+	{ return std::make_pair(lines, samples); }
+
+	// The type of the samples in the data file
+	DataTypeEnum data_type() const
+	{ return input_data_type; }
+
+	// Where the samples start in the data file, and whether they are
+	// stored with a different byte order than ours
+	size_t header_offset() const
+	{ return data_offset; }
+
+	bool foreign_byte_order() const
+	{ return swap_bytes; }
+
+	size_t num_channels() const
+	{ return channels.size(); }
+
+	std::vector<std::string> const& channel_names() const
+	{ return channels; }
+
+	// returned by value: the default for missing keys is a temporary
+	std::string get_meta(std::string const& key) const
+	{ return meta.get(key); }
+
+	template<typename T>
+	T get_meta(std::string const& key, T const& missing) const
+	{ return meta.get(key, missing); }
+
+	template<typename ...T>
+	std::vector<std::string> get_meta_values(std::string const& key) const
+	{ return meta.get_values(key); }
+
+	template<typename ...T>
+	std::tuple<T...> get_meta_tuple(std::string const& key) const
+	{ return meta.get_tuple<T...>(key); }
+
+	bool has_meta(std::string const& key) const
+	{ return meta.has_key(key); }
+
+	template<typename ...T>
+	void get_meta_tuple(std::string const& key, T&... args) const
+	{ std::tie(args...) = meta.get_tuple<T...>(key); }
+
+	// Set the policy used to convert the data to a different type
+	// on load (default: TRUNCATE)
+	void set_conversion(ConversionPolicy policy)
+	{ conversion = policy; }
+
+	ConversionPolicy get_conversion() const
+	{ return conversion; }
+
+	// I/O statistics of this input (all zero without CXXENVI_PROFILE)
+	IOStats const& stats() const
+	{ return profile.stats(); }
+
+	// Call cb with the progress of each channel read (pass an empty
+	// function to stop)
+	void set_progress(ProgressCallback const& cb)
+	{ monitor.set_callback(cb); }
+
+	// Stop channel reads once token is cancelled. The output buffer
+	// contents are then unspecified
+	void set_cancel(std::shared_ptr<CancelToken const> const& token)
+	{ monitor.set_token(token); }
+
+	// Index of the channel with the given name
+	size_t channel_index(std::string const& channel) const
+	{
+		const CallScope call;
+		auto channel_idx(
+			std::find(channels.cbegin(), channels.cend(), channel)
+			);
+
+		if (channel_idx == channels.cend()) {
+			raise(STATUS_NO_CHANNEL, std::runtime_error("channel " + channel + " not found"));
+			return SIZE_MAX;
+		}
+
+		return channel_idx - channels.cbegin();
+	}
+
+	// Load channel number chnum
+	template<typename OutputType>
+	void get_channel(size_t chnum, size_t &o_lines, size_t &o_samples,
+		std::vector<OutputType>& o_data)
+	{
+		const CallScope call;
+		if (chnum >= channels.size())
+			return raise(STATUS_NO_CHANNEL, std::invalid_argument("channel number too high"));
+
+		o_lines = lines;
+		o_samples = samples;
+		o_data.resize(pixels);
+
+		get_channel(chnum, o_data.data());
+	}
+
+	template<typename OutputType>
+	void get_channel(std::string const& channel, size_t &o_lines, size_t &o_samples,
+		std::vector<OutputType>& o_data)
+	{
+		const CallScope call;
+		get_channel(channel_index(channel), o_lines, o_samples, o_data);
+	}
+
+	template<typename OutputType>
+	void get_channel(size_t chnum, OutputType *o_data)
+	{
+		const CallScope call;
+		if (chnum >= channels.size())
+			return raise(STATUS_NO_CHANNEL, std::invalid_argument("channel number too high"));
+
+		Loader<>::load(input_data_type, this, chnum, o_data);
+	}
+
+	// Load channel number chnum into o_data, holding count elements
+	// (at least the image size)
+	template<typename OutputType>
+	void get_channel(size_t chnum, OutputType *o_data, size_t count)
+	{
+		const CallScope call;
+		if (count < pixels)
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("output buffer too small"));
+		get_channel(chnum, o_data);
+	}
+
+	// Load channel number chnum into a view, of any layout, with the
+	// image size
+	template<typename OutputType>
+	void get_channel(size_t chnum, ImageView<OutputType> const& view)
+	{
+		const CallScope call;
+		if (chnum >= channels.size())
+			return raise(STATUS_NO_CHANNEL, std::invalid_argument("channel number too high"));
+		if (view.lines != lines || view.samples != samples)
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("wrong view size"));
+
+		Loader<>::load(input_data_type, this, chnum, view);
+	}
+
+	template<typename OutputType>
+	void get_channel(std::string const& channel, ImageView<OutputType> const& view)
+	{
+		const CallScope call;
+		get_channel(channel_index(channel), view);
+	}
+
+	// Load count lines of channel chnum, starting from first_line
+	template<typename OutputType>
+	void get_lines(size_t chnum, size_t first_line, size_t count, OutputType *o_data)
+	{
+		const CallScope call;
+		if (chnum >= channels.size())
+			return raise(STATUS_NO_CHANNEL, std::invalid_argument("channel number too high"));
+		if (first_line > lines || count > lines - first_line)
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("lines out of range"));
+
+		const LineRange<OutputType> range = { o_data, first_line, count };
+		Loader<>::load(input_data_type, this, chnum, range);
+	}
+
+	// Load a window of channel chnum, its lines one after the other
+	template<typename OutputType>
+	void get_window(size_t chnum, Window const& window, OutputType *o_data)
+	{
+		const CallScope call;
+		if (chnum >= channels.size())
+			return raise(STATUS_NO_CHANNEL, std::invalid_argument("channel number too high"));
+		if (window.line > lines || window.lines > lines - window.line ||
+			window.sample > samples || window.samples > samples - window.sample)
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("window out of range"));
+		if (window.empty())
+			return;
+
+		const WindowRange<OutputType> range = { o_data, window };
+		Loader<>::load(input_data_type, this, chnum, range);
+	}
+
+	// Does the header have a valid 'map info'?
+	bool has_geotransform() const
+	{ return has_geo; }
+
+	// The parsed 'map info' of the header
+	GeoTransform const& geotransform() const
+	{ return geo; }
+
+	// The window of pixels covering the map rectangle between (x0, y0)
+	// and (x1, y1), empty if it is outside the image
+	Window map_window(double x0, double y0, double x1, double y1) const
+	{
+		const CallScope call;
+		if (!has_geo) {
+			raise(STATUS_INVALID_HEADER, std::runtime_error("no valid 'map info' in header"));
+			const Window none = { 0, 0, 0, 0 };
+			return none;
+		}
+		return geo.window(x0, y0, x1, y1, lines, samples);
+	}
+
+	// Load the window of channel chnum covering a map rectangle,
+	// returning it (geotransform().crop() gives its 'map info')
+	template<typename OutputType>
+	Window get_map_crop(size_t chnum, double x0, double y0, double x1, double y1,
+		std::vector<OutputType>& o_data)
+	{
+		const CallScope call;
+		const Window window = map_window(x0, y0, x1, y1);
+		o_data.resize(window.lines*window.samples);
+		if (!failed())
+			get_window(chnum, window, o_data.data());
+		return window;
+	}
+
+	// Size of the images loaded by get_decimated() with the given step
+	std::pair<size_t, size_t> decimated_extent(size_t step) const
+	{
+		step = std::max(step, size_t(1));
+		return std::make_pair((lines + step - 1)/step, (samples + step - 1)/step);
+	}
+
+	// Load every step-th sample of every step-th line of channel chnum,
+	// for previews: lines in between are not read at all
+	template<typename OutputType>
+	void get_decimated(size_t chnum, size_t step, OutputType *o_data)
+	{
+		const CallScope call;
+		if (chnum >= channels.size())
+			return raise(STATUS_NO_CHANNEL, std::invalid_argument("channel number too high"));
+		if (!step)
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("decimation step must be positive"));
+
+		const Decimation<OutputType> dec = { o_data, step };
+		Loader<>::load(input_data_type, this, chnum, dec);
+	}
+
+	// Load count lines of all the channels, starting from first_line,
+	// one channel after the other
+	template<typename OutputType>
+	void get_block(size_t first_line, size_t count, OutputType *o_data)
+	{
+		const CallScope call;
+		for (size_t ch = 0; ch < channels.size() && !failed(); ++ch)
+			get_lines(ch, first_line, count, o_data + ch*count*samples);
+	}
+
+	// Load count lines of the given channels, starting from first_line,
+	// one channel after the other in the order given. Channels that are
+	// not listed are not read at all, so e.g. good_channels() skips the
+	// I/O for the bad bands
+	template<typename OutputType>
+	void get_block(size_t first_line, size_t count, std::vector<size_t> const& chans,
+		OutputType *o_data)
+	{
+		const CallScope call;
+		for (size_t k = 0; k < chans.size() && !failed(); ++k)
+			get_lines(chans[k], first_line, count, o_data + k*count*samples);
+	}
+
+	// Does the header (or a loaded manifest) have checksums of the data?
+	bool has_checksums() const
+	{ return !sums.empty(); }
+
+	// Lines per checksummed chunk of each channel
+	size_t checksum_lines() const
+	{ return sums.chunk_lines(); }
+
+	// Take the checksums from a manifest saved by Output::set_checksums()
+	void load_checksums(std::string const& fname)
+	{
+		const CallScope call;
+		const auto manifest = Checksums::load(fname);
+		if (failed())
+			return;
+		expect_checksums(manifest.first, manifest.second);
+		if (sums.empty())
+			return raise(STATUS_INVALID_HEADER, std::runtime_error("checksums do not match the data: " + fname));
+	}
+
+	// Check the chunks that the get_*() functions read in full (from
+	// their first line, in order) against their checksums as they are
+	// loaded, raising STATUS_READ_FAILED on a mismatch
+	void set_verify(bool enable)
+	{ verifying = enable; }
+
+	// Read all the data to check its checksums, about 16MB at a time,
+	// hashing the chunks of each block on threads threads (0 for one
+	// per hardware thread). Returns the channel and first line of each
+	// corrupt chunk
+	std::vector<std::pair<size_t, size_t>> verify(size_t threads = 0)
+	{
+		const CallScope call;
+		std::vector<std::pair<size_t, size_t>> bad;
+		if (sums.empty()) {
+			raise(STATUS_UNSUPPORTED, std::runtime_error("no checksums to verify"));
+			return bad;
+		}
+		const size_t per_channel = sums.chunks_per_channel();
+		const size_t total = channels.size()*per_channel;
+		const uint64_t band_bytes = uint64_t(pixels)*type_size(input_data_type);
+		const uint64_t chunk_bytes = uint64_t(sums.chunk_lines())*samples*type_size(input_data_type);
+		const size_t block_bytes = size_t(16) << 20;
+		// the last chunk of each channel may be shorter
+		auto length = [&](size_t chunk) {
+			return std::min(chunk_bytes, band_bytes - uint64_t(chunk%per_channel)*chunk_bytes);
+		};
+		auto check = [&](size_t chunk, uint32_t crc) {
+			if (!sums.matches(chunk, crc))
+				bad.push_back(std::make_pair(chunk/per_channel, chunk%per_channel*sums.chunk_lines()));
+		};
+
+		// the chunks of all the channels follow each other
+		seek(data_offset, channels.size()*band_bytes);
+		if (chunk_bytes <= block_bytes) {
+			// whole chunks per block, each hashed by one thread
+			const size_t per_block = size_t(block_bytes/std::max(chunk_bytes, uint64_t(1)));
+			std::vector<char> buf(size_t(std::min(uint64_t(per_block), uint64_t(total))*chunk_bytes));
+			std::vector<size_t> offsets(per_block + 1, 0);
+			std::vector<uint32_t> crcs(per_block);
+			for (size_t first = 0; first < total; first += per_block) {
+				const size_t count = std::min(per_block, total - first);
+				for (size_t i = 0; i < count; ++i)
+					offsets[i + 1] = offsets[i] + size_t(length(first + i));
+				read_bytes(buf.data(), offsets[count]);
+				if (failed())
+					return bad;
+				parallel_for(count, threads, [&](size_t begin, size_t end) {
+					for (size_t i = begin; i < end; ++i)
+						crcs[i] = Kernels::crc32c(0, buf.data() + offsets[i], offsets[i + 1] - offsets[i]);
+				});
+				for (size_t i = 0; i < count; ++i)
+					check(first + i, crcs[i]);
+			}
+			return bad;
+		}
+
+		// chunks larger than a block: split each block between the
+		// threads, and combine their checksums
+		const size_t parts = thread_count(threads);
+		std::vector<char> buf(block_bytes);
+		std::vector<uint32_t> crcs(parts);
+		for (size_t chunk = 0; chunk < total; ++chunk) {
+			const uint64_t size = length(chunk);
+			uint32_t crc = 0;
+			for (uint64_t done = 0; done < size; done += buf.size()) {
+				const size_t n = size_t(std::min(uint64_t(buf.size()), size - done));
+				read_bytes(buf.data(), n);
+				if (failed())
+					return bad;
+				parallel_for(parts, parts, [&](size_t begin, size_t end) {
+					for (size_t t = begin; t < end; ++t)
+						crcs[t] = Kernels::crc32c(0, buf.data() + n*t/parts, n*(t + 1)/parts - n*t/parts);
+				});
+				for (size_t t = 0; t < parts; ++t)
+					crc = Checksums::combine(crc, crcs[t], n*(t + 1)/parts - n*t/parts);
+			}
+			check(chunk, crc);
+		}
+		return bad;
+	}
+
+	Result<std::vector<std::pair<size_t, size_t>>> try_verify(size_t threads = 0) noexcept
+	{
+		Result<std::vector<std::pair<size_t, size_t>>> ret;
+		ret.status = capture(STATUS_READ_FAILED, [&]() { ret.value = verify(threads); });
+		return ret;
+	}
+
+	// Is channel chnum flagged as bad in the header's 'bbl'?
+	bool is_bad_band(size_t chnum) const
+	{ return chnum < bad_bands.size() && bad_bands[chnum]; }
+
+	// The channels not flagged as bad, in order
+	std::vector<size_t> good_channels() const
+	{
+		std::vector<size_t> ret;
+		for (size_t ch = 0; ch < channels.size(); ++ch)
+			if (!is_bad_band(ch))
+				ret.push_back(ch);
+		return ret;
+	}
+
+	// The channel whose wavelength is nearest to wavelength (in nm),
+	// optionally ignoring bad bands. Returns SIZE_MAX (after raising)
+	// if the header has no wavelength per channel or no channel is left
+	size_t channel_at(double wavelength, bool skip_bad = false) const
+	{
+		if (wavelength_order.empty()) {
+			raise(STATUS_NO_CHANNEL, std::runtime_error("no wavelengths for the channels"));
+			return SIZE_MAX;
+		}
+
+		const auto pos = std::lower_bound(wavelength_order.cbegin(), wavelength_order.cend(), wavelength,
+			[this](size_t ch, double w) { return band_wavelengths[ch] < w; });
+
+		// the nearest usable channel on each side of the insertion point
+		auto hi = pos;
+		while (hi != wavelength_order.cend() && skip_bad && bad_bands[*hi])
+			++hi;
+		auto lo = pos;
+		while (lo != wavelength_order.cbegin() && skip_bad && bad_bands[*(lo - 1)])
+			--lo;
+
+		if (lo == wavelength_order.cbegin() && hi == wavelength_order.cend()) {
+			raise(STATUS_NO_CHANNEL, std::runtime_error("no good channels"));
+			return SIZE_MAX;
+		}
+		if (lo == wavelength_order.cbegin())
+			return *hi;
+		if (hi == wavelength_order.cend())
+			return *(lo - 1);
+		return band_wavelengths[*hi] - wavelength < wavelength - band_wavelengths[*(lo - 1)]
+			? *hi : *(lo - 1);
+	}
+
+	// The channels with wavelengths (in nm) in [lo, hi], sorted by
+	// wavelength, optionally without the bad bands
+	std::vector<size_t> channels_between(double lo, double hi, bool skip_bad = false) const
+	{
+		std::vector<size_t> ret;
+		auto it = std::lower_bound(wavelength_order.cbegin(), wavelength_order.cend(), lo,
+			[this](size_t ch, double w) { return band_wavelengths[ch] < w; });
+		for (; it != wavelength_order.cend() && band_wavelengths[*it] <= hi; ++it)
+			if (!skip_bad || !bad_bands[*it])
+				ret.push_back(*it);
+		return ret;
+	}
+
+	// Load the channel nearest to wavelength (in nm), returning its
+	// number (SIZE_MAX on failure)
+	template<typename OutputType>
+	size_t get_channel_at(double wavelength, OutputType *o_data, bool skip_bad = false)
+	{
+		const CallScope call;
+		const size_t ch = channel_at(wavelength, skip_bad);
+		if (ch != SIZE_MAX)
+			get_channel(ch, o_data);
+		return ch;
+	}
+
+	// Is this an ENVI spectral library (.sli)? These have a single
+	// channel, with a spectrum per line and a wavelength per sample
+	bool is_spectral_library() const
+	{
+		std::string type = meta.get("file type");
+		std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+		return type == "envi spectral library";
+	}
+
+	// The names of the spectra of a spectral library
+	std::vector<std::string> spectra_names() const
+	{ return meta.get_values("spectra names"); }
+
+	// Load the spectra of a spectral library, one after the other
+	template<typename OutputType>
+	void get_spectra(std::vector<OutputType>& o_data)
+	{
+		const CallScope call;
+		if (!is_spectral_library())
+			return raise(STATUS_UNSUPPORTED, std::invalid_argument("not a spectral library"));
+		if (channels.size() != 1)
+			return raise(STATUS_INVALID_HEADER, std::runtime_error("spectral library with multiple bands"));
+		o_data.resize(pixels);
+		get_channel(0, o_data.data());
+	}
+
+	// The header's 'data ignore value', or NaN if there is none
+	double ignore_value() const
+	{ return meta.get("data ignore value", std::numeric_limits<double>::quiet_NaN()); }
+
+	// The wavelength (center) of each channel (or sample, for spectral
+	// libraries) in nanometers, or an empty vector if the header doesn't
+	// have them. Wavelengths in micrometers or millimeters are converted,
+	// anything else is assumed to be nm
+	std::vector<double> const& wavelengths() const
+	{ return band_wavelengths; }
+
+	// The full width at half maximum of each channel, in nanometers, or
+	// an empty vector if the header doesn't have them
+	std::vector<double> fwhm() const
+	{ return wavelength_values("fwhm"); }
+
+#if CXXENVI_COMPLEX
+	// Load channel number chnum of a complex file, reducing each sample
+	// to a real value (magnitude, power, phase or power in dB)
+	template<typename OutputType>
+	void get_channel(size_t chnum, OutputType *o_data, ComplexReduction mode)
+	{
+		const CallScope call;
+		if (chnum >= channels.size())
+			return raise(STATUS_NO_CHANNEL, std::invalid_argument("channel number too high"));
+
+		switch (input_data_type) {
+		case FP32C:
+			return Loader<FP32C>::prep_load(this, chnum, o_data, mode);
+		case FP64C:
+			return Loader<FP64C>::prep_load(this, chnum, o_data, mode);
+		default:
+			raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("complex reduction requested on real data"));
+		}
+	}
+
+	template<typename OutputType>
+	void get_channel(size_t chnum, size_t &o_lines, size_t &o_samples,
+		std::vector<OutputType>& o_data, ComplexReduction mode)
+	{
+		const CallScope call;
+		if (chnum >= channels.size())
+			return raise(STATUS_NO_CHANNEL, std::invalid_argument("channel number too high"));
+
+		o_lines = lines;
+		o_samples = samples;
+		o_data.resize(pixels);
+
+		get_channel(chnum, o_data.data(), mode);
+	}
+
+	template<typename OutputType>
+	void get_channel(std::string const& channel, size_t &o_lines, size_t &o_samples,
+		std::vector<OutputType>& o_data, ComplexReduction mode)
+	{
+		const CallScope call;
+		get_channel(channel_index(channel), o_lines, o_samples, o_data, mode);
+	}
+
+	// Load channel number chnum into separate (planar) buffers for the
+	// real and imaginary parts. Real data is loaded with a zero
+	// imaginary part
+	template<typename OutputType>
+	void get_channel(size_t chnum, OutputType *o_re, OutputType *o_im)
+	{
+		const CallScope call;
+		if (chnum >= channels.size())
+			return raise(STATUS_NO_CHANNEL, std::invalid_argument("channel number too high"));
+
+		switch (input_data_type) {
+		case FP32C:
+			return Loader<FP32C>::prep_load(this, chnum, o_re, o_im);
+		case FP64C:
+			return Loader<FP64C>::prep_load(this, chnum, o_re, o_im);
+		default:
+			Loader<>::load(input_data_type, this, chnum, o_re);
+			std::fill(o_im, o_im + pixels, OutputType());
+		}
+	}
+
+	template<typename OutputType>
+	void get_channel(size_t chnum, size_t &o_lines, size_t &o_samples,
+		std::vector<OutputType>& o_re, std::vector<OutputType>& o_im)
+	{
+		const CallScope call;
+		if (chnum >= channels.size())
+			return raise(STATUS_NO_CHANNEL, std::invalid_argument("channel number too high"));
+
+		o_lines = lines;
+		o_samples = samples;
+		o_re.resize(pixels);
+		o_im.resize(pixels);
+
+		get_channel(chnum, o_re.data(), o_im.data());
+	}
+
+	template<typename OutputType>
+	void get_channel(std::string const& channel, size_t &o_lines, size_t &o_samples,
+		std::vector<OutputType>& o_re, std::vector<OutputType>& o_im)
+	{
+		const CallScope call;
+		get_channel(channel_index(channel), o_lines, o_samples, o_re, o_im);
+	}
+#endif
+
+	// Non-throwing get_channel(). Missing channels are checked upfront,
+	// so they are cheap to report even with exceptions enabled
+	template<typename OutputType>
+	Status try_get_channel(size_t chnum, OutputType *o_data) noexcept
+	{
+		if (chnum >= channels.size())
+			return Status(STATUS_NO_CHANNEL, "channel number too high");
+		return capture(STATUS_READ_FAILED, [&]() { get_channel(chnum, o_data); });
+	}
+
+	template<typename OutputType>
+	Status try_get_channel(std::string const& channel, OutputType *o_data) noexcept
+	{
+		const auto found = std::find(channels.cbegin(), channels.cend(), channel);
+		if (found == channels.cend())
+			return Status(STATUS_NO_CHANNEL, "channel " + channel + " not found");
+		return try_get_channel(found - channels.cbegin(), o_data);
+	}
+
+	template<typename OutputType>
+	Status try_get_channel(size_t chnum, std::vector<OutputType>& o_data) noexcept
+	{
+		if (chnum >= channels.size())
+			return Status(STATUS_NO_CHANNEL, "channel number too high");
+		return capture(STATUS_READ_FAILED, [&]() {
+			o_data.resize(pixels);
+			get_channel(chnum, o_data.data());
+		});
+	}
+
+	~BasicInput()
+	{
+		if (need_closing)
+			close();
+	}
+};
+
+// Band math: expressions over the channels of one or more inputs, such as
+// (b[800nm] - b[670nm])/(b[800nm] + b[670nm]), evaluated a block of lines
+// at a time, so memory use is bounded by the block size rather than by the
+// size of the images. Inputs are added under a name, and their channels
+// selected with
+// 	name[3]		by (0-based) index
+// 	name["Red"]	by band name
+// 	name[800nm]	by nearest wavelength (nm or um)
+// Expressions can use numbers, parentheses, + - * / ^ and the functions
+// sqrt, abs, log, exp, min and max. Evaluation is in single precision
+class ENVI::BandMath
+{
+	// Operations of a compiled expression, binary ones first
+	enum OpCode { ADD, SUB, MUL, DIV, POW, MIN, MAX, NEG, SQRT, ABS, LOG, EXP, BAND, CONSTANT };
+
+	struct Op
+	{
+		OpCode code;
+		// for BAND, the index in the bands of the expression
+		size_t band;
+		// for CONSTANT, its value
+		float value;
+	};
+
+	// A channel of an input
+	struct Band
+	{
+		size_t input;
+		size_t channel;
+
+		bool operator==(Band const& other) const
+		{ return input == other.input && channel == other.channel; }
+	};
+
+	// An input, and how to load its lines
+	struct Source
+	{
+		std::string name;
+		std::vector<std::string> channels;
+		std::vector<double> wavelengths;
+		std::function<void(size_t, size_t, size_t, float*)> load;
+	};
+
+public:
+	// A compiled expression. It can only be evaluated by the BandMath
+	// that compiled it
+	class Expression
+	{
+		friend class BandMath;
+		// the operations, in postfix order
+		std::vector<Op> program;
+		// the channels it reads
+		std::vector<Band> bands;
+		// the deepest the evaluation stack gets
+		size_t depth;
+
+	public:
+		Expression() : depth(0) {}
+
+		bool empty() const
+		{ return program.empty(); }
+	};
+
+private:
+	std::vector<Source> sources;
+	size_t lines, samples;
+	size_t threads;
+	size_t block_lines;
+
+	// Number of samples each thread evaluates at a time
+	enum { chunk = 1024 };
+
+	// A value on the evaluation stack: a run of samples, or a scalar
+	// if data is null
+	struct Operand
+	{
+		float const* data;
+		float value;
+	};
+
+	struct Add { float operator()(float a, float b) const { return a + b; } };
+	struct Sub { float operator()(float a, float b) const { return a - b; } };
+	struct Mul { float operator()(float a, float b) const { return a * b; } };
+	struct Div { float operator()(float a, float b) const { return a / b; } };
+	struct Pow { float operator()(float a, float b) const { return std::pow(a, b); } };
+	struct Min { float operator()(float a, float b) const { return b < a ? b : a; } };
+	struct Max { float operator()(float a, float b) const { return a < b ? b : a; } };
+	struct Neg { float operator()(float a) const { return -a; } };
+	struct Sqrt { float operator()(float a) const { return std::sqrt(a); } };
+	struct Abs { float operator()(float a) const { return std::fabs(a); } };
+	struct Log { float operator()(float a) const { return std::log(a); } };
+	struct Exp { float operator()(float a) const { return std::exp(a); } };
+
+	// Apply f to n samples of a and b, leaving the result in a. The
+	// loops are kept separate for the scalar cases, so that each one
+	// vectorizes
+	template<typename F>
+	static void binary(F f, Operand& a, Operand const& b, float* out, size_t n)
+	{
+		if (a.data && b.data) {
+			for (size_t i = 0; i < n; ++i)
+				out[i] = f(a.data[i], b.data[i]);
+		} else if (a.data) {
+			const float v = b.value;
+			for (size_t i = 0; i < n; ++i)
+				out[i] = f(a.data[i], v);
+		} else if (b.data) {
+			const float v = a.value;
+			for (size_t i = 0; i < n; ++i)
+				out[i] = f(v, b.data[i]);
+		} else {
+			a.value = f(a.value, b.value);
+			return;
+		}
+		a.data = out;
+	}
+
+	template<typename F>
+	static void unary(F f, Operand& a, float* out, size_t n)
+	{
+		if (!a.data) {
+			a.value = f(a.value);
+			return;
+		}
+		for (size_t i = 0; i < n; ++i)
+			out[i] = f(a.data[i]);
+		a.data = out;
+	}
+
+	// Apply the operation to the operand(s) ending at top, writing
+	// n samples of the result to out if it isn't a scalar
+	static void apply(OpCode code, Operand* top, float* out, size_t n)
+	{
+		switch (code) {
+		case ADD: return binary(Add(), top[-1], top[0], out, n);
+		case SUB: return binary(Sub(), top[-1], top[0], out, n);
+		case MUL: return binary(Mul(), top[-1], top[0], out, n);
+		case DIV: return binary(Div(), top[-1], top[0], out, n);
+		case POW: return binary(Pow(), top[-1], top[0], out, n);
+		case MIN: return binary(Min(), top[-1], top[0], out, n);
+		case MAX: return binary(Max(), top[-1], top[0], out, n);
+		case NEG: return unary(Neg(), top[0], out, n);
+		case SQRT: return unary(Sqrt(), top[0], out, n);
+		case ABS: return unary(Abs(), top[0], out, n);
+		case LOG: return unary(Log(), top[0], out, n);
+		case EXP: return unary(Exp(), top[0], out, n);
+		default: return;
+		}
+	}
+
+	// Run the program on n samples, with bands pointing at the data of
+	// the expression bands, and temp having room for depth chunks
+	static void run(Expression const& expr, float const* const* bands,
+		float* temp, std::vector<Operand>& stack, float* out, size_t n)
+	{
+		stack.clear();
+		for (auto const& op : expr.program) {
+			if (op.code == BAND || op.code == CONSTANT) {
+				const Operand value = { op.code == BAND ? bands[op.band] : nullptr, op.value };
+				stack.push_back(value);
+				continue;
+			}
+			// the result replaces the first operand, in its temp slot
+			const bool is_unary = op.code >= NEG;
+			const size_t slot = stack.size() - (is_unary ? 1 : 2);
+			apply(op.code, &stack.back(), temp + slot*chunk, n);
+			if (!is_unary)
+				stack.pop_back();
+		}
+		Operand const& result = stack.back();
+		if (!result.data)
+			std::fill(out, out + n, result.value);
+		else
+			std::copy(result.data, result.data + n, out);
+	}
+
+	// Recursive descent parser, compiling an expression to postfix
+	class Parser
+	{
+		BandMath const& math;
+		std::string const& text;
+		Expression& expr;
+		size_t pos;
+		// current height of the evaluation stack
+		size_t height;
+
+		bool error(std::string const& msg)
+		{
+			raise(STATUS_INVALID_ARGUMENT, std::invalid_argument(msg +
+				" at position " + std::to_string(pos) + " of '" + text + "'"));
+			return false;
+		}
+
+		void skip_space()
+		{
+			while (pos < text.size() && std::isspace((unsigned char)text[pos]))
+				++pos;
+		}
+
+		bool accept(char c)
+		{
+			skip_space();
+			if (pos < text.size() && text[pos] == c) {
+				++pos;
+				return true;
+			}
+			return false;
+		}
+
+		bool at_number()
+		{
+			skip_space();
+			return pos < text.size() &&
+				(std::isdigit((unsigned char)text[pos]) || text[pos] == '.');
+		}
+
+		bool number(double& value)
+		{
+			if (!at_number())
+				return false;
+			const char *start = text.c_str() + pos;
+			char *end;
+			value = std::strtod(start, &end);
+			pos += end - start;
+			return end != start;
+		}
+
+		std::string identifier()
+		{
+			skip_space();
+			const size_t start = pos;
+			while (pos < text.size() &&
+				(std::isalnum((unsigned char)text[pos]) || text[pos] == '_'))
+				++pos;
+			return text.substr(start, pos - start);
+		}
+
+		// Append an operation, folding it if its operands are constants
+		void emit(OpCode code, size_t band = 0, float value = 0)
+		{
+			if (code == BAND || code == CONSTANT) {
+				expr.depth = std::max(expr.depth, ++height);
+			} else {
+				const size_t args = code < NEG ? 2 : 1;
+				if (code < NEG)
+					--height;
+				auto& prog = expr.program;
+				if (prog.size() >= args &&
+					std::all_of(prog.end() - args, prog.end(),
+						[](Op const& op) { return op.code == CONSTANT; })) {
+					Operand ops[2] = { { nullptr, prog[prog.size() - args].value },
+						{ nullptr, prog.back().value } };
+					apply(code, &ops[args - 1], nullptr, 0);
+					prog.resize(prog.size() - args);
+					code = CONSTANT;
+					value = ops[0].value;
+				}
+			}
+			const Op op = { code, band, value };
+			expr.program.push_back(op);
+		}
+
+		// Compile a channel selector, after name[
+		bool band(std::string const& name)
+		{
+			size_t input = 0;
+			while (input < math.sources.size() && math.sources[input].name != name)
+				++input;
+			if (input == math.sources.size())
+				return error("unknown input '" + name + "'");
+			Source const& src = math.sources[input];
+
+			size_t channel = 0;
+			double value;
+			if (accept('"')) {
+				const size_t end = text.find('"', pos);
+				if (end == text.npos)
+					return error("unterminated band name");
+				const std::string label = text.substr(pos, end - pos);
+				channel = std::find(src.channels.begin(), src.channels.end(), label) -
+					src.channels.begin();
+				if (channel == src.channels.size())
+					return error("no band named '" + label + "' in '" + name + "'");
+				pos = end + 1;
+			} else if (number(value)) {
+				std::string unit = identifier();
+				if (unit.empty() && text.compare(pos, 3, "\xc2\xb5m") == 0) {
+					// micro sign
+					pos += 3;
+					unit = "um";
+				}
+				if (unit.empty()) {
+					if (value != std::floor(value) || value >= src.channels.size())
+						return error("band index out of range for '" + name + "'");
+					channel = size_t(value);
+				} else if (unit == "nm" || unit == "um") {
+					if (src.wavelengths.size() != src.channels.size())
+						return error("'" + name + "' has no wavelengths");
+					const double wl = unit == "um" ? value*1e3 : value;
+					for (size_t c = 1; c < src.wavelengths.size(); ++c)
+						if (std::fabs(src.wavelengths[c] - wl) <
+							std::fabs(src.wavelengths[channel] - wl))
+							channel = c;
+				} else {
+					return error("unknown wavelength unit '" + unit + "'");
+				}
+			} else {
+				return error("expected a band index, name or wavelength");
+			}
+			if (!accept(']'))
+				return error("expected ']'");
+
+			const Band b = { input, channel };
+			const size_t idx = std::find(expr.bands.begin(), expr.bands.end(), b) -
+				expr.bands.begin();
+			if (idx == expr.bands.size())
+				expr.bands.push_back(b);
+			emit(BAND, idx);
+			return true;
+		}
+
+		// Compile a function call, after name(
+		bool function(std::string const& name)
+		{
+			static const struct { char const* name; OpCode code; size_t args; } functions[] = {
+				{ "sqrt", SQRT, 1 }, { "abs", ABS, 1 }, { "log", LOG, 1 },
+				{ "exp", EXP, 1 }, { "min", MIN, 2 }, { "max", MAX, 2 },
+			};
+			for (auto const& f : functions) {
+				if (name != f.name)
+					continue;
+				for (size_t a = 0; a < f.args; ++a) {
+					if (a && !accept(','))
+						return error("expected ','");
+					if (!expression())
+						return false;
+				}
+				if (!accept(')'))
+					return error("expected ')'");
+				emit(f.code);
+				return true;
+			}
+			return error("unknown function '" + name + "'");
+		}
+
+		bool primary()
+		{
+			if (accept('(')) {
+				if (!expression())
+					return false;
+				return accept(')') || error("expected ')'");
+			}
+			double value;
+			if (at_number()) {
+				if (!number(value))
+					return error("invalid number");
+				emit(CONSTANT, 0, float(value));
+				return true;
+			}
+			const std::string name = identifier();
+			if (name.empty())
+				return error("expected a value");
+			if (accept('('))
+				return function(name);
+			if (accept('['))
+				return band(name);
+			return error("expected '(' or '[' after '" + name + "'");
+		}
+
+		// exponentiation is right-associative, and binds tighter than
+		// unary minus on its left (-2^2 is -4)
+		bool power()
+		{
+			if (!primary())
+				return false;
+			if (accept('^')) {
+				if (!unary())
+					return false;
+				emit(POW);
+			}
+			return true;
+		}
+
+		bool unary()
+		{
+			if (accept('-')) {
+				if (!unary())
+					return false;
+				emit(NEG);
+				return true;
+			}
+			if (accept('+'))
+				return unary();
+			return power();
+		}
+
+		bool term()
+		{
+			if (!unary())
+				return false;
+			for (;;) {
+				const OpCode code = accept('*') ? MUL : accept('/') ? DIV : BAND;
+				if (code == BAND)
+					return true;
+				if (!unary())
+					return false;
+				emit(code);
+			}
+		}
+
+		bool expression()
+		{
+			if (!term())
+				return false;
+			for (;;) {
+				const OpCode code = accept('+') ? ADD : accept('-') ? SUB : BAND;
+				if (code == BAND)
+					return true;
+				if (!term())
+					return false;
+				emit(code);
+			}
+		}
+
+	public:
+		Parser(BandMath const& _math, std::string const& _text, Expression& _expr) :
+			math(_math), text(_text), expr(_expr), pos(0), height(0)
+		{}
+
+		bool parse()
+		{
+			if (!expression())
+				return false;
+			skip_space();
+			if (pos != text.size())
+				return error("unexpected '" + text.substr(pos, 1) + "'");
+			return true;
+		}
+	};
+
+	// Evaluate expr on n samples, reading the data of band i of the
+	// expression from data[map[i]]
+	void compute(Expression const& expr, std::vector<size_t> const& map,
+		std::vector<std::vector<float>> const& data, float* out, size_t n) const
+	{
+		parallel_for((n + chunk - 1)/chunk, threads, [&](size_t begin, size_t end) {
+			std::vector<float> temp(expr.depth*chunk);
+			std::vector<Operand> stack;
+			stack.reserve(expr.depth);
+			std::vector<float const*> bands(map.size());
+			for (size_t c = begin; c < end; ++c) {
+				const size_t offset = c*chunk;
+				for (size_t b = 0; b < map.size(); ++b)
+					bands[b] = data[map[b]].data() + offset;
+				run(expr, bands.data(), temp.data(), stack, out + offset,
+					std::min(size_t(chunk), n - offset));
+			}
+		});
+	}
+
+public:
+	BandMath() : lines(0), samples(0), threads(0), block_lines(0)
+	{}
+
+	// Make the channels of input available to expressions as name[...].
+	// All inputs must have the same extent, and stay open while in use
+	template<typename StreamType>
+	void add_input(std::string const& name, BasicInput<StreamType>& input)
+	{
+		const CallScope call;
+		if (name.empty() || std::isdigit((unsigned char)name[0]) ||
+			!std::all_of(name.begin(), name.end(), [](char c) {
+				return std::isalnum((unsigned char)c) || c == '_'; }))
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("invalid input name '" + name + "'"));
+		for (auto const& src : sources)
+			if (src.name == name)
+				return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("input '" + name + "' added twice"));
+
+		const auto extent = input.extent();
+		if (sources.empty()) {
+			lines = extent.first;
+			samples = extent.second;
+		} else if (extent != std::make_pair(lines, samples)) {
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("extent of input '" + name + "' differs"));
+		}
+
+		Source src;
+		src.name = name;
+		src.channels = input.channel_names();
+		src.wavelengths = input.wavelengths();
+		BasicInput<StreamType> *in = &input;
+		src.load = [in](size_t ch, size_t first, size_t count, float* out) {
+			in->get_lines(ch, first, count, out);
+		};
+		sources.push_back(std::move(src));
+	}
+
+	template<typename StreamType>
+	Status try_add_input(std::string const& name, BasicInput<StreamType>& input) noexcept
+	{ return capture(STATUS_INVALID_ARGUMENT, [&]() { add_input(name, input); }); }
+
+	// Number of threads evaluating each block; 0 (the default) uses one
+	// per hardware thread
+	void set_threads(size_t count)
+	{ threads = count; }
+
+	// Number of lines loaded and evaluated at a time; 0 (the default)
+	// picks about 1MB of samples per channel
+	void set_block_lines(size_t count)
+	{ block_lines = count; }
+
+	// Compile an expression over the inputs added so far
+	Expression compile(std::string const& text) const
+	{
+		const CallScope call;
+		Expression expr;
+		Parser parser(*this, text, expr);
+		if (!parser.parse())
+			return Expression();
+		return expr;
+	}
+
+	Result<Expression> try_compile(std::string const& text) const noexcept
+	{
+		Result<Expression> ret;
+		ret.status = capture(STATUS_INVALID_ARGUMENT, [&]() { ret.value = compile(text); });
+		return ret;
+	}
+
+	// Evaluate each expression as a new channel of output, with the
+	// corresponding name. The channels read by any of the expressions
+	// are loaded once per block
+	template<typename OutputDataType, typename StreamType>
+	void evaluate(Output<OutputDataType, StreamType>& output,
+		std::vector<std::string> const& names, std::vector<Expression> const& exprs)
+	{
+		const CallScope call;
+		if (names.size() != exprs.size())
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("expected one channel name per expression"));
+		for (auto const& expr : exprs)
+			if (expr.empty())
+				return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("empty expression"));
+		if (output.extent() != std::make_pair(lines, samples))
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("extent of output differs from the inputs"));
+
+		std::vector<Band> bands;
+		std::vector<std::vector<size_t>> maps(exprs.size());
+		for (size_t e = 0; e < exprs.size(); ++e) {
+			for (auto const& b : exprs[e].bands) {
+				const size_t idx = std::find(bands.begin(), bands.end(), b) - bands.begin();
+				if (idx == bands.size())
+					bands.push_back(b);
+				maps[e].push_back(idx);
+			}
+		}
+
+		std::vector<size_t> channels;
+		for (auto const& name : names)
+			channels.push_back(output.reserve_channel(name));
+
+		const size_t block = block_lines ? block_lines :
+			std::max(size_t(1), (size_t(1) << 18)/std::max(samples, size_t(1)));
+		const size_t block_samples = std::min(block, lines)*samples;
+		std::vector<std::vector<float>> data(bands.size(), std::vector<float>(block_samples));
+		std::vector<float> result(block_samples);
+
+		for (size_t first = 0; first < lines; first += block) {
+			const size_t count = std::min(block, lines - first);
+			for (size_t b = 0; b < bands.size(); ++b) {
+				sources[bands[b].input].load(bands[b].channel, first, count, data[b].data());
+				if (failed())
+					return;
+			}
+			for (size_t e = 0; e < exprs.size(); ++e) {
+				compute(exprs[e], maps[e], data, result.data(), count*samples);
+				output.write_lines(channels[e], first, result.data(), count);
+				if (failed())
+					return;
+			}
+		}
+	}
+
+	// Evaluate a single expression as a new channel of output
+	template<typename OutputDataType, typename StreamType>
+	void evaluate(Output<OutputDataType, StreamType>& output,
+		std::string const& name, Expression const& expr)
+	{
+		const CallScope call;
+		evaluate(output, std::vector<std::string>(1, name), std::vector<Expression>(1, expr));
+	}
+
+	template<typename OutputDataType, typename StreamType>
+	Status try_evaluate(Output<OutputDataType, StreamType>& output,
+		std::vector<std::string> const& names, std::vector<Expression> const& exprs) noexcept
+	{ return capture(STATUS_FAILED, [&]() { evaluate(output, names, exprs); }); }
+
+	template<typename OutputDataType, typename StreamType>
+	Status try_evaluate(Output<OutputDataType, StreamType>& output,
+		std::string const& name, Expression const& expr) noexcept
+	{ return capture(STATUS_FAILED, [&]() { evaluate(output, name, expr); }); }
+};
+
+// Principal component analysis of the channels of an input. fit() computes
+// the mean and covariance of the channels in a single pass over the file,
+// a block of lines at a time, and their eigen-decomposition; project() then
+// writes the top components of every pixel to an Output in a second pass.
+// Pixels where any channel has the header's 'data ignore value' (or is NaN)
+// are left out, and written as the ignore value
+class ENVI::PCA
+{
+	size_t channels;
+	uint64_t pixels;
+	std::vector<double> means;
+	// row-major, channels x channels
+	std::vector<double> cov;
+	// in decreasing order, with the matching eigenvectors as rows
+	std::vector<double> values;
+	std::vector<double> vectors;
+	size_t threads;
+	size_t block_lines;
+	bool masking;
+
+	// Number of pixels accumulated at a time by each thread
+	enum { chunk = 256 };
+
+	// Partial sums of a thread, of the samples shifted by the origin
+	struct Sums
+	{
+		uint64_t count;
+		std::vector<double> sum;
+		// upper triangle of the sums of products
+		std::vector<double> cross;
+		// the current chunk, channel by channel
+		std::vector<double> centered;
+		std::vector<char> valid;
+
+		explicit Sums(size_t n) :
+			count(0), sum(n), cross(n*n), centered(n*chunk), valid(chunk)
+		{}
+	};
+
+	// Dot product of two runs of n doubles, with independent partial
+	// sums so that the loop pipelines (and vectorizes)
+	static double dot(double const* a, double const* b, size_t n)
+	{
+		double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4) {
+			s0 += a[i]*b[i];
+			s1 += a[i+1]*b[i+1];
+			s2 += a[i+2]*b[i+2];
+			s3 += a[i+3]*b[i+3];
+		}
+		for (; i < n; ++i)
+			s0 += a[i]*b[i];
+		return (s0 + s1) + (s2 + s3);
+	}
+
+	// Accumulate n pixels into sums, after subtracting the origin
+	void accumulate(std::vector<float const*> const& data, float ignore,
+		std::vector<double> const& origin, Sums& sums, size_t n) const
+	{
+		char *valid = sums.valid.data();
+		valid_pixels(data, ignore, valid, n);
+		for (size_t i = 0; i < n; ++i)
+			sums.count += valid[i];
+
+		// invalid pixels become zeros, which add nothing to the sums
+		for (size_t b = 0; b < channels; ++b) {
+			double *xb = sums.centered.data() + b*chunk;
+			float const* x = data[b];
+			const double o = origin[b];
+			double s = 0;
+			for (size_t i = 0; i < n; ++i) {
+				xb[i] = valid[i] ? x[i] - o : 0;
+				s += xb[i];
+			}
+			sums.sum[b] += s;
+		}
+		for (size_t b = 0; b < channels; ++b) {
+			double const* xb = sums.centered.data() + b*chunk;
+			for (size_t c = b; c < channels; ++c)
+				sums.cross[b*channels + c] +=
+					dot(xb, sums.centered.data() + c*chunk, n);
+		}
+	}
+
+	// Eigen-decomposition of the symmetric n x n matrix a by cyclic
+	// Jacobi rotations, returning the eigenvalues in decreasing order,
+	// and the eigenvectors as the rows of vecs
+	static void eigen(std::vector<double> a, size_t n,
+		std::vector<double>& vals, std::vector<double>& vecs)
+	{
+		std::vector<double> v(n*n, 0);
+		for (size_t i = 0; i < n; ++i)
+			v[i*n + i] = 1;
+
+		double total = 0;
+		for (auto x : a)
+			total += x*x;
+		for (int sweep = 0; sweep < 64; ++sweep) {
+			double off = 0;
+			for (size_t p = 0; p < n; ++p)
+				for (size_t q = p + 1; q < n; ++q)
+					off += a[p*n + q]*a[p*n + q];
+			if (off <= 1e-30*total)
+				break;
+
+			for (size_t p = 0; p < n; ++p) {
+				for (size_t q = p + 1; q < n; ++q) {
+					const double apq = a[p*n + q];
+					if (apq == 0)
+						continue;
+					// the rotation zeroing a[p][q]
+					const double theta = (a[q*n + q] - a[p*n + p])/(2*apq);
+					const double t = (theta < 0 ? -1 : 1)/
+						(std::fabs(theta) + std::sqrt(theta*theta + 1));
+					const double c = 1/std::sqrt(t*t + 1), s = t*c;
+					for (size_t k = 0; k < n; ++k) {
+						const double akp = a[k*n + p], akq = a[k*n + q];
+						a[k*n + p] = c*akp - s*akq;
+						a[k*n + q] = s*akp + c*akq;
+					}
+					for (size_t k = 0; k < n; ++k) {
+						const double apk = a[p*n + k], aqk = a[q*n + k];
+						a[p*n + k] = c*apk - s*aqk;
+						a[q*n + k] = s*apk + c*aqk;
+					}
+					for (size_t k = 0; k < n; ++k) {
+						const double vkp = v[k*n + p], vkq = v[k*n + q];
+						v[k*n + p] = c*vkp - s*vkq;
+						v[k*n + q] = s*vkp + c*vkq;
+					}
+				}
+			}
+		}
+
+		std::vector<size_t> order(n);
+		for (size_t i = 0; i < n; ++i)
+			order[i] = i;
+		std::stable_sort(order.begin(), order.end(),
+			[&](size_t i, size_t j) { return a[i*n + i] > a[j*n + j]; });
+
+		vals.resize(n);
+		vecs.resize(n*n);
+		for (size_t r = 0; r < n; ++r) {
+			const size_t col = order[r];
+			vals[r] = a[col*n + col];
+			// the eigenvectors are the columns of v. Make the largest
+			// element of each positive, for reproducible signs
+			size_t top = 0;
+			for (size_t k = 1; k < n; ++k)
+				if (std::fabs(v[k*n + col]) > std::fabs(v[top*n + col]))
+					top = k;
+			const double sign = v[top*n + col] < 0 ? -1 : 1;
+			for (size_t k = 0; k < n; ++k)
+				vecs[r*n + k] = sign*v[k*n + col];
+		}
+	}
+
+	// Lines per block when loading all the channels of an input:
+	// about 16MB of samples, unless set
+	size_t block_size(size_t samples) const
+	{
+		if (block_lines)
+			return block_lines;
+		return std::max(size_t(1), (size_t(1) << 22)/std::max(channels*samples, size_t(1)));
+	}
+
+	// The value of masked pixels, NaN when not masking
+	template<typename StreamType>
+	float ignore_value(BasicInput<StreamType> const& input) const
+	{
+		return float(masking ? input.ignore_value() : std::numeric_limits<double>::quiet_NaN());
+	}
+
+public:
+	PCA() : channels(0), pixels(0), threads(0), block_lines(0), masking(true)
+	{}
+
+	// Number of threads accumulating or projecting each block; 0 (the
+	// default) uses one per hardware thread
+	void set_threads(size_t count)
+	{ threads = count; }
+
+	// Number of lines loaded at a time; 0 (the default) picks about
+	// 16MB of samples over all channels
+	void set_block_lines(size_t count)
+	{ block_lines = count; }
+
+	// Whether to leave out pixels with the 'data ignore value' (the
+	// default), or only NaNs
+	void set_masking(bool enable)
+	{ masking = enable; }
+
+	// Compute the mean and covariance of the channels of input, and
+	// their principal components
+	template<typename StreamType>
+	void fit(BasicInput<StreamType>& input)
+	{
+		const CallScope call;
+		const size_t lines = input.extent().first, samples = input.extent().second;
+		channels = input.num_channels();
+		pixels = 0;
+		if (!channels)
+			return raise(STATUS_NO_CHANNEL, std::invalid_argument("input has no channels"));
+
+		const float ignore = ignore_value(input);
+		const size_t block = block_size(samples);
+		const size_t parts = thread_count(threads);
+		std::vector<float> cube(channels*std::min(block, lines)*samples);
+		std::vector<float const*> data(channels);
+		std::vector<Sums> sums(parts, Sums(channels));
+		// samples are accumulated relative to the mean of the first
+		// block with valid pixels, to keep the sums of products small
+		std::vector<double> origin(channels, 0);
+		bool have_origin = false;
+
+		for (size_t first = 0; first < lines; first += block) {
+			const size_t count = std::min(block, lines - first);
+			const size_t n = count*samples;
+			input.get_block(first, count, cube.data());
+			if (failed())
+				return;
+			for (size_t b = 0; b < channels; ++b)
+				data[b] = cube.data() + b*n;
+
+			if (!have_origin) {
+				std::vector<char> valid(n);
+				valid_pixels(data, ignore, valid.data(), n);
+				const size_t found = std::count(valid.begin(), valid.end(), 1);
+				for (size_t b = 0; found && b < channels; ++b) {
+					double s = 0;
+					for (size_t i = 0; i < n; ++i)
+						s += valid[i] ? data[b][i] : 0;
+					origin[b] = s/found;
+				}
+				have_origin = found > 0;
+			}
+
+			// each part accumulates a contiguous range of chunks
+			const size_t chunks = (n + chunk - 1)/chunk;
+			const size_t step = (chunks + parts - 1)/parts;
+			parallel_for(parts, parts, [&](size_t begin, size_t end) {
+				std::vector<float const*> ptrs(channels);
+				for (size_t t = begin; t < end; ++t) {
+					for (size_t c = t*step; c < std::min(chunks, (t + 1)*step); ++c) {
+						const size_t offset = c*chunk;
+						for (size_t b = 0; b < channels; ++b)
+							ptrs[b] = data[b] + offset;
+						accumulate(ptrs, ignore, origin, sums[t],
+							std::min(size_t(chunk), n - offset));
+					}
+				}
+			});
+		}
+
+		Sums total(channels);
+		for (auto const& part : sums) {
+			total.count += part.count;
+			for (size_t b = 0; b < channels; ++b)
+				total.sum[b] += part.sum[b];
+			for (size_t i = 0; i < channels*channels; ++i)
+				total.cross[i] += part.cross[i];
+		}
+		if (total.count < 2)
+			return raise(STATUS_INVALID_ARGUMENT, std::runtime_error("not enough valid pixels for a covariance"));
+
+		pixels = total.count;
+		const double N = double(total.count);
+		means.resize(channels);
+		cov.resize(channels*channels);
+		for (size_t b = 0; b < channels; ++b)
+			means[b] = origin[b] + total.sum[b]/N;
+		for (size_t b = 0; b < channels; ++b) {
+			for (size_t c = b; c < channels; ++c) {
+				const double v = (total.cross[b*channels + c] -
+					total.sum[b]*total.sum[c]/N)/(N - 1);
+				cov[b*channels + c] = cov[c*channels + b] = v;
+			}
+		}
+		eigen(cov, channels, values, vectors);
+	}
+
+	size_t num_channels() const
+	{ return channels; }
+
+	// Number of (valid) pixels the statistics are computed on
+	uint64_t num_pixels() const
+	{ return pixels; }
+
+	std::vector<double> const& mean() const
+	{ return means; }
+
+	// Covariance of the channels, row-major
+	std::vector<double> const& covariance() const
+	{ return cov; }
+
+	// Variance along each component, in decreasing order
+	std::vector<double> const& eigenvalues() const
+	{ return values; }
+
+	// The components, as the rows of a row-major matrix
+	std::vector<double> const& components() const
+	{ return vectors; }
+
+	// Write the first count components of each pixel of input (which
+	// must have the channels the PCA was fit on) to new channels of
+	// output, named "PC 1", "PC 2" and so on
+	template<typename StreamType, typename OutputDataType, typename OutStreamType>
+	void project(BasicInput<StreamType>& input,
+		Output<OutputDataType, OutStreamType>& output, size_t count)
+	{
+		const CallScope call;
+		if (!pixels)
+			return raise(STATUS_INVALID_ARGUMENT, std::logic_error("PCA not fit"));
+		if (input.num_channels() != channels)
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("input channels differ from the fit ones"));
+		if (!count || count > channels)
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("invalid number of components"));
+		if (output.extent() != input.extent())
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("extent of output differs from the input"));
+
+		const size_t lines = input.extent().first, samples = input.extent().second;
+		const float ignore = ignore_value(input);
+		if (ignore == ignore)
+			output.add_meta("data ignore value", input.get_meta("data ignore value"));
+		// masked pixels are written as the ignore value, if any
+		const float fill = ignore == ignore ? ignore : 0;
+
+		std::vector<size_t> outs;
+		for (size_t k = 0; k < count; ++k)
+			outs.push_back(output.reserve_channel("PC " + std::to_string(k + 1)));
+
+		// the projection of x is W x - W m, with W the first components
+		std::vector<float> weights(count*channels), offsets(count);
+		for (size_t k = 0; k < count; ++k) {
+			double o = 0;
+			for (size_t b = 0; b < channels; ++b) {
+				weights[k*channels + b] = float(vectors[k*channels + b]);
+				o += vectors[k*channels + b]*means[b];
+			}
+			offsets[k] = float(-o);
+		}
+
+		const size_t block = block_size(samples);
+		const size_t block_samples = std::min(block, lines)*samples;
+		std::vector<float> cube(channels*block_samples);
+		std::vector<std::vector<float>> result(count, std::vector<float>(block_samples));
+
+		for (size_t first = 0; first < lines; first += block) {
+			const size_t nlines = std::min(block, lines - first);
+			const size_t n = nlines*samples;
+			input.get_block(first, nlines, cube.data());
+			if (failed())
+				return;
+
+			parallel_for((n + chunk - 1)/chunk, threads, [&](size_t begin, size_t end) {
+				std::vector<float const*> ptrs(channels);
+				std::vector<char> valid(chunk);
+				for (size_t c = begin; c < end; ++c) {
+					const size_t offset = c*chunk;
+					const size_t m = std::min(size_t(chunk), n - offset);
+					for (size_t b = 0; b < channels; ++b)
+						ptrs[b] = cube.data() + b*n + offset;
+					valid_pixels(ptrs, ignore, valid.data(), m);
+					for (size_t k = 0; k < count; ++k) {
+						float *y = result[k].data() + offset;
+						std::fill(y, y + m, offsets[k]);
+						for (size_t b = 0; b < channels; ++b) {
+							const float w = weights[k*channels + b];
+							float const* x = ptrs[b];
+							for (size_t i = 0; i < m; ++i)
+								y[i] += w*x[i];
+						}
+						for (size_t i = 0; i < m; ++i)
+							y[i] = valid[i] ? y[i] : fill;
+					}
+				}
+			});
+
+			for (size_t k = 0; k < count; ++k) {
+				output.write_lines(outs[k], first, result[k].data(), nlines);
+				if (failed())
+					return;
+			}
+		}
+	}
+
+	template<typename StreamType>
+	Status try_fit(BasicInput<StreamType>& input) noexcept
+	{ return capture(STATUS_READ_FAILED, [&]() { fit(input); }); }
+
+	template<typename StreamType, typename OutputDataType, typename OutStreamType>
+	Status try_project(BasicInput<StreamType>& input,
+		Output<OutputDataType, OutStreamType>& output, size_t count) noexcept
+	{ return capture(STATUS_FAILED, [&]() { project(input, output, count); }); }
+};
+
+// Matching of the pixels of an input against reference spectra (targets),
+// writing one score channel per target. Inputs are read a block of lines
+// at a time, with all the channels of a block in memory: the scores of a
+// chunk of pixels are accumulated one channel at a time, so that BSQ data
+// is matched without transposing it to per-pixel spectra. Pixels with the
+// 'data ignore value' (or NaN) get the ignore value (or NaN) as score
+class ENVI::SpectralMatch
+{
+	struct Target
+	{
+		std::string name;
+		std::vector<double> spectrum;
+	};
+
+	MatchMethod method;
+	std::vector<Target> targets;
+	size_t threads;
+	size_t block_lines;
+	bool masking;
+
+	// Background statistics, for the matched filter
+	struct Background
+	{
+		std::vector<double> mean;
+		std::vector<double> values;
+		std::vector<double> vectors;
+
+		Background()
+		{}
+		explicit Background(PCA const& stats) :
+			mean(stats.mean()), values(stats.eigenvalues()), vectors(stats.components())
+		{}
+	};
+	// the one given by set_background(), if any
+	Background background;
+	bool has_background;
+
+	// Number of pixels scored at a time by each thread
+	enum { chunk = 512 };
+
+	// The matched filter of the given target: w with score w.(x - mean),
+	// normalized for the target itself to score 1. The covariance is
+	// inverted through its eigen-decomposition, ignoring the components
+	// with (relatively) negligible variance
+	static std::vector<double> filter(std::vector<double> const& spectrum, Background const& bg)
+	{
+		std::vector<double> const& mean = bg.mean, & values = bg.values, & vectors = bg.vectors;
+		const size_t n = mean.size();
+		std::vector<double> d(n), w(n, 0);
+		for (size_t b = 0; b < n; ++b)
+			d[b] = spectrum[b] - mean[b];
+		for (size_t k = 0; k < n; ++k) {
+			if (values[k] <= values[0]*1e-12)
+				break;
+			double proj = 0;
+			for (size_t b = 0; b < n; ++b)
+				proj += vectors[k*n + b]*d[b];
+			for (size_t b = 0; b < n; ++b)
+				w[b] += vectors[k*n + b]*proj/values[k];
+		}
+		double norm = 0;
+		for (size_t b = 0; b < n; ++b)
+			norm += w[b]*d[b];
+		for (auto& x : w)
+			x = norm > 0 ? x/norm : 0;
+		return w;
+	}
+
+public:
+	explicit SpectralMatch(MatchMethod _method = SPECTRAL_ANGLE) :
+		method(_method), threads(0), block_lines(0), masking(true), has_background(false)
+	{}
+
+	void set_method(MatchMethod _method)
+	{ method = _method; }
+
+	// Number of threads scoring each block; 0 (the default) uses one
+	// per hardware thread
+	void set_threads(size_t count)
+	{ threads = count; }
+
+	// Number of lines loaded at a time; 0 (the default) picks about
+	// 16MB of samples over all channels
+	void set_block_lines(size_t count)
+	{ block_lines = count; }
+
+	// Whether to skip pixels with the 'data ignore value' (the default),
+	// or only NaNs
+	void set_masking(bool enable)
+	{ masking = enable; }
+
+	// Add a target, with one value per channel of the inputs, scored
+	// in a channel with the given name
+	void add_target(std::string const& name, std::vector<double> const& spectrum)
+	{
+		const CallScope call;
+		if (spectrum.empty())
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("empty target spectrum"));
+		Target t = { name, spectrum };
+		targets.push_back(std::move(t));
+	}
+
+	// Use the mean and covariance of stats as the background of the
+	// matched filter. Without one, each run() computes it from its input
+	void set_background(PCA const& stats)
+	{
+		background = Background(stats);
+		has_background = true;
+	}
+
+	// Score every pixel of input against each target, adding a channel
+	// per target to output. Spectral angles are in radians
+	template<typename StreamType, typename OutputDataType, typename OutStreamType>
+	void run(BasicInput<StreamType>& input, Output<OutputDataType, OutStreamType>& output)
+	{
+		const CallScope call;
+		const size_t channels = input.num_channels();
+		if (targets.empty())
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("no targets to match"));
+		for (auto const& t : targets)
+			if (t.spectrum.size() != channels)
+				return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument(
+					"target '" + t.name + "' does not have a value per channel"));
+		if (output.extent() != input.extent())
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("extent of output differs from the input"));
+
+		const size_t ntargets = targets.size();
+		// per target: the spectrum (or filter) and a constant term
+		std::vector<double> weights(ntargets*channels), offsets(ntargets, 0);
+		if (method == MATCHED_FILTER) {
+			Background fitted;
+			if (!has_background) {
+				PCA stats;
+				stats.set_threads(threads);
+				stats.set_block_lines(block_lines);
+				stats.set_masking(masking);
+				stats.fit(input);
+				if (failed())
+					return;
+				fitted = Background(stats);
+			} else if (background.mean.size() != channels) {
+				return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument(
+					"background does not have a value per channel"));
+			}
+			Background const& bg = has_background ? background : fitted;
+			for (size_t k = 0; k < ntargets; ++k) {
+				const std::vector<double> w = filter(targets[k].spectrum, bg);
+				std::copy(w.begin(), w.end(), weights.begin() + k*channels);
+				for (size_t b = 0; b < channels; ++b)
+					offsets[k] -= w[b]*bg.mean[b];
+			}
+		} else {
+			for (size_t k = 0; k < ntargets; ++k) {
+				std::copy(targets[k].spectrum.begin(), targets[k].spectrum.end(),
+					weights.begin() + k*channels);
+				// the norm of the target, for the angle
+				for (auto v : targets[k].spectrum)
+					offsets[k] += v*v;
+				offsets[k] = std::sqrt(offsets[k]);
+			}
+		}
+
+		const size_t lines = input.extent().first, samples = input.extent().second;
+		const float ignore = float(masking ? input.ignore_value() : std::numeric_limits<double>::quiet_NaN());
+		if (ignore == ignore)
+			output.add_meta("data ignore value", input.get_meta("data ignore value"));
+
+		std::vector<size_t> outs;
+		for (auto const& t : targets)
+			outs.push_back(output.reserve_channel(t.name));
+
+		const size_t block = block_lines ? block_lines :
+			std::max(size_t(1), (size_t(1) << 22)/std::max(channels*samples, size_t(1)));
+		const size_t block_samples = std::min(block, lines)*samples;
+		std::vector<float> cube(channels*block_samples);
+		std::vector<std::vector<float>> result(ntargets, std::vector<float>(block_samples));
+
+		for (size_t first = 0; first < lines; first += block) {
+			const size_t nlines = std::min(block, lines - first);
+			const size_t n = nlines*samples;
+			input.get_block(first, nlines, cube.data());
+			if (failed())
+				return;
+
+			parallel_for((n + chunk - 1)/chunk, threads, [&](size_t begin, size_t end) {
+				std::vector<float const*> ptrs(channels);
+				std::vector<char> valid(chunk);
+				// the accumulated scores of each target, then the
+				// squared norms of the pixels
+				std::vector<double> acc((ntargets + 1)*chunk);
+				double *norms = acc.data() + ntargets*chunk;
+				for (size_t c = begin; c < end; ++c) {
+					const size_t offset = c*chunk;
+					const size_t m = std::min(size_t(chunk), n - offset);
+					for (size_t b = 0; b < channels; ++b)
+						ptrs[b] = cube.data() + b*n + offset;
+					valid_pixels(ptrs, ignore, valid.data(), m);
+
+					std::fill(acc.begin(), acc.end(), 0);
+					for (size_t b = 0; b < channels; ++b) {
+						float const* x = ptrs[b];
+						if (method == SPECTRAL_ANGLE)
+							Kernels::square_distance_add(x, 0, norms, m);
+						for (size_t k = 0; k < ntargets; ++k) {
+							const double w = weights[k*channels + b];
+							if (method == EUCLIDEAN_DISTANCE)
+								Kernels::square_distance_add(x, w, acc.data() + k*chunk, m);
+							else
+								Kernels::multiply_add(x, w, acc.data() + k*chunk, m);
+						}
+					}
+
+					for (size_t k = 0; k < ntargets; ++k) {
+						double const* a = acc.data() + k*chunk;
+						float *y = result[k].data() + offset;
+						for (size_t i = 0; i < m; ++i) {
+							double score;
+							if (method == SPECTRAL_ANGLE) {
+								const double cosine = a[i]/(std::sqrt(norms[i])*offsets[k]);
+								score = std::acos(std::max(-1.0, std::min(1.0, cosine)));
+							} else if (method == EUCLIDEAN_DISTANCE) {
+								score = std::sqrt(a[i]);
+							} else {
+								score = a[i] + offsets[k];
+							}
+							y[i] = valid[i] ? float(score) : ignore;
+						}
+					}
+				}
+			});
+
+			for (size_t k = 0; k < ntargets; ++k) {
+				output.write_lines(outs[k], first, result[k].data(), nlines);
+				if (failed())
+					return;
+			}
+		}
+	}
+
+	template<typename StreamType, typename OutputDataType, typename OutStreamType>
+	Status try_run(BasicInput<StreamType>& input, Output<OutputDataType, OutStreamType>& output) noexcept
+	{ return capture(STATUS_FAILED, [&]() { run(input, output); }); }
+};
+
+// Index of reference spectra (e.g. a spectral library) for k-nearest
+// neighbour searches. The spectra are sorted by their projection on the
+// principal axis of the library, which bounds their distance from a query
+// from below: a search scans groups of spectra outwards from the query
+// projection, and stops once no group left can get closer than the k-th
+// best so far. Groups are stored band by band, so that the distances of
+// a whole group accumulate through the vectorized kernels, and a group is
+// abandoned as soon as none of its spectra can make it to the k best
+class ENVI::SpectralIndex
+{
+public:
+	struct Neighbor
+	{
+		// index of the spectrum in the library
+		size_t index;
+		// Euclidean distance, or spectral angle in radians
+		double distance;
+	};
+
+private:
+	// Spectra per group
+	enum { group = 32 };
+
+	MatchMethod metric;
+	size_t count, length;
+	size_t threads;
+	std::vector<std::string> spectra_names;
+	// unit vector of the principal axis, and the projection of
+	// each spectrum on it, in sorted order
+	std::vector<double> axis;
+	std::vector<double> keys;
+	// the library index of each spectrum, in sorted order
+	std::vector<size_t> order;
+	// groups of spectra, band by band; the last one is padded
+	std::vector<float> groups;
+
+	// Bring a spectrum to the form it is indexed in: for the spectral
+	// angle, unit vectors, whose distances grow with their angles
+	void prepare(float* spectrum) const
+	{
+		if (metric != SPECTRAL_ANGLE)
+			return;
+		double norm = 0;
+		for (size_t b = 0; b < length; ++b)
+			norm += double(spectrum[b])*spectrum[b];
+		norm = norm > 0 ? 1/std::sqrt(norm) : 0;
+		for (size_t b = 0; b < length; ++b)
+			spectrum[b] = float(spectrum[b]*norm);
+	}
+
+	// The principal axis of the n spectra in data, by power iteration
+	static std::vector<double> principal_axis(std::vector<float> const& data, size_t n, size_t len)
+	{
+		std::vector<double> mean(len, 0), v(len, 1/std::sqrt(double(len))), next(len);
+		for (size_t i = 0; i < n; ++i)
+			for (size_t b = 0; b < len; ++b)
+				mean[b] += data[i*len + b];
+		for (auto& m : mean)
+			m /= double(n);
+		for (int iter = 0; iter < 32; ++iter) {
+			std::fill(next.begin(), next.end(), 0);
+			for (size_t i = 0; i < n; ++i) {
+				float const* x = data.data() + i*len;
+				double proj = 0;
+				for (size_t b = 0; b < len; ++b)
+					proj += (x[b] - mean[b])*v[b];
+				for (size_t b = 0; b < len; ++b)
+					next[b] += proj*(x[b] - mean[b]);
+			}
+			double norm = 0;
+			for (auto x : next)
+				norm += x*x;
+			// all the spectra are the same: any axis will do
+			if (norm == 0)
+				break;
+			norm = std::sqrt(norm);
+			for (size_t b = 0; b < len; ++b)
+				v[b] = next[b]/norm;
+		}
+		return v;
+	}
+
+	// Search the k nearest to the (prepared) query, into best, sorted by
+	// squared distance. dist is scratch space for a group
+	void search(float const* query, size_t k, std::vector<Neighbor>& best,
+		std::vector<double>& dist) const
+	{
+		best.clear();
+		double proj = 0;
+		for (size_t b = 0; b < length; ++b)
+			proj += axis[b]*query[b];
+
+		const size_t ngroups = (count + group - 1)/group;
+		// lower bound of the squared distance of the spectra of group g
+		auto bound = [&](size_t g) {
+			const double lo = keys[g*group], hi = keys[std::min(count, (g + 1)*group) - 1];
+			const double d = proj < lo ? lo - proj : proj > hi ? proj - hi : 0;
+			return d*d;
+		};
+		auto worst = [&]() {
+			return best.size() < k ? std::numeric_limits<double>::infinity() : best.back().distance;
+		};
+
+		size_t right = (std::lower_bound(keys.begin(), keys.end(), proj) - keys.begin())/group;
+		if (right == ngroups)
+			--right;
+		size_t left = right;
+		bool have_left = true, have_right = true;
+		bool first = true;
+		while (have_left || have_right) {
+			// scan the side whose next group may be closer
+			size_t g;
+			if (first) {
+				g = right;
+				first = false;
+				have_left = left > 0;
+				have_right = right + 1 < ngroups;
+			} else if (have_left && (!have_right || bound(left - 1) <= bound(right + 1))) {
+				g = --left;
+				have_left = left > 0;
+			} else {
+				g = ++right;
+				have_right = right + 1 < ngroups;
+			}
+			if (bound(g) >= worst()) {
+				// the groups further on this side are even farther
+				if (g == left)
+					have_left = false;
+				if (g == right)
+					have_right = false;
+				continue;
+			}
+
+			float const* spectra = groups.data() + g*group*length;
+			std::fill(dist.begin(), dist.end(), 0);
+			bool abandoned = false;
+			for (size_t b = 0; b < length; ++b) {
+				Kernels::square_distance_add(spectra + b*group, query[b], dist.data(), group);
+				if ((b & 15) == 15 &&
+					*std::min_element(dist.begin(), dist.end()) >= worst()) {
+					abandoned = true;
+					break;
+				}
+			}
+			if (abandoned)
+				continue;
+
+			const size_t n = std::min(size_t(group), count - g*group);
+			for (size_t i = 0; i < n; ++i) {
+				if (dist[i] >= worst())
+					continue;
+				const Neighbor nb = { order[g*group + i], dist[i] };
+				auto pos = std::upper_bound(best.begin(), best.end(), nb,
+					[](Neighbor const& a, Neighbor const& b) { return a.distance < b.distance; });
+				best.insert(pos, nb);
+				if (best.size() > k)
+					best.pop_back();
+			}
+		}
+
+		// from squared distances of the prepared spectra
+		for (auto& nb : best) {
+			nb.distance = std::sqrt(nb.distance);
+			if (metric == SPECTRAL_ANGLE)
+				nb.distance = 2*std::asin(std::min(1.0, nb.distance/2));
+		}
+	}
+
+public:
+	// Index for the given metric: EUCLIDEAN_DISTANCE or SPECTRAL_ANGLE
+	// (build() rejects the others)
+	explicit SpectralIndex(MatchMethod _metric = EUCLIDEAN_DISTANCE) :
+		metric(_metric), count(0), length(0), threads(0)
+	{}
+
+	// Number of threads for batch searches; 0 (the default) uses one per
+	// hardware thread
+	void set_threads(size_t _threads)
+	{ threads = _threads; }
+
+	// Index n spectra of len values each, stored one after the other
+	void build(float const* spectra, size_t n, size_t len,
+		std::vector<std::string> const& names = std::vector<std::string>())
+	{
+		const CallScope call;
+		if (metric != EUCLIDEAN_DISTANCE && metric != SPECTRAL_ANGLE)
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("unsupported metric for a spectral index"));
+		if (!n || !len)
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("no spectra to index"));
+		count = n;
+		length = len;
+		spectra_names = names;
+
+		std::vector<float> data(spectra, spectra + n*len);
+		for (size_t i = 0; i < n; ++i)
+			prepare(data.data() + i*len);
+		axis = principal_axis(data, n, len);
+
+		std::vector<double> proj(n, 0);
+		for (size_t i = 0; i < n; ++i)
+			for (size_t b = 0; b < len; ++b)
+				proj[i] += axis[b]*data[i*len + b];
+		order.resize(n);
+		for (size_t i = 0; i < n; ++i)
+			order[i] = i;
+		std::sort(order.begin(), order.end(),
+			[&](size_t a, size_t b) { return proj[a] < proj[b]; });
+
+		keys.resize(n);
+		const size_t ngroups = (n + group - 1)/group;
+		// padding is far enough not to be a candidate
+		groups.assign(ngroups*group*len, std::numeric_limits<float>::max());
+		for (size_t i = 0; i < n; ++i) {
+			keys[i] = proj[order[i]];
+			float *g = groups.data() + (i/group)*group*len + i % group;
+			for (size_t b = 0; b < len; ++b)
+				g[b*group] = data[order[i]*len + b];
+		}
+	}
+
+	// Index the spectra of a spectral library
+	template<typename StreamType>
+	void build(BasicInput<StreamType>& library)
+	{
+		const CallScope call;
+		std::vector<float> spectra;
+		library.get_spectra(spectra);
+		if (failed())
+			return;
+		build(spectra.data(), library.extent().first, library.extent().second,
+			library.spectra_names());
+	}
+
+	// Number of spectra indexed
+	size_t size() const
+	{ return count; }
+
+	// Number of values of each spectrum
+	size_t spectrum_length() const
+	{ return length; }
+
+	std::vector<std::string> const& names() const
+	{ return spectra_names; }
+
+	// The k nearest spectra to the given one, closest first
+	std::vector<Neighbor> nearest(float const* spectrum, size_t k) const
+	{
+		const CallScope call;
+		std::vector<Neighbor> best;
+		if (!count) {
+			raise(STATUS_INVALID_ARGUMENT, std::logic_error("empty spectral index"));
+			return best;
+		}
+		if (!k)
+			return best;
+		std::vector<double> dist(group);
+		std::vector<float> query(spectrum, spectrum + length);
+		prepare(query.data());
+		search(query.data(), k, best, dist);
+		return best;
+	}
+
+	// Search the k nearest spectra for each of n spectra, storing them
+	// (closest first) in out, k per spectrum; if less than k spectra are
+	// indexed, the rest have index SIZE_MAX. Value b of spectrum i is
+	// spectra[i*spectrum_stride + b*sample_stride]; the default strides
+	// (0) are for spectra stored one after the other, while for a block
+	// of BSQ data, they would be 1 and the number of pixels of the block
+	void nearest(float const* spectra, size_t n, size_t k, Neighbor* out,
+		size_t spectrum_stride = 0, size_t sample_stride = 1) const
+	{
+		const CallScope call;
+		if (!count)
+			return raise(STATUS_INVALID_ARGUMENT, std::logic_error("empty spectral index"));
+		if (!k)
+			return;
+		if (!spectrum_stride)
+			spectrum_stride = length*sample_stride;
+
+		parallel_for(n, threads, [&](size_t begin, size_t end) {
+			std::vector<Neighbor> best;
+			std::vector<double> dist(group);
+			std::vector<float> query(length);
+			for (size_t i = begin; i < end; ++i) {
+				float const* x = spectra + i*spectrum_stride;
+				for (size_t b = 0; b < length; ++b)
+					query[b] = x[b*sample_stride];
+				prepare(query.data());
+				search(query.data(), k, best, dist);
+				for (size_t j = 0; j < k; ++j) {
+					const Neighbor none = { SIZE_MAX, std::numeric_limits<double>::infinity() };
+					out[i*k + j] = j < best.size() ? best[j] : none;
+				}
+			}
+		});
+	}
+};
+
+// Per-pixel reductions across the channels of an input (sum, mean,
+// minimum, maximum, and so on), computed reading one channel after the
+// other and accumulating it into per-pixel accumulators. By default whole
+// channels are read, so a BSQ file is read sequentially, with memory for
+// one channel plus the accumulators; limiting the block of lines read at
+// a time bounds memory further, at the cost of a seek per channel and
+// block. Samples with the 'data ignore value' (or NaN) are skipped
+class ENVI::BandReducer
+{
+	struct Request
+	{
+		BandReduction what;
+		std::string name;
+	};
+
+	std::vector<Request> requests;
+	size_t threads;
+	size_t block_lines;
+	bool masking;
+
+	// The accumulators of a block of pixels
+	struct Accumulators
+	{
+		std::vector<double> sum;
+		std::vector<uint32_t> count;
+		std::vector<float> min, max;
+		std::vector<uint32_t> argmin, argmax;
+	};
+
+	bool needs(BandReduction a, BandReduction b) const
+	{
+		for (auto const& r : requests)
+			if (r.what == a || r.what == b)
+				return true;
+		return false;
+	}
+
+	static const char* default_name(BandReduction what)
+	{
+		switch (what) {
+		case BAND_SUM: return "sum";
+		case BAND_MEAN: return "mean";
+		case BAND_MIN: return "min";
+		case BAND_MAX: return "max";
+		case BAND_ARGMIN: return "argmin";
+		case BAND_ARGMAX: return "argmax";
+		default: return "count";
+		}
+	}
+
+	// Accumulate n samples x of channel b into the accumulators, from
+	// offset on. Each accumulator has its own loop, so that they vectorize
+	static void accumulate(float const* x, uint32_t b, float ignore,
+		Accumulators& acc, size_t offset, size_t n)
+	{
+		uint32_t *count = acc.count.data() + offset;
+		for (size_t i = 0; i < n; ++i)
+			count[i] += (x[i] == x[i]) & (x[i] != ignore);
+		if (!acc.sum.empty()) {
+			double *sum = acc.sum.data() + offset;
+			for (size_t i = 0; i < n; ++i)
+				sum[i] += (x[i] == x[i]) & (x[i] != ignore) ? x[i] : 0.0f;
+		}
+		// NaNs never compare less or greater
+		if (!acc.min.empty()) {
+			float *min = acc.min.data() + offset;
+			uint32_t *arg = acc.argmin.data() + offset;
+			for (size_t i = 0; i < n; ++i) {
+				const bool better = x[i] < min[i] && x[i] != ignore;
+				min[i] = better ? x[i] : min[i];
+				arg[i] = better ? b : arg[i];
+			}
+		}
+		if (!acc.max.empty()) {
+			float *max = acc.max.data() + offset;
+			uint32_t *arg = acc.argmax.data() + offset;
+			for (size_t i = 0; i < n; ++i) {
+				const bool better = x[i] > max[i] && x[i] != ignore;
+				max[i] = better ? x[i] : max[i];
+				arg[i] = better ? b : arg[i];
+			}
+		}
+	}
+
+	// The value of reduction what for pixel i, fill if undefined
+	static float result(BandReduction what, Accumulators const& acc, size_t i, float fill)
+	{
+		const uint32_t count = acc.count[i];
+		switch (what) {
+		case BAND_SUM: return float(acc.sum[i]);
+		case BAND_MEAN: return count ? float(acc.sum[i]/count) : fill;
+		case BAND_MIN: return count ? acc.min[i] : fill;
+		case BAND_MAX: return count ? acc.max[i] : fill;
+		case BAND_ARGMIN: return count ? float(acc.argmin[i]) : fill;
+		case BAND_ARGMAX: return count ? float(acc.argmax[i]) : fill;
+		default: return float(count);
+		}
+	}
+
+public:
+	BandReducer() : threads(0), block_lines(0), masking(true)
+	{}
+
+	// Add a reduction, computed into a channel with the given name
+	// (by default, its own: "sum", "mean" and so on)
+	void add(BandReduction what, std::string const& name = std::string())
+	{
+		const Request r = { what, name.empty() ? default_name(what) : name };
+		requests.push_back(r);
+	}
+
+	// Number of threads accumulating each channel; 0 (the default) uses
+	// one per hardware thread
+	void set_threads(size_t count)
+	{ threads = count; }
+
+	// Number of lines of each channel read at a time; 0 (the default)
+	// reads whole channels
+	void set_block_lines(size_t count)
+	{ block_lines = count; }
+
+	// Whether to skip samples with the 'data ignore value' (the
+	// default), or only NaNs
+	void set_masking(bool enable)
+	{ masking = enable; }
+
+	// Compute the reductions over the channels of input, adding a
+	// channel for each to output. Undefined values (e.g. the mean of a
+	// pixel with no valid samples) are the ignore value, or NaN
+	template<typename StreamType, typename OutputDataType, typename OutStreamType>
+	void run(BasicInput<StreamType>& input, Output<OutputDataType, OutStreamType>& output)
+	{
+		const CallScope call;
+		if (requests.empty())
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("no reductions to compute"));
+		if (output.extent() != input.extent())
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("extent of output differs from the input"));
+
+		const size_t lines = input.extent().first, samples = input.extent().second;
+		const size_t channels = input.num_channels();
+		const float ignore = float(masking ? input.ignore_value() : std::numeric_limits<double>::quiet_NaN());
+		if (ignore == ignore)
+			output.add_meta("data ignore value", input.get_meta("data ignore value"));
+
+		std::vector<size_t> outs;
+		for (auto const& r : requests)
+			outs.push_back(output.reserve_channel(r.name));
+
+		const size_t block = block_lines ? std::min(block_lines, lines) : lines;
+		const size_t block_samples = block*samples;
+		std::vector<float> data(block_samples), res(block_samples);
+		Accumulators acc;
+		const bool sums = needs(BAND_SUM, BAND_MEAN);
+		const bool mins = needs(BAND_MIN, BAND_ARGMIN);
+		const bool maxs = needs(BAND_MAX, BAND_ARGMAX);
+
+		for (size_t first = 0; first < lines; first += block) {
+			const size_t count = std::min(block, lines - first);
+			const size_t n = count*samples;
+			acc.count.assign(n, 0);
+			if (sums)
+				acc.sum.assign(n, 0);
+			if (mins) {
+				acc.min.assign(n, std::numeric_limits<float>::infinity());
+				acc.argmin.assign(n, 0);
+			}
+			if (maxs) {
+				acc.max.assign(n, -std::numeric_limits<float>::infinity());
+				acc.argmax.assign(n, 0);
+			}
+
+			for (size_t b = 0; b < channels; ++b) {
+				input.get_lines(b, first, count, data.data());
+				if (failed())
+					return;
+				parallel_for(n, threads, [&](size_t begin, size_t end) {
+					accumulate(data.data() + begin, uint32_t(b), ignore, acc, begin, end - begin);
+				});
+			}
+
+			for (size_t r = 0; r < requests.size(); ++r) {
+				for (size_t i = 0; i < n; ++i)
+					res[i] = result(requests[r].what, acc, i, ignore);
+				output.write_lines(outs[r], first, res.data(), count);
+				if (failed())
+					return;
+			}
+		}
+	}
+
+	template<typename StreamType, typename OutputDataType, typename OutStreamType>
+	Status try_run(BasicInput<StreamType>& input, Output<OutputDataType, OutStreamType>& output) noexcept
+	{ return capture(STATUS_FAILED, [&]() { run(input, output); }); }
+};
+
+// Neighbourhood filters (convolutions and morphology) over the channels
+// of an input. Lines are streamed through a ring buffer holding just the
+// lines the kernel needs for a block of output lines, so memory use is
+// proportional to the kernel and block heights rather than to the size
+// of the channels. Edges are handled by replicating the first and last
+// lines and samples. Kernels must have odd sizes, and are centered
+class ENVI::SpatialFilter
+{
+	enum Kind { CONVOLVE, SEPARABLE, ERODE, DILATE };
+
+	Kind kind;
+	size_t rows, cols;
+	// row-major weights (CONVOLVE), or non-zero for the elements of
+	// the neighbourhood (ERODE, DILATE)
+	std::vector<float> weights;
+	// SEPARABLE: weights along lines (applied as lines are loaded),
+	// and across them
+	std::vector<float> row_weights, col_weights;
+	size_t threads;
+	size_t block_lines;
+
+	SpatialFilter(Kind _kind, size_t _rows, size_t _cols) :
+		kind(_kind), rows(_rows), cols(_cols), threads(0), block_lines(0)
+	{
+		if (!(rows & 1) || !(cols & 1))
+			raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("filter sizes must be odd"));
+	}
+
+	// Store a line of input into a ring slot, padded with cols/2 copies
+	// of its edges on either side; temp has room for a padded line.
+	// For separable filters, the slot gets the line filtered along it
+	void store_line(float const* in, float* slot, float* temp, size_t samples) const
+	{
+		const size_t pad = cols/2;
+		float *dst = kind == SEPARABLE ? temp : slot;
+		std::fill(dst, dst + pad, in[0]);
+		std::copy(in, in + samples, dst + pad);
+		std::fill(dst + pad + samples, dst + 2*pad + samples, in[samples - 1]);
+		if (kind != SEPARABLE)
+			return;
+		std::fill(slot + pad, slot + pad + samples, 0.0f);
+		for (size_t j = 0; j < cols; ++j) {
+			const float w = row_weights[j];
+			for (size_t x = 0; x < samples; ++x)
+				slot[pad + x] += w*temp[x + j];
+		}
+	}
+
+	// Compute a line of output from the rows (padded) input lines
+	// around it. Every kernel element is a pass over the whole line,
+	// which vectorizes
+	void filter_line(float const* const* lines, float* out, size_t samples) const
+	{
+		const size_t pad = cols/2;
+		switch (kind) {
+		case SEPARABLE:
+			std::fill(out, out + samples, 0.0f);
+			for (size_t i = 0; i < rows; ++i) {
+				const float w = col_weights[i];
+				float const* in = lines[i] + pad;
+				for (size_t x = 0; x < samples; ++x)
+					out[x] += w*in[x];
+			}
+			break;
+		case CONVOLVE:
+			std::fill(out, out + samples, 0.0f);
+			for (size_t i = 0; i < rows; ++i) {
+				for (size_t j = 0; j < cols; ++j) {
+					const float w = weights[i*cols + j];
+					if (w == 0)
+						continue;
+					float const* in = lines[i] + j;
+					for (size_t x = 0; x < samples; ++x)
+						out[x] += w*in[x];
+				}
+			}
+			break;
+		case ERODE:
+		case DILATE:
+			std::fill(out, out + samples, kind == ERODE ?
+				std::numeric_limits<float>::infinity() : -std::numeric_limits<float>::infinity());
+			for (size_t i = 0; i < rows; ++i) {
+				for (size_t j = 0; j < cols; ++j) {
+					if (weights[i*cols + j] == 0)
+						continue;
+					float const* in = lines[i] + j;
+					if (kind == ERODE)
+						for (size_t x = 0; x < samples; ++x)
+							out[x] = in[x] < out[x] ? in[x] : out[x];
+					else
+						for (size_t x = 0; x < samples; ++x)
+							out[x] = in[x] > out[x] ? in[x] : out[x];
+				}
+			}
+			break;
+		}
+	}
+
+public:
+	// Convolution with a rows x cols kernel, given row-major. The kernel
+	// is applied as is (not flipped): output(y, x) is the sum of
+	// weights(i, j)*input(y + i - rows/2, x + j - cols/2)
+	static SpatialFilter convolution(size_t rows, size_t cols, std::vector<float> const& weights)
+	{
+		const CallScope call;
+		SpatialFilter f(CONVOLVE, rows, cols);
+		if (weights.size() != rows*cols)
+			raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("wrong number of filter weights"));
+		f.weights = weights;
+		return f;
+	}
+
+	// Separable convolution: the kernel is the outer product of column
+	// (across lines) and row (along them)
+	static SpatialFilter separable(std::vector<float> const& row, std::vector<float> const& column)
+	{
+		const CallScope call;
+		SpatialFilter f(SEPARABLE, column.size(), row.size());
+		f.row_weights = row;
+		f.col_weights = column;
+		return f;
+	}
+
+	// Mean over a size x size window
+	static SpatialFilter box(size_t size)
+	{
+		const std::vector<float> w(size, 1.0f/size);
+		return separable(w, w);
+	}
+
+	// Gaussian smoothing, truncated at 3 sigma
+	static SpatialFilter gaussian(double sigma)
+	{
+		const size_t radius = size_t(std::ceil(3*sigma));
+		std::vector<float> w(2*radius + 1);
+		double total = 0;
+		for (size_t i = 0; i < w.size(); ++i) {
+			const double d = double(i) - double(radius);
+			total += w[i] = float(sigma > 0 ? std::exp(-d*d/(2*sigma*sigma)) : 1);
+		}
+		for (auto& x : w)
+			x = float(x/total);
+		return separable(w, w);
+	}
+
+	// Sobel derivative along lines (x) or across them (y)
+	static SpatialFilter sobel_x()
+	{ return separable({ -1, 0, 1 }, { 1, 2, 1 }); }
+
+	static SpatialFilter sobel_y()
+	{ return separable({ 1, 2, 1 }, { -1, 0, 1 }); }
+
+	// Minimum (erosion) or maximum (dilation) over a rows x cols
+	// neighbourhood, optionally restricted to the non-zero elements of
+	// a row-major mask
+	static SpatialFilter erosion(size_t rows, size_t cols,
+		std::vector<float> const& mask = std::vector<float>())
+	{
+		const CallScope call;
+		SpatialFilter f(ERODE, rows, cols);
+		f.weights = mask.empty() ? std::vector<float>(rows*cols, 1) : mask;
+		if (f.weights.size() != rows*cols)
+			raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("wrong size of the neighbourhood mask"));
+		return f;
+	}
+
+	static SpatialFilter dilation(size_t rows, size_t cols,
+		std::vector<float> const& mask = std::vector<float>())
+	{
+		const CallScope call;
+		SpatialFilter f = erosion(rows, cols, mask);
+		f.kind = DILATE;
+		return f;
+	}
+
+	// Number of threads computing each block of lines; 0 (the default)
+	// uses one per hardware thread
+	void set_threads(size_t count)
+	{ threads = count; }
+
+	// Number of output lines computed at a time; 0 (the default) picks
+	// 16 per thread
+	void set_block_lines(size_t count)
+	{ block_lines = count; }
+
+	// Filter channel chnum of input into a new channel of output,
+	// returning its index
+	template<typename StreamType, typename OutputDataType, typename OutStreamType>
+	size_t run(BasicInput<StreamType>& input, size_t chnum,
+		Output<OutputDataType, OutStreamType>& output, std::string const& name)
+	{
+		const CallScope call;
+		if (chnum >= input.num_channels()) {
+			raise(STATUS_NO_CHANNEL, std::invalid_argument("channel number too high"));
+			return SIZE_MAX;
+		}
+		if (!(rows & 1) || !(cols & 1)) {
+			raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("filter sizes must be odd"));
+			return SIZE_MAX;
+		}
+		if (output.extent() != input.extent()) {
+			raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("extent of output differs from the input"));
+			return SIZE_MAX;
+		}
+		const size_t lines = input.extent().first, samples = input.extent().second;
+		const size_t out = output.reserve_channel(name);
+		if (!lines || !samples)
+			return out;
+
+		// the ring holds the lines for a block of output lines
+		const size_t radius = rows/2, width = samples + 2*(cols/2);
+		const size_t block = std::min(lines, block_lines ? block_lines : 16*thread_count(threads));
+		const size_t slots = block + rows - 1;
+		std::vector<float> ring(slots*width), staging((block + radius)*samples);
+		std::vector<float> result(block*samples);
+		size_t loaded = 0;
+
+		for (size_t first = 0; first < lines; first += block) {
+			const size_t count = std::min(block, lines - first);
+
+			// load the lines up to the last one needed by this block
+			const size_t upto = std::min(lines, first + count + radius);
+			const size_t nload = upto - loaded;
+			input.get_lines(chnum, loaded, nload, staging.data());
+			if (failed())
+				return SIZE_MAX;
+			parallel_for(nload, threads, [&](size_t begin, size_t end) {
+				std::vector<float> temp(width);
+				for (size_t l = begin; l < end; ++l)
+					store_line(staging.data() + l*samples,
+						ring.data() + ((loaded + l) % slots)*width, temp.data(), samples);
+			});
+			loaded = upto;
+
+			parallel_for(count, threads, [&](size_t begin, size_t end) {
+				std::vector<float const*> window(rows);
+				for (size_t y = first + begin; y < first + end; ++y) {
+					for (size_t i = 0; i < rows; ++i) {
+						// the lines around y, replicating the edges
+						const size_t l = size_t(std::min(std::max(ptrdiff_t(y + i) -
+							ptrdiff_t(radius), ptrdiff_t(0)), ptrdiff_t(lines - 1)));
+						window[i] = ring.data() + (l % slots)*width;
+					}
+					filter_line(window.data(), result.data() + (y - first)*samples, samples);
+				}
+			});
+
+			output.write_lines(out, first, result.data(), count);
+			if (failed())
+				return SIZE_MAX;
+		}
+		return out;
+	}
+
+	// Filter all the channels of input into output, keeping their names
+	template<typename StreamType, typename OutputDataType, typename OutStreamType>
+	void run(BasicInput<StreamType>& input, Output<OutputDataType, OutStreamType>& output)
+	{
+		const CallScope call;
+		for (size_t ch = 0; ch < input.num_channels() && !failed(); ++ch)
+			run(input, ch, output, input.channel_names()[ch]);
+	}
+
+	template<typename StreamType, typename OutputDataType, typename OutStreamType>
+	Status try_run(BasicInput<StreamType>& input, Output<OutputDataType, OutStreamType>& output) noexcept
+	{ return capture(STATUS_FAILED, [&]() { run(input, output); }); }
+};
+
+// Resampling of the channels of an input to the spectral response
+// functions (SRFs) of another sensor. Source channels are taken as
+// Gaussian responses from the 'wavelength' and 'fwhm' of the header
+// (spacing of the channels when there are no FWHMs), and each target band
+// gets the normalized overlap of its response with each of them as
+// weights. Negligible weights are dropped, so the weights are a sparse
+// matrix, applied to blocks of lines of the channels any band uses
+class ENVI::SpectralResampler
+{
+	struct Band
+	{
+		std::string name;
+		// Gaussian response, or the tabulated one if any
+		double center, fwhm;
+		std::vector<double> wavelengths, response;
+	};
+
+	// Sparse matrix of weights, by target band (compressed rows)
+	struct Weights
+	{
+		std::vector<size_t> start;
+		std::vector<size_t> channel;
+		std::vector<double> weight;
+	};
+
+	std::vector<Band> bands;
+	size_t threads;
+	size_t block_lines;
+
+	// Weights below this fraction of the largest one of a band are dropped
+	static constexpr double threshold() { return 1e-4; }
+
+	// Number of pixels resampled at a time by each thread
+	enum { chunk = 1024 };
+
+	static double gaussian(double x, double fwhm)
+	{
+		const double sigma = fwhm/2.3548200450309493;
+		return std::exp(-x*x/(2*sigma*sigma));
+	}
+
+	// Tabulated response of a band at the given wavelength
+	static double sample(Band const& band, double wavelength)
+	{
+		auto const& wl = band.wavelengths;
+		auto it = std::upper_bound(wl.begin(), wl.end(), wavelength);
+		if (it == wl.begin() || it == wl.end())
+			return wavelength == wl.back() ? band.response.back() : 0;
+		const size_t i = it - wl.begin() - 1;
+		const double t = (wavelength - wl[i])/(wl[i + 1] - wl[i]);
+		return band.response[i] + t*(band.response[i + 1] - band.response[i]);
+	}
+
+	// The weights of the target bands for channels with the given
+	// centers and widths
+	Weights weights(std::vector<double> const& centers, std::vector<double> widths) const
+	{
+		const size_t n = centers.size();
+		// without FWHMs, a channel extends to halfway its neighbours
+		if (widths.size() != n) {
+			widths.resize(n);
+			for (size_t b = 0; b < n; ++b) {
+				const double lo = b > 0 ? centers[b] - centers[b - 1] : 0;
+				const double hi = b + 1 < n ? centers[b + 1] - centers[b] : 0;
+				widths[b] = std::fabs(lo && hi ? (lo + hi)/2 : lo + hi);
+			}
+		}
+
+		Weights w;
+		std::vector<double> row(n);
+		for (auto const& band : bands) {
+			for (size_t b = 0; b < n; ++b) {
+				if (!(widths[b] > 0)) {
+					// a channel without width (a lone one without
+					// FWHM) samples the response at its center
+					row[b] = band.response.empty() ? band.fwhm > 0 ?
+						gaussian(centers[b] - band.center, band.fwhm) : centers[b] == band.center :
+						sample(band, centers[b]);
+				} else if (band.response.empty()) {
+					// the overlap of two Gaussians is a Gaussian,
+					// with the sum of their variances, scaled by
+					// the ratio of the channel width to its width
+					const double width = std::sqrt(band.fwhm*band.fwhm + widths[b]*widths[b]);
+					row[b] = gaussian(centers[b] - band.center, width)*widths[b]/width;
+				} else {
+					// trapezoidal integral of the tabulated response
+					// times the channel one
+					row[b] = 0;
+					auto const& wl = band.wavelengths;
+					for (size_t i = 0; i + 1 < wl.size(); ++i) {
+						const double f0 = band.response[i]*gaussian(wl[i] - centers[b], widths[b]);
+						const double f1 = band.response[i + 1]*gaussian(wl[i + 1] - centers[b], widths[b]);
+						row[b] += (f0 + f1)/2*(wl[i + 1] - wl[i]);
+					}
+				}
+			}
+			const double top = *std::max_element(row.begin(), row.end());
+			double total = 0;
+			for (auto& x : row)
+				total += x = x > top*threshold() ? x : 0;
+			if (!(total > 0)) {
+				raise(STATUS_INVALID_ARGUMENT, std::invalid_argument(
+					"band '" + band.name + "' does not overlap the input channels"));
+				return Weights();
+			}
+			w.start.push_back(w.channel.size());
+			for (size_t b = 0; b < n; ++b) {
+				if (row[b] == 0)
+					continue;
+				w.channel.push_back(b);
+				w.weight.push_back(row[b]/total);
+			}
+		}
+		w.start.push_back(w.channel.size());
+		return w;
+	}
+
+public:
+	SpectralResampler() : threads(0), block_lines(0)
+	{}
+
+	// Add a target band with a Gaussian response, in nanometers
+	void add_band(std::string const& name, double center, double fwhm)
+	{
+		const CallScope call;
+		if (!(fwhm >= 0))
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("invalid FWHM for band '" + name + "'"));
+		Band b = { name, center, fwhm, std::vector<double>(), std::vector<double>() };
+		bands.push_back(std::move(b));
+	}
+
+	// Add a target band with the given response at each of the (sorted)
+	// wavelengths, in nanometers
+	void add_band(std::string const& name, std::vector<double> const& wavelengths,
+		std::vector<double> const& response)
+	{
+		const CallScope call;
+		if (wavelengths.size() != response.size() || wavelengths.size() < 2 ||
+			!std::is_sorted(wavelengths.begin(), wavelengths.end()))
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("invalid response for band '" + name + "'"));
+
+		// for the header: the centroid, and the width at half maximum
+		double sum = 0, weighted = 0;
+		const double half = *std::max_element(response.begin(), response.end())/2;
+		double lo = wavelengths.back(), hi = wavelengths.front();
+		for (size_t i = 0; i < response.size(); ++i) {
+			sum += response[i];
+			weighted += response[i]*wavelengths[i];
+			if (response[i] >= half) {
+				lo = std::min(lo, wavelengths[i]);
+				hi = std::max(hi, wavelengths[i]);
+			}
+		}
+		Band b = { name, sum > 0 ? weighted/sum : 0, std::max(0.0, hi - lo), wavelengths, response };
+		bands.push_back(std::move(b));
+	}
+
+	// Number of threads resampling each block; 0 (the default) uses one
+	// per hardware thread
+	void set_threads(size_t count)
+	{ threads = count; }
+
+	// Number of lines resampled at a time; 0 (the default) picks about
+	// 16MB of samples over the channels used
+	void set_block_lines(size_t count)
+	{ block_lines = count; }
+
+	// The weights of the channels of input for each target band, as a
+	// dense row-major bands x channels matrix
+	template<typename StreamType>
+	std::vector<double> matrix(BasicInput<StreamType> const& input) const
+	{
+		const size_t channels = input.num_channels();
+		if (input.wavelengths().size() != channels) {
+			raise(STATUS_INVALID_HEADER, std::runtime_error("input has no wavelengths"));
+			return std::vector<double>();
+		}
+		const Weights w = weights(input.wavelengths(), input.fwhm());
+		std::vector<double> ret(bands.size()*channels, 0);
+		for (size_t t = 0; t + 1 < w.start.size(); ++t)
+			for (size_t i = w.start[t]; i < w.start[t + 1]; ++i)
+				ret[t*channels + w.channel[i]] = w.weight[i];
+		return ret;
+	}
+
+	// Resample input into a channel of output for each target band,
+	// adding their wavelengths and FWHMs to its header
+	template<typename StreamType, typename OutputDataType, typename OutStreamType>
+	void run(BasicInput<StreamType>& input, Output<OutputDataType, OutStreamType>& output)
+	{
+		const CallScope call;
+		if (bands.empty())
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("no bands to resample to"));
+		if (output.extent() != input.extent())
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("extent of output differs from the input"));
+		const std::vector<double> centers = input.wavelengths();
+		if (centers.size() != input.num_channels())
+			return raise(STATUS_INVALID_HEADER, std::runtime_error("input has no wavelengths"));
+		const Weights w = weights(centers, input.fwhm());
+		if (failed())
+			return;
+
+		// the channels used by any band, loaded once per block
+		std::vector<size_t> used(w.channel);
+		std::sort(used.begin(), used.end());
+		used.erase(std::unique(used.begin(), used.end()), used.end());
+		std::vector<size_t> slot(input.num_channels());
+		for (size_t i = 0; i < used.size(); ++i)
+			slot[used[i]] = i;
+
+		std::vector<double> out_centers, out_fwhm;
+		std::vector<size_t> outs;
+		for (auto const& band : bands) {
+			outs.push_back(output.reserve_channel(band.name));
+			out_centers.push_back(band.center);
+			out_fwhm.push_back(band.fwhm);
+		}
+		output.add_meta("wavelength units", "Nanometers");
+		output.add_meta("wavelength", out_centers);
+		output.add_meta("fwhm", out_fwhm);
+
+		const size_t lines = input.extent().first, samples = input.extent().second;
+		const size_t block = block_lines ? block_lines :
+			std::max(size_t(1), (size_t(1) << 22)/std::max(used.size()*samples, size_t(1)));
+		const size_t block_samples = std::min(block, lines)*samples;
+		std::vector<float> cube(used.size()*block_samples);
+		std::vector<std::vector<float>> result(bands.size(), std::vector<float>(block_samples));
+
+		for (size_t first = 0; first < lines; first += block) {
+			const size_t count = std::min(block, lines - first);
+			const size_t n = count*samples;
+			for (size_t i = 0; i < used.size(); ++i) {
+				input.get_lines(used[i], first, count, cube.data() + i*n);
+				if (failed())
+					return;
+			}
+
+			// each band is a sparse row times the (dense) block
+			parallel_for((n + chunk - 1)/chunk, threads, [&](size_t begin, size_t end) {
+				std::vector<double> acc(chunk);
+				for (size_t c = begin; c < end; ++c) {
+					const size_t offset = c*chunk;
+					const size_t m = std::min(size_t(chunk), n - offset);
+					for (size_t t = 0; t < bands.size(); ++t) {
+						std::fill(acc.begin(), acc.end(), 0);
+						for (size_t i = w.start[t]; i < w.start[t + 1]; ++i)
+							Kernels::multiply_add(cube.data() + slot[w.channel[i]]*n + offset,
+								w.weight[i], acc.data(), m);
+						std::copy(acc.begin(), acc.begin() + m, result[t].begin() + offset);
+					}
+				}
+			});
+
+			for (size_t t = 0; t < bands.size(); ++t) {
+				output.write_lines(outs[t], first, result[t].data(), count);
+				if (failed())
+					return;
+			}
+		}
+	}
+
+	template<typename StreamType, typename OutputDataType, typename OutStreamType>
+	Status try_run(BasicInput<StreamType>& input, Output<OutputDataType, OutStreamType>& output) noexcept
+	{ return capture(STATUS_FAILED, [&]() { run(input, output); }); }
+};
+
+// Summed-area tables (integral images): each sample of a table channel is
+// the sum of the input channel over the rectangle from the origin to it,
+// so the sum over any rectangle takes four lookups. Tables are built
+// while streaming the input lines, with double sums for double outputs
+// and exact 64-bit integer sums for (integer inputs and) 64-bit integer
+// outputs, and queried through a memory mapping of the table file
+class ENVI::SummedAreaTable
+{
+	size_t threads;
+	size_t block_lines;
+	bool masking;
+
+	// Load count lines of channel chnum into sums, each line replaced
+	// by its running sums; masked samples count as 0
+	template<typename StreamType>
+	void row_sums(BasicInput<StreamType>& input, size_t chnum, size_t first, size_t count,
+		double* sums, std::vector<float>& staging, double ignore)
+	{
+		const size_t samples = input.extent().second;
+		input.get_lines(chnum, first, count, staging.data());
+		if (failed())
+			return;
+		parallel_for(count, threads, [&](size_t begin, size_t end) {
+			const float skip = float(ignore);
+			for (size_t l = begin; l < end; ++l) {
+				float* in = staging.data() + l*samples;
+				for (size_t s = 0; s < samples; ++s)
+					if (in[s] != in[s] || in[s] == skip)
+						in[s] = 0;
+				Kernels::prefix_sum(in, sums + l*samples, samples);
+			}
+		});
+	}
+
+	template<typename StreamType>
+	void row_sums(BasicInput<StreamType>& input, size_t chnum, size_t first, size_t count,
+		int64_t* sums, std::vector<float>& /* staging */, double ignore)
+	{
+		const size_t samples = input.extent().second;
+		input.get_lines(chnum, first, count, sums);
+		if (failed())
+			return;
+		parallel_for(count, threads, [&](size_t begin, size_t end) {
+			for (size_t l = begin; l < end; ++l) {
+				int64_t* row = sums + l*samples;
+				int64_t run = 0;
+				for (size_t s = 0; s < samples; ++s)
+					row[s] = run += double(row[s]) == ignore ? 0 : row[s];
+			}
+		});
+	}
+
+	static bool integer_type(DataTypeEnum type)
+	{ return type != FP32 && type != FP64 && type != FP32C && type != FP64C; }
+
+public:
+	// A summed-area table file, mapped in memory (or loaded, without
+	// mmap() or when its byte order is not ours)
+	class Table
+	{
+		size_t lines, samples;
+		std::vector<std::string> channels;
+		bool integer;
+		void* mapping;
+		size_t mapped_bytes;
+		double const* real_sums;
+		int64_t const* integer_sums;
+		std::vector<double> real_data;
+		std::vector<int64_t> integer_data;
+
+		template<typename T>
+		T lookup(T const* sums, size_t chnum, size_t line, size_t sample,
+			size_t nlines, size_t nsamples) const
 		{
-			if (req == input_type)
-				return prep_load(in, chnum, o_data);
-			// this shouldn't happen:
-			if (input_type == UINT64)
-				throw std::invalid_argument("invalid input type");
-			Loader<next_type(input_type)>::load(req, in, chnum, o_data);
+			T const* tab = sums + chnum*lines*samples;
+			const size_t l1 = line + nlines - 1, s1 = sample + nsamples - 1;
+			T ret = tab[l1*samples + s1];
+			if (line)
+				ret -= tab[(line - 1)*samples + s1];
+			if (sample)
+				ret -= tab[l1*samples + sample - 1];
+			if (line && sample)
+				ret += tab[(line - 1)*samples + sample - 1];
+			return ret;
+		}
+
+		void load(std::string const& fname)
+		{
+			auto input = ropen(fname);
+			if (failed())
+				return;
+			const DataTypeEnum type = input->data_type();
+			if (type != FP64 && type != INT64 && type != UINT64)
+				return raise(STATUS_UNSUPPORTED, std::invalid_argument("summed-area tables must be 64-bit"));
+			lines = input->extent().first;
+			samples = input->extent().second;
+			channels = input->channel_names();
+			integer = type != FP64;
+			const size_t count = channels.size()*lines*samples;
+
+#if CXXENVI_MMAP
+			if (!input->foreign_byte_order()) {
+				const int fd = ::open(fname.c_str(), O_RDONLY);
+				struct stat st;
+				if (fd < 0 || ::fstat(fd, &st) != 0) {
+					if (fd >= 0)
+						::close(fd);
+					return raise(STATUS_OPEN_FAILED, std::runtime_error("cannot open " + fname));
+				}
+				const size_t offset = input->header_offset();
+				if (size_t(st.st_size) < offset + count*8) {
+					::close(fd);
+					return raise(STATUS_READ_FAILED, std::runtime_error("summed-area table too short"));
+				}
+				if (st.st_size > 0) {
+					void* map = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+					if (map != MAP_FAILED) {
+						mapping = map;
+						mapped_bytes = size_t(st.st_size);
+					}
+				}
+				::close(fd);
+				if (mapping) {
+					char const* base = static_cast<char const*>(mapping) + offset;
+					real_sums = reinterpret_cast<double const*>(base);
+					integer_sums = reinterpret_cast<int64_t const*>(base);
+					return;
+				}
+			}
+#endif
+			// loaded one channel after the other, which also fixes the
+			// byte order
+			const size_t pixels = lines*samples;
+			if (integer)
+				integer_data.resize(count);
+			else
+				real_data.resize(count);
+			for (size_t ch = 0; ch < channels.size() && !failed(); ++ch) {
+				if (integer)
+					input->get_channel(ch, integer_data.data() + ch*pixels);
+				else
+					input->get_channel(ch, real_data.data() + ch*pixels);
+			}
+			real_sums = real_data.data();
+			integer_sums = integer_data.data();
+		}
+
+	public:
+		explicit Table(std::string const& fname) :
+			lines(0), samples(0), integer(false), mapping(nullptr), mapped_bytes(0),
+			real_sums(nullptr), integer_sums(nullptr)
+		{
+			load(fname);
+		}
+
+		Table(Table const&) = delete;
+		Table& operator=(Table const&) = delete;
+
+		~Table()
+		{
+#if CXXENVI_MMAP
+			if (mapping)
+				::munmap(mapping, mapped_bytes);
+#endif
+		}
+
+		std::pair<size_t, size_t> extent() const
+		{ return std::make_pair(lines, samples); }
+
+		size_t num_channels() const
+		{ return channels.size(); }
+
+		std::vector<std::string> const& channel_names() const
+		{ return channels; }
+
+		// Is the table memory-mapped (as opposed to loaded)?
+		bool mapped() const
+		{ return mapping != nullptr; }
+
+		// Sum of channel chnum over nlines x nsamples samples, starting
+		// at (line, sample). Returns NaN (after raising) if the
+		// rectangle is outside the table
+		double sum(size_t chnum, size_t line, size_t sample, size_t nlines, size_t nsamples) const
+		{
+			if (chnum >= channels.size()) {
+				raise(STATUS_NO_CHANNEL, std::invalid_argument("channel number too high"));
+				return std::numeric_limits<double>::quiet_NaN();
+			}
+			if (line > lines || nlines > lines - line || sample > samples || nsamples > samples - sample) {
+				raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("rectangle out of range"));
+				return std::numeric_limits<double>::quiet_NaN();
+			}
+			if (!nlines || !nsamples)
+				return 0;
+			return integer ?
+				double(lookup(integer_sums, chnum, line, sample, nlines, nsamples)) :
+				lookup(real_sums, chnum, line, sample, nlines, nsamples);
+		}
+
+		// Mean of channel chnum over the rectangle (masked samples
+		// count as 0)
+		double mean(size_t chnum, size_t line, size_t sample, size_t nlines, size_t nsamples) const
+		{ return sum(chnum, line, sample, nlines, nsamples)/double(nlines*nsamples); }
+	};
+
+	SummedAreaTable() : threads(0), block_lines(0), masking(true)
+	{}
+
+	// Number of threads computing each block of lines; 0 (the default)
+	// uses one per hardware thread
+	void set_threads(size_t count)
+	{ threads = count; }
+
+	// Number of lines summed at a time; 0 (the default) picks about 16MB
+	// of sums
+	void set_block_lines(size_t count)
+	{ block_lines = count; }
+
+	// Whether samples with the 'data ignore value' count as 0 (the
+	// default), or only NaNs
+	void set_masking(bool enable)
+	{ masking = enable; }
+
+	// Write the table of channel chnum of input into a new channel of
+	// output, returning its index. The output must have a 64-bit type:
+	// double, or an integer type for exact sums of integer inputs
+	template<typename StreamType, typename OutputDataType, typename OutStreamType>
+	size_t build(BasicInput<StreamType>& input, size_t chnum,
+		Output<OutputDataType, OutStreamType>& output, std::string const& name)
+	{
+		const CallScope call;
+		typedef typename std::conditional<std::is_integral<OutputDataType>::value,
+			int64_t, double>::type Sum;
+
+		if (chnum >= input.num_channels()) {
+			raise(STATUS_NO_CHANNEL, std::invalid_argument("channel number too high"));
+			return SIZE_MAX;
+		}
+		if (sizeof(OutputDataType) != 8 || !std::is_arithmetic<OutputDataType>::value) {
+			raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("summed-area tables must be 64-bit"));
+			return SIZE_MAX;
+		}
+		if (std::is_integral<Sum>::value && !integer_type(input.data_type())) {
+			raise(STATUS_UNSUPPORTED, std::invalid_argument("integer sums of non-integer data"));
+			return SIZE_MAX;
+		}
+		if (output.extent() != input.extent()) {
+			raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("extent of output differs from the input"));
+			return SIZE_MAX;
+		}
+		const size_t lines = input.extent().first, samples = input.extent().second;
+		const size_t out = output.reserve_channel(name);
+		if (!lines || !samples)
+			return out;
+
+		const double ignore = masking ? input.ignore_value() : std::numeric_limits<double>::quiet_NaN();
+		const size_t block = std::min(lines, block_lines ? block_lines :
+			std::max(size_t(1), (size_t(16) << 20)/(8*samples)));
+		std::vector<Sum> sums(block*samples), above(samples, 0);
+		std::vector<float> staging(std::is_integral<Sum>::value ? 0 : block*samples);
+
+		for (size_t first = 0; first < lines; first += block) {
+			const size_t count = std::min(block, lines - first);
+			row_sums(input, chnum, first, count, sums.data(), staging, ignore);
+			if (failed())
+				return SIZE_MAX;
+
+			// add up the running sums down the lines, a range of
+			// samples per thread
+			parallel_for(samples, threads, [&](size_t begin, size_t end) {
+				for (size_t l = 0; l < count; ++l) {
+					Sum* row = sums.data() + l*samples;
+					Sum const* prev = l ? row - samples : above.data();
+					for (size_t s = begin; s < end; ++s)
+						row[s] += prev[s];
+				}
+			});
+			std::copy(sums.begin() + (count - 1)*samples, sums.begin() + count*samples, above.begin());
+
+			output.write_lines(out, first, sums.data(), count);
+			if (failed())
+				return SIZE_MAX;
+		}
+		return out;
+	}
+
+	// Write the tables of all the channels of input into output,
+	// keeping their names
+	template<typename StreamType, typename OutputDataType, typename OutStreamType>
+	void build(BasicInput<StreamType>& input, Output<OutputDataType, OutStreamType>& output)
+	{
+		const CallScope call;
+		for (size_t ch = 0; ch < input.num_channels() && !failed(); ++ch)
+			build(input, ch, output, input.channel_names()[ch]);
+	}
+
+	// Write the tables of all the channels of input into a (double)
+	// sidecar file
+	template<typename StreamType>
+	void build(BasicInput<StreamType>& input, std::string const& fname)
+	{
+		const CallScope call;
+		auto output = create<double>(fname, "summed-area table",
+			input.extent().first, input.extent().second);
+		build(input, *output);
+	}
+
+	template<typename StreamType, typename OutputDataType, typename OutStreamType>
+	Status try_build(BasicInput<StreamType>& input, Output<OutputDataType, OutStreamType>& output) noexcept
+	{ return capture(STATUS_FAILED, [&]() { build(input, output); }); }
+
+	template<typename StreamType>
+	Status try_build(BasicInput<StreamType>& input, std::string const& fname) noexcept
+	{ return capture(STATUS_FAILED, [&]() { build(input, fname); }); }
+
+	// Map a table file for queries
+	static std::shared_ptr<Table> open(std::string const& fname)
+	{
+		const CallScope call;
+		return std::shared_ptr<Table>(new Table(fname));
+	}
+
+	static Result<std::shared_ptr<Table>> try_open(std::string const& fname) noexcept
+	{
+		Result<std::shared_ptr<Table>> ret;
+		ret.status = capture(STATUS_OPEN_FAILED, [&]() { ret.value = open(fname); });
+		if (!ret.ok())
+			ret.value.reset();
+		return ret;
+	}
+};
+
+// A KLL quantile sketch: a stack of compactors, each holding samples
+// that stand for 2^level samples of the input. A full compactor is sorted
+// and every other sample (starting at random) moves up a level, so the
+// sketch keeps O(k) samples however many are added, and quantiles have a
+// rank error of about 1.7/k. Sketches of parts of the data merge into a
+// sketch of the whole
+class ENVI::QuantileSketch
+{
+	size_t k;
+	uint64_t n;
+	float lo, hi;
+	// state of the coin flips choosing which half of a compactor moves up
+	uint64_t seed;
+	std::vector<std::vector<float>> levels;
+	size_t retained, capacity;
+
+	// The compactors shrink by 2/3 per level below the top one, down to 2
+	size_t level_capacity(size_t level) const
+	{
+		const double depth = double(levels.size() - 1 - level);
+		return std::max(size_t(2), size_t(std::ceil(double(k)*std::pow(2.0/3.0, depth))));
+	}
+
+	void update_capacity()
+	{
+		capacity = 0;
+		for (size_t h = 0; h < levels.size(); ++h)
+			capacity += level_capacity(h);
+	}
+
+	// Compact the lowest full compactor until the samples fit
+	void compress()
+	{
+		while (retained >= capacity) {
+			size_t h = 0;
+			while (h + 1 < levels.size() && levels[h].size() < level_capacity(h))
+				++h;
+			if (h + 1 == levels.size()) {
+				levels.emplace_back();
+				update_capacity();
+			}
+			std::vector<float>& cur = levels[h];
+			std::vector<float>& up = levels[h + 1];
+			std::sort(cur.begin(), cur.end());
+			// with an odd count the smallest sample stays
+			const size_t odd = cur.size() & 1;
+			seed = seed*6364136223846793005ULL + 1442695040888963407ULL;
+			for (size_t i = odd + (seed >> 63); i < cur.size(); i += 2)
+				up.push_back(cur[i]);
+			retained -= (cur.size() - odd)/2;
+			cur.resize(odd);
+		}
+	}
+
+	// The retained samples, sorted, with their weights
+	std::vector<std::pair<float, uint64_t>> weighted() const
+	{
+		std::vector<std::pair<float, uint64_t>> ret;
+		ret.reserve(retained);
+		for (size_t h = 0; h < levels.size(); ++h)
+			for (float x : levels[h])
+				ret.push_back(std::make_pair(x, uint64_t(1) << h));
+		std::sort(ret.begin(), ret.end());
+		return ret;
+	}
+
+public:
+	// A sketch with compactors of (at most) size k; the seed picks the
+	// sequence of coin flips
+	explicit QuantileSketch(size_t _k = 200, uint64_t _seed = 0) :
+		k(std::max(_k, size_t(8))), n(0),
+		lo(std::numeric_limits<float>::infinity()), hi(-std::numeric_limits<float>::infinity()),
+		seed(_seed), levels(1), retained(0), capacity(0)
+	{
+		update_capacity();
+	}
+
+	// Add a sample; NaNs and infinities are skipped
+	void add(float x)
+	{
+		if (!std::isfinite(x))
+			return;
+		++n;
+		lo = std::min(lo, x);
+		hi = std::max(hi, x);
+		levels[0].push_back(x);
+		if (++retained >= capacity)
+			compress();
+	}
+
+	// Add count samples, skipping those equal to ignore
+	void add(float const* x, size_t count, float ignore = std::numeric_limits<float>::quiet_NaN())
+	{
+		for (size_t i = 0; i < count; ++i)
+			if (x[i] != ignore)
+				add(x[i]);
+	}
+
+	// Add the samples of another sketch, with the same k
+	void merge(QuantileSketch const& other)
+	{
+		if (other.k != k)
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("merging sketches of different sizes"));
+		if (!other.n)
+			return;
+		if (other.levels.size() > levels.size()) {
+			levels.resize(other.levels.size());
+			update_capacity();
+		}
+		for (size_t h = 0; h < other.levels.size(); ++h)
+			levels[h].insert(levels[h].end(), other.levels[h].begin(), other.levels[h].end());
+		n += other.n;
+		retained += other.retained;
+		lo = std::min(lo, other.lo);
+		hi = std::max(hi, other.hi);
+		compress();
+	}
+
+	// Number of samples added
+	uint64_t count() const
+	{ return n; }
+
+	float min() const
+	{ return n ? lo : std::numeric_limits<float>::quiet_NaN(); }
+
+	float max() const
+	{ return n ? hi : std::numeric_limits<float>::quiet_NaN(); }
+
+	// The (approximate) q-quantile, for q in [0, 1], or NaN if the
+	// sketch is empty
+	double quantile(double q) const
+	{
+		if (!n)
+			return std::numeric_limits<double>::quiet_NaN();
+		if (q <= 0)
+			return lo;
+		if (q >= 1)
+			return hi;
+		const double target = q*double(n);
+		uint64_t seen = 0;
+		for (auto const& item : weighted()) {
+			seen += item.second;
+			if (double(seen) >= target)
+				return item.first;
+		}
+		return hi;
+	}
+
+	// The (approximate) fraction of the samples not greater than x
+	double rank(double x) const
+	{
+		if (!n)
+			return std::numeric_limits<double>::quiet_NaN();
+		uint64_t below = 0;
+		for (size_t h = 0; h < levels.size(); ++h)
+			for (float v : levels[h])
+				if (v <= x)
+					below += uint64_t(1) << h;
+		return double(below)/double(n);
+	}
+
+	// A text representation, on a single line without commas: k, the
+	// count, min, max, the number of compactors, their sizes and the
+	// samples
+	std::string str() const
+	{
+		std::ostringstream ss;
+		ss.precision(9);
+		ss << k << ' ' << n;
+		if (!n)
+			return ss.str();
+		ss << ' ' << lo << ' ' << hi << ' ' << levels.size();
+		for (auto const& level : levels)
+			ss << ' ' << level.size();
+		for (auto const& level : levels)
+			for (float x : level)
+				ss << ' ' << x;
+		return ss.str();
+	}
+
+	// Read a sketch back from its str()
+	static QuantileSketch parse(std::string const& str)
+	{
+		const CallScope call;
+		std::istringstream ss(str);
+		size_t k = 0, depth = 0;
+		uint64_t n = 0;
+		ss >> k >> n;
+		QuantileSketch ret(k);
+		if (ss && n) {
+			ss >> ret.lo >> ret.hi >> depth;
+			std::vector<size_t> sizes(ss && depth < 64 ? depth : 0);
+			for (auto& size : sizes)
+				ss >> size;
+			ret.levels.assign(sizes.size(), std::vector<float>());
+			for (size_t h = 0; h < sizes.size() && ss; ++h) {
+				ret.levels[h].resize(size_t(std::min(uint64_t(sizes[h]), n)));
+				for (auto& x : ret.levels[h])
+					ss >> x;
+				ret.retained += ret.levels[h].size();
+			}
+			ret.n = n;
+			if (ret.levels.empty())
+				ss.setstate(std::ios::failbit);
+			else
+				ret.update_capacity();
+		}
+		if (!ss || ret.k != k)
+			raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("malformed quantile sketch"));
+		return ret;
+	}
+};
+
+// Quantile sketches of the channels of an input, for e.g. percentile
+// stretches, computed in one pass over the data (or fed while writing
+// it). They can be stored in the header of an output or in a sidecar file
+// (one sketch per line), so later readers need no data pass
+class ENVI::BandQuantiles
+{
+	size_t k;
+	size_t threads;
+	size_t block_lines;
+	bool masking;
+	std::vector<QuantileSketch> sketches;
+
+	// Parse sketches, if there is one per channel
+	bool parse(std::vector<std::string> const& strs, size_t channels)
+	{
+		if (strs.empty() || (channels && strs.size() != channels))
+			return false;
+		std::vector<QuantileSketch> parsed;
+		for (auto const& str : strs) {
+			parsed.push_back(QuantileSketch::parse(str));
+			if (failed())
+				return false;
+		}
+		sketches.swap(parsed);
+		return true;
+	}
+
+public:
+	BandQuantiles() : k(200), threads(0), block_lines(0), masking(true)
+	{}
+
+	// Size of the compactors of the sketches: the rank error of the
+	// quantiles is about 1.7/k (default 200)
+	void set_accuracy(size_t _k)
+	{ k = _k; }
+
+	// Number of threads sketching each block; 0 (the default) uses one
+	// per hardware thread
+	void set_threads(size_t count)
+	{ threads = count; }
+
+	// Number of lines loaded at a time; 0 (the default) picks about
+	// 16MB of samples over all channels
+	void set_block_lines(size_t count)
+	{ block_lines = count; }
+
+	// Whether to skip samples with the 'data ignore value' (the
+	// default), or only NaNs
+	void set_masking(bool enable)
+	{ masking = enable; }
+
+	// Sketch all the channels of input. Each thread sketches its own
+	// range of every block, and the sketches are merged at the end
+	template<typename StreamType>
+	void run(BasicInput<StreamType>& input)
+	{
+		const CallScope call;
+		const size_t lines = input.extent().first, samples = input.extent().second;
+		const size_t channels = input.num_channels();
+		const float ignore = float(masking ? input.ignore_value() : std::numeric_limits<double>::quiet_NaN());
+		const size_t block = block_lines ? block_lines :
+			std::max(size_t(1), (size_t(1) << 22)/std::max(channels*samples, size_t(1)));
+		const size_t parts = thread_count(threads);
+
+		std::vector<QuantileSketch> partial;
+		for (size_t t = 0; t < parts; ++t)
+			for (size_t b = 0; b < channels; ++b)
+				partial.push_back(QuantileSketch(k, t*channels + b));
+		std::vector<float> cube(channels*std::min(block, lines)*samples);
+
+		for (size_t first = 0; first < lines; first += block) {
+			const size_t count = std::min(block, lines - first);
+			const size_t n = count*samples;
+			input.get_block(first, count, cube.data());
+			if (failed())
+				return;
+			parallel_for(parts, parts, [&](size_t begin, size_t end) {
+				for (size_t t = begin; t < end; ++t) {
+					const size_t from = n*t/parts, to = n*(t + 1)/parts;
+					for (size_t b = 0; b < channels; ++b)
+						partial[t*channels + b].add(cube.data() + b*n + from, to - from, ignore);
+				}
+			});
+		}
+
+		sketches.assign(partial.begin(), partial.begin() + channels);
+		for (size_t t = 1; t < parts; ++t)
+			for (size_t b = 0; b < channels; ++b)
+				sketches[b].merge(partial[t*channels + b]);
+	}
+
+	template<typename StreamType>
+	Status try_run(BasicInput<StreamType>& input) noexcept
+	{ return capture(STATUS_FAILED, [&]() { run(input); }); }
+
+	// Add count samples of channel chnum, e.g. while writing them, with
+	// the masking of the data ignore value given
+	void add(size_t chnum, float const* data, size_t count,
+		float ignore = std::numeric_limits<float>::quiet_NaN())
+	{
+		while (sketches.size() <= chnum)
+			sketches.push_back(QuantileSketch(k, sketches.size()));
+		sketches[chnum].add(data, count, ignore);
+	}
+
+	size_t num_channels() const
+	{ return sketches.size(); }
+
+	QuantileSketch const& sketch(size_t chnum) const
+	{ return sketches.at(chnum); }
+
+	// The q-quantile of channel chnum
+	double quantile(size_t chnum, double q) const
+	{
+		const CallScope call;
+		if (chnum >= sketches.size()) {
+			raise(STATUS_NO_CHANNEL, std::invalid_argument("channel number too high"));
+			return std::numeric_limits<double>::quiet_NaN();
 		}
+		return sketches[chnum].quantile(q);
+	}
 
-		template<typename OutputType>
-		static inline void
-		load(DataTypeEnum req, Input *in, size_t chnum, OutputType *o_data)
-		{
-			if (req == input_type)
-				return prep_load(in, chnum, o_data);
-			// this shouldn't happen:
-			if (input_type == UINT64)
-				throw std::invalid_argument("invalid input type");
-			Loader<next_type(input_type)>::load(req, in, chnum, o_data);
+	// The range of a percentile stretch of channel chnum (by default,
+	// from the 2% to the 98% quantile)
+	std::pair<double, double> stretch(size_t chnum, double low = 0.02, double high = 0.98) const
+	{ return std::make_pair(quantile(chnum, low), quantile(chnum, high)); }
+
+	// Store the sketches in the header of output, as 'quantile sketches'
+	template<typename OutputDataType, typename OutStreamType>
+	void store(Output<OutputDataType, OutStreamType>& output) const
+	{
+		const CallScope call;
+		std::vector<std::string> strs;
+		for (auto const& s : sketches)
+			strs.push_back(s.str());
+		output.add_meta("quantile sketches", strs);
+	}
+
+	// Load the sketches from the header of input, returning false if it
+	// has none (or not one per channel)
+	template<typename StreamType>
+	bool load(BasicInput<StreamType> const& input)
+	{ return parse(input.get_meta_values("quantile sketches"), input.num_channels()); }
+
+	// Write the sketches to a sidecar file, one per line
+	void save(std::string const& fname) const
+	{
+		const CallScope call;
+		std::ofstream out(fname);
+		for (auto const& s : sketches)
+			out << s.str() << '\n';
+		if (!out)
+			raise(STATUS_WRITE_FAILED, std::runtime_error("cannot write " + fname));
+	}
+
+	// Read the sketches from a sidecar file, returning false if it
+	// cannot be read
+	bool load(std::string const& fname)
+	{
+		const CallScope call;
+		std::ifstream in(fname);
+		std::vector<std::string> strs;
+		std::string line;
+		while (std::getline(in, line))
+			if (!line.empty())
+				strs.push_back(line);
+		return parse(strs, 0);
+	}
+};
+
+// Quick RGB previews of an input. Three channels are loaded decimated, so
+// that only about max_size lines of each are read, then stretched to bytes
+// and interleaved. Without explicit ranges, each channel is stretched
+// between two percentiles, taken from the 'quantile sketches' of the
+// header if it has them, or else from the preview samples
+class ENVI::Quicklook
+{
+	enum Selection { DEFAULT, INDICES, WAVELENGTHS };
+
+	Selection selection;
+	size_t bands[3];
+	double wavelengths[3];
+	size_t max_size;
+	double low, high;
+	bool linear[3];
+	double range_lo[3], range_hi[3];
+	bool masking;
+
+	// The channels to show, as red, green and blue
+	template<typename StreamType>
+	bool pick_channels(BasicInput<StreamType> const& input, size_t* chans) const
+	{
+		const size_t channels = input.num_channels();
+		if (!channels) {
+			raise(STATUS_NO_CHANNEL, std::invalid_argument("input has no channels"));
+			return false;
 		}
-	};
+		if (selection == WAVELENGTHS || (selection == DEFAULT &&
+			channels >= 3 && input.wavelengths().size() == channels)) {
+			// natural colours unless told otherwise
+			static const double natural[3] = { 640, 550, 470 };
+			for (size_t i = 0; i < 3; ++i) {
+				chans[i] = input.channel_at(selection == DEFAULT ? natural[i] : wavelengths[i], true);
+				if (chans[i] == SIZE_MAX)
+					return false;
+			}
+			return true;
+		}
+		for (size_t i = 0; i < 3; ++i) {
+			chans[i] = selection == INDICES ? bands[i] : std::min(i, channels - 1);
+			if (chans[i] >= channels) {
+				raise(STATUS_NO_CHANNEL, std::invalid_argument("channel number too high"));
+				return false;
+			}
+		}
+		return true;
+	}
 
-	template<DataTypeEnum input_type>
-	friend struct Loader;
+	// The low and high percentiles of the finite samples of a preview
+	static std::pair<double, double> percentiles(std::vector<float> const& data, double low, double high)
+	{
+		std::vector<float> values;
+		values.reserve(data.size());
+		for (float x : data)
+			if (std::isfinite(x))
+				values.push_back(x);
+		if (values.empty())
+			return std::make_pair(0.0, 0.0);
+		const size_t last = values.size() - 1;
+		const size_t a = size_t(std::min(std::max(low, 0.0), 1.0)*double(last) + 0.5);
+		const size_t b = size_t(std::min(std::max(high, 0.0), 1.0)*double(last) + 0.5);
+		std::nth_element(values.begin(), values.begin() + a, values.end());
+		const double lo = values[a];
+		std::nth_element(values.begin(), values.begin() + b, values.end());
+		return std::make_pair(lo, double(values[b]));
+	}
+
+	// CRC-32 of the PNG chunks
+	static uint32_t crc32(uint32_t crc, uint8_t const* data, size_t count)
+	{
+		static const std::vector<uint32_t> table = []() {
+			std::vector<uint32_t> t(256);
+			for (uint32_t n = 0; n < 256; ++n) {
+				uint32_t c = n;
+				for (int k = 0; k < 8; ++k)
+					c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+				t[n] = c;
+			}
+			return t;
+		}();
+		crc = ~crc;
+		for (size_t i = 0; i < count; ++i)
+			crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	static void put_be32(std::vector<uint8_t>& out, uint32_t v)
+	{
+		for (int shift = 24; shift >= 0; shift -= 8)
+			out.push_back(uint8_t(v >> shift));
+	}
+
+	static void write_chunk(std::ostream& out, char const* type, std::vector<uint8_t> const& data)
+	{
+		std::vector<uint8_t> head;
+		put_be32(head, uint32_t(data.size()));
+		head.insert(head.end(), type, type + 4);
+		uint32_t crc = crc32(0, head.data() + 4, 4);
+		crc = crc32(crc, data.data(), data.size());
+		std::vector<uint8_t> tail;
+		put_be32(tail, crc);
+		out.write(reinterpret_cast<char const*>(head.data()), head.size());
+		out.write(reinterpret_cast<char const*>(data.data()), data.size());
+		out.write(reinterpret_cast<char const*>(tail.data()), tail.size());
+	}
 
 public:
-	BasicInput(StreamType&& _data, StreamType&& _hdr) :
-		description(),
-		lines(0),
-		samples(0),
-		pixels(0),
-		data_offset(0),
-		channels(),
-		data(_data),
-		hdr(_hdr),
-		need_closing(false)
+	Quicklook() : selection(DEFAULT), max_size(512), low(0.02), high(0.98), masking(true)
 	{
-		prepare_reading();
+		for (size_t i = 0; i < 3; ++i) {
+			bands[i] = i;
+			wavelengths[i] = 0;
+			linear[i] = false;
+			range_lo[i] = range_hi[i] = 0;
+		}
 	}
 
-	BasicInput(std::string const& fname) :
-		description(),
-		lines(0),
-		samples(0),
-		pixels(0),
-		data_offset(0),
-		channels(),
-		data(StreamType(fname)),
-		hdr(StreamType(hdr_name(fname)))
+	// Show the given channels as red, green and blue. By default these
+	// are the channels nearest to 640, 550 and 470nm if the header has
+	// wavelengths, or else the first three (or the first, as grey)
+	void set_bands(size_t red, size_t green, size_t blue)
 	{
-		if (!hdr.good()) {
-			hdr = StreamType(fname + ".hdr");
+		selection = INDICES;
+		bands[0] = red;
+		bands[1] = green;
+		bands[2] = blue;
+	}
+
+	// Show the good channels nearest to the given wavelengths (in nm)
+	void set_wavelengths(double red, double green, double blue)
+	{
+		selection = WAVELENGTHS;
+		wavelengths[0] = red;
+		wavelengths[1] = green;
+		wavelengths[2] = blue;
+	}
+
+	// Largest side of the preview, in pixels (default 512): the input
+	// is decimated by the smallest step that fits it
+	void set_max_size(size_t size)
+	{ max_size = std::max(size, size_t(1)); }
+
+	// Stretch between the given quantiles (default 0.02 and 0.98)
+	void set_percentiles(double _low, double _high)
+	{
+		low = _low;
+		high = _high;
+	}
+
+	// Stretch colour (0 red, 1 green, 2 blue) linearly from lo to hi
+	// instead of between percentiles
+	void set_range(size_t colour, double lo, double hi)
+	{
+		if (colour >= 3)
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("colour must be 0, 1 or 2"));
+		linear[colour] = true;
+		range_lo[colour] = lo;
+		range_hi[colour] = hi;
+	}
+
+	// Whether pixels with the 'data ignore value' are black (the
+	// default), or only NaNs
+	void set_masking(bool enable)
+	{ masking = enable; }
+
+	// Render the preview of input into rgb, three bytes per pixel line by
+	// line, returning its size (lines, samples)
+	template<typename StreamType>
+	std::pair<size_t, size_t> render(BasicInput<StreamType>& input, std::vector<uint8_t>& rgb)
+	{
+		const CallScope call;
+		const std::pair<size_t, size_t> none(0, 0);
+		size_t chans[3];
+		if (!pick_channels(input, chans))
+			return none;
+
+		const size_t side = std::max(input.extent().first, input.extent().second);
+		const size_t step = std::max(size_t(1), (side + max_size - 1)/max_size);
+		const std::pair<size_t, size_t> size = input.decimated_extent(step);
+		const size_t n = size.first*size.second;
+		const float ignore = float(masking ? input.ignore_value() : std::numeric_limits<double>::quiet_NaN());
+
+		// malformed sketches fall back to the preview samples too
+		BandQuantiles sketches;
+		bool sketched = false;
+		if (!linear[0] || !linear[1] || !linear[2]) {
+			const Status loaded = capture(STATUS_INVALID_HEADER, [&]() { sketched = sketches.load(input); });
+			sketched = sketched && loaded.ok();
 		}
-		need_closing = true;
 
-		prepare_reading();
+		std::vector<float> data(n);
+		std::vector<uint8_t> plane(n);
+		rgb.resize(3*n);
+		for (size_t c = 0; c < 3; ++c) {
+			// channels shown twice are only loaded once
+			if (c == 0 || chans[c] != chans[c - 1]) {
+				input.get_decimated(chans[c], step, data.data());
+				if (failed())
+					return none;
+				if (ignore == ignore)
+					for (auto& x : data)
+						if (x == ignore)
+							x = std::numeric_limits<float>::quiet_NaN();
+			}
+
+			std::pair<double, double> range(range_lo[c], range_hi[c]);
+			if (!linear[c])
+				range = sketched ? sketches.stretch(chans[c], low, high) : percentiles(data, low, high);
+			const double width = range.second - range.first;
+			Kernels::stretch(data.data(), float(range.first), float(width > 0 ? 255/width : 0),
+				plane.data(), n);
+			for (size_t i = 0; i < n; ++i)
+				rgb[3*i + c] = plane[i];
+		}
+		return size;
 	}
 
-	std::pair<size_t, size_t> extent() const
-	{ return std::make_pair(lines, samples); }
+	// Write an RGB image as a binary PPM
+	static void write_ppm(std::string const& fname, std::vector<uint8_t> const& rgb,
+		size_t lines, size_t samples)
+	{
+		const CallScope call;
+		if (rgb.size() != 3*lines*samples)
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("wrong RGB buffer size"));
+		std::ofstream out(fname, std::ios::binary);
+		if (!out)
+			return raise(STATUS_OPEN_FAILED, std::runtime_error("cannot open " + fname));
+		out << "P6\n" << samples << ' ' << lines << "\n255\n";
+		out.write(reinterpret_cast<char const*>(rgb.data()), rgb.size());
+		if (!out)
+			raise(STATUS_WRITE_FAILED, std::runtime_error("error writing " + fname));
+	}
 
-	size_t num_channels() const
-	{ return channels.size(); }
+	// Write an RGB image as a PNG. The image data is stored without
+	// compression (in stored deflate blocks), which needs no zlib
+	static void write_png(std::string const& fname, std::vector<uint8_t> const& rgb,
+		size_t lines, size_t samples)
+	{
+		const CallScope call;
+		if (rgb.size() != 3*lines*samples)
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("wrong RGB buffer size"));
+		std::ofstream out(fname, std::ios::binary);
+		if (!out)
+			return raise(STATUS_OPEN_FAILED, std::runtime_error("cannot open " + fname));
+		static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+		out.write(reinterpret_cast<char const*>(signature), 8);
+
+		std::vector<uint8_t> header;
+		put_be32(header, uint32_t(samples));
+		put_be32(header, uint32_t(lines));
+		// 8 bits per colour, RGB, deflate, no filtering or interlacing
+		const uint8_t rest[5] = { 8, 2, 0, 0, 0 };
+		header.insert(header.end(), rest, rest + 5);
+		write_chunk(out, "IHDR", header);
+
+		// each line is preceded by its (null) filter type
+		std::vector<uint8_t> raw;
+		raw.reserve(lines*(3*samples + 1));
+		for (size_t l = 0; l < lines; ++l) {
+			raw.push_back(0);
+			raw.insert(raw.end(), rgb.begin() + 3*l*samples, rgb.begin() + 3*(l + 1)*samples);
+		}
+		std::vector<uint8_t> zlib = { 0x78, 0x01 };
+		size_t pos = 0;
+		do {
+			const size_t len = std::min(raw.size() - pos, size_t(65535));
+			zlib.push_back(pos + len == raw.size() ? 1 : 0);
+			const uint8_t lens[4] = { uint8_t(len), uint8_t(len >> 8),
+				uint8_t(~len), uint8_t(~len >> 8) };
+			zlib.insert(zlib.end(), lens, lens + 4);
+			zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + len);
+			pos += len;
+		} while (pos < raw.size());
+		uint32_t a = 1, b = 0;
+		for (uint8_t x : raw) {
+			a = (a + x) % 65521;
+			b = (b + a) % 65521;
+		}
+		put_be32(zlib, (b << 16) | a);
+		write_chunk(out, "IDAT", zlib);
+		write_chunk(out, "IEND", std::vector<uint8_t>());
+		if (!out)
+			raise(STATUS_WRITE_FAILED, std::runtime_error("error writing " + fname));
+	}
 
-	std::vector<std::string> const& channel_names() const
-	{ return channels; }
+	// Render the preview of input into a PPM or PNG file
+	template<typename StreamType>
+	void write_ppm(BasicInput<StreamType>& input, std::string const& fname)
+	{
+		const CallScope call;
+		std::vector<uint8_t> rgb;
+		const std::pair<size_t, size_t> size = render(input, rgb);
+		if (!failed())
+			write_ppm(fname, rgb, size.first, size.second);
+	}
 
-	std::string const& get_meta(std::string const& key) const
-	{ return meta.get(key); }
+	template<typename StreamType>
+	void write_png(BasicInput<StreamType>& input, std::string const& fname)
+	{
+		const CallScope call;
+		std::vector<uint8_t> rgb;
+		const std::pair<size_t, size_t> size = render(input, rgb);
+		if (!failed())
+			write_png(fname, rgb, size.first, size.second);
+	}
+
+	template<typename StreamType>
+	Status try_write_ppm(BasicInput<StreamType>& input, std::string const& fname) noexcept
+	{ return capture(STATUS_FAILED, [&]() { write_ppm(input, fname); }); }
+
+	template<typename StreamType>
+	Status try_write_png(BasicInput<StreamType>& input, std::string const& fname) noexcept
+	{ return capture(STATUS_FAILED, [&]() { write_png(input, fname); }); }
+};
+
+// A spatial index of georeferenced files: the map bounds of each file
+// (from the 'map info' of its header) in an R-tree, bulk loaded by
+// sort-tile-recursive packing, so that the files covering a box or a
+// point are found without opening any header. Bounds are compared as
+// they are, so the files should share a projection
+class ENVI::Catalog
+{
+	enum { fanout = 16 };
+
+	struct Entry
+	{
+		std::string file;
+		double box[4]; // min x, min y, max x, max y
+	};
+
+	// A node of the tree: the bounds of its children, which are items
+	// [first, first + count) of the level below (entries for the leaves)
+	struct Node
+	{
+		double box[4];
+		size_t first, count;
+	};
 
+	std::vector<Entry> entries;
+	// levels[0] holds the leaves, the last level the root
+	std::vector<std::vector<Node>> levels;
+	size_t threads;
+
+	static bool overlaps(double const* a, double const* b)
+	{ return a[0] <= b[2] && b[0] <= a[2] && a[1] <= b[3] && b[1] <= a[3]; }
+
+	// Sort-tile-recursive order of boxes: slices along x, sorted by y
 	template<typename T>
-	T get_meta(std::string const& key, T const& missing) const
-	{ return meta.get(key, missing); }
+	static void tile(std::vector<T>& items, double const* (*box)(T const&))
+	{
+		auto centre = [&](T const& item, size_t axis) {
+			double const* b = box(item);
+			return b[axis] + b[axis + 2];
+		};
+		std::sort(items.begin(), items.end(), [&](T const& a, T const& b) {
+			return centre(a, 0) < centre(b, 0);
+		});
+		const size_t nodes = (items.size() + fanout - 1)/fanout;
+		const size_t slices = size_t(std::ceil(std::sqrt(double(nodes))));
+		const size_t per_slice = slices*fanout;
+		for (size_t first = 0; first < items.size(); first += per_slice)
+			std::sort(items.begin() + first, items.begin() + std::min(items.size(), first + per_slice),
+				[&](T const& a, T const& b) { return centre(a, 1) < centre(b, 1); });
+	}
 
-	template<typename ...T>
-	std::vector<std::string> get_meta_values(std::string const& key) const
-	{ return meta.get_values(key); }
+	static double const* entry_box(Entry const& e)
+	{ return e.box; }
 
-	template<typename ...T>
-	std::tuple<T...> get_meta_tuple(std::string const& key) const
-	{ return meta.get_tuple<T...>(key); }
+	static double const* node_box(Node const& n)
+	{ return n.box; }
 
-	bool has_meta(std::string const& key) const
-	{ return meta.has_key(key); }
+	// Group consecutive items in nodes of fanout children
+	template<typename T>
+	static std::vector<Node> pack(std::vector<T> const& items, double const* (*box)(T const&))
+	{
+		std::vector<Node> ret;
+		for (size_t first = 0; first < items.size(); first += fanout) {
+			Node node;
+			node.first = first;
+			node.count = std::min(size_t(fanout), items.size() - first);
+			std::copy(box(items[first]), box(items[first]) + 4, node.box);
+			for (size_t i = first + 1; i < first + node.count; ++i) {
+				double const* b = box(items[i]);
+				node.box[0] = std::min(node.box[0], b[0]);
+				node.box[1] = std::min(node.box[1], b[1]);
+				node.box[2] = std::max(node.box[2], b[2]);
+				node.box[3] = std::max(node.box[3], b[3]);
+			}
+			ret.push_back(node);
+		}
+		return ret;
+	}
 
-	template<typename ...T>
-	void get_meta_tuple(std::string const& key, T&... args) const
-	{ std::tie(args...) = meta.get_tuple<T...>(key); }
+	// Bulk load the tree from the entries
+	void build()
+	{
+		levels.clear();
+		if (entries.empty())
+			return;
+		tile(entries, entry_box);
+		levels.push_back(pack(entries, entry_box));
+		while (levels.back().size() > 1) {
+			tile(levels.back(), node_box);
+			levels.push_back(pack(levels.back(), node_box));
+		}
+	}
 
-	// Load channel number chnum
-	template<typename OutputType>
-	void get_channel(size_t chnum, size_t &o_lines, size_t &o_samples,
-		std::vector<OutputType>& o_data)
+	// The map bounds of input, if it has a valid 'map info'
+	template<typename StreamType>
+	static bool bounds(BasicInput<StreamType> const& input, double* box)
 	{
-		if (chnum >= channels.size())
-			throw std::invalid_argument("channel number too high");
+		if (!input.has_geotransform())
+			return false;
+		const double u[4] = { 0, double(input.extent().second), 0, double(input.extent().second) };
+		const double v[4] = { 0, 0, double(input.extent().first), double(input.extent().first) };
+		double x[4], y[4];
+		input.geotransform().pixel_to_map(u, v, x, y, 4);
+		box[0] = *std::min_element(x, x + 4);
+		box[1] = *std::min_element(y, y + 4);
+		box[2] = *std::max_element(x, x + 4);
+		box[3] = *std::max_element(y, y + 4);
+		return std::isfinite(box[0] + box[1] + box[2] + box[3]);
+	}
 
-		o_lines = lines;
-		o_samples = samples;
-		o_data.resize(pixels);
+	void add_entry(std::string const& file, double const* box)
+	{
+		Entry e;
+		e.file = file;
+		std::copy(box, box + 4, e.box);
+		entries.push_back(e);
+	}
 
-		Loader<>::load(input_data_type, this, chnum, o_data);
+public:
+	Catalog() : threads(0)
+	{}
+
+	// Number of threads reading headers; 0 (the default) uses one per
+	// hardware thread
+	void set_threads(size_t count)
+	{ threads = count; }
+
+	// Add the given files, reading their headers in parallel, and
+	// rebuild the tree. Files that cannot be opened or have no valid
+	// 'map info' are left out; returns the number of files added
+	size_t add(std::vector<std::string> const& files)
+	{
+		const CallScope call;
+		std::vector<double> boxes(4*files.size());
+		std::vector<char> found(files.size(), 0);
+		parallel_for(files.size(), threads, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				auto input = try_ropen(files[i]);
+				found[i] = input.ok() && bounds(*input.value, boxes.data() + 4*i);
+			}
+		});
+		size_t added = 0;
+		for (size_t i = 0; i < files.size(); ++i) {
+			if (found[i]) {
+				add_entry(files[i], boxes.data() + 4*i);
+				++added;
+			}
+		}
+		build();
+		return added;
 	}
 
-	template<typename OutputType>
-	void get_channel(std::string const& channel, size_t &o_lines, size_t &o_samples,
-		std::vector<OutputType>& o_data)
+	// Add a single file; prefer adding many at once, since the tree is
+	// rebuilt each time
+	bool add(std::string const& file)
 	{
-		auto channel_idx(
-			std::find(channels.cbegin(), channels.cend(), channel)
-			);
+		const CallScope call;
+		return add(std::vector<std::string>(1, file)) == 1;
+	}
 
-		if (channel_idx == channels.cend())
-			throw std::runtime_error("channel " + channel + " not found");
+	// Add a file with known bounds, without reading its header
+	void add(std::string const& file, double min_x, double min_y, double max_x, double max_y)
+	{
+		const CallScope call;
+		const double box[4] = { min_x, min_y, max_x, max_y };
+		add_entry(file, box);
+		build();
+	}
 
-		const size_t chnum = channel_idx - channels.cbegin();
+	size_t size() const
+	{ return entries.size(); }
 
-		get_channel(chnum, o_lines, o_samples, o_data);
+	// The files whose bounds intersect the box between (min_x, min_y)
+	// and (max_x, max_y)
+	std::vector<std::string> query(double min_x, double min_y, double max_x, double max_y) const
+	{
+		std::vector<std::string> ret;
+		if (levels.empty())
+			return ret;
+		const double box[4] = { min_x, min_y, max_x, max_y };
+		// (level, node) pairs still to visit
+		std::vector<std::pair<size_t, size_t>> stack(1, std::make_pair(levels.size() - 1, size_t(0)));
+		while (!stack.empty()) {
+			const size_t level = stack.back().first;
+			Node const& node = levels[level][stack.back().second];
+			stack.pop_back();
+			if (!overlaps(node.box, box))
+				continue;
+			for (size_t i = node.first; i < node.first + node.count; ++i) {
+				if (level)
+					stack.push_back(std::make_pair(level - 1, i));
+				else if (overlaps(entries[i].box, box))
+					ret.push_back(entries[i].file);
+			}
+		}
+		return ret;
 	}
 
-	template<typename OutputType>
-	void get_channel(size_t chnum, OutputType *o_data)
+	// The files whose bounds contain the point (x, y)
+	std::vector<std::string> query(double x, double y) const
+	{ return query(x, y, x, y); }
+
+	// Save the catalogue as text: a line per file with its bounds and
+	// name
+	void save(std::string const& fname) const
 	{
-		if (chnum >= channels.size())
-			throw std::invalid_argument("channel number too high");
+		const CallScope call;
+		std::ofstream out(fname);
+		out.precision(17);
+		out << "ENVI catalog\n";
+		for (auto const& e : entries)
+			out << e.box[0] << ' ' << e.box[1] << ' ' << e.box[2] << ' ' << e.box[3]
+				<< ' ' << e.file << '\n';
+		if (!out)
+			raise(STATUS_WRITE_FAILED, std::runtime_error("cannot write " + fname));
+	}
 
-		Loader<>::load(input_data_type, this, chnum, o_data);
+	// Load a catalogue saved with save(), replacing the current one
+	void load(std::string const& fname)
+	{
+		const CallScope call;
+		std::ifstream in(fname);
+		std::string line;
+		ENVI::getline(in, line);
+		if (line != "ENVI catalog")
+			return raise(STATUS_INVALID_HEADER, std::runtime_error("not a catalog: " + fname));
+		std::vector<Entry> loaded;
+		while (in) {
+			if (!ENVI::getline(in, line))
+				continue;
+			std::istringstream ss(line);
+			Entry e;
+			ss >> e.box[0] >> e.box[1] >> e.box[2] >> e.box[3];
+			if (ss.get() != ' ' || !std::getline(ss, e.file) || e.file.empty())
+				return raise(STATUS_INVALID_HEADER, std::runtime_error("malformed catalog line: " + line));
+			loaded.push_back(e);
+		}
+		entries.swap(loaded);
+		build();
 	}
 
-	~BasicInput()
+	Status try_load(std::string const& fname) noexcept
+	{ return capture(STATUS_OPEN_FAILED, [&]() { load(fname); }); }
+};
+
+// Streaming comparison of two inputs of the same shape, e.g. a regression
+// check of a processing chain or change detection between acquisitions.
+// Both are read a block of lines of a channel at a time, and the samples
+// are compared within absolute and relative tolerances; the differences
+// can be written to an output as they go
+class ENVI::CubeComparison
+{
+public:
+	// Statistics of a channel: the samples compared, those out of
+	// tolerance, the largest absolute difference, and the first line
+	// with a mismatch (SIZE_MAX if none)
+	struct BandStats
 	{
-		if (need_closing)
-			close();
+		uint64_t compared;
+		uint64_t mismatches;
+		double max_error;
+		size_t first_line;
+	};
+
+private:
+	double atol, rtol;
+	bool relative;
+	bool fail_fast;
+	size_t threads;
+	size_t block_lines;
+	std::vector<BandStats> stats;
+	bool complete;
+
+	template<typename StreamTypeA, typename StreamTypeB>
+	bool check(BasicInput<StreamTypeA> const& a, BasicInput<StreamTypeB> const& b)
+	{
+		stats.clear();
+		complete = false;
+		if (a.extent() != b.extent()) {
+			raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("inputs have different extents"));
+			return false;
+		}
+		if (a.num_channels() != b.num_channels()) {
+			raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("inputs have different numbers of channels"));
+			return false;
+		}
+		return true;
+	}
+
+	// Compare the channels of a and b, writing the differences into
+	// output unless it is null
+	template<typename StreamTypeA, typename StreamTypeB, typename OutputType>
+	void compare(BasicInput<StreamTypeA>& a, BasicInput<StreamTypeB>& b, OutputType* output)
+	{
+		const size_t lines = a.extent().first, samples = a.extent().second;
+		const size_t block = std::min(lines, block_lines ? block_lines :
+			std::max(size_t(1), (size_t(1) << 22)/std::max(samples, size_t(1))));
+		const size_t parts = thread_count(threads);
+		std::vector<float> va(block*samples), vb(block*samples);
+		std::vector<float> diff(output ? block*samples : 0);
+		std::vector<BandStats> partial(parts);
+
+		for (size_t ch = 0; ch < a.num_channels(); ++ch) {
+			const size_t out = output ? output->reserve_channel(a.channel_names()[ch]) : 0;
+			BandStats total = { 0, 0, 0, SIZE_MAX };
+			for (size_t first = 0; first < lines; first += block) {
+				const size_t count = std::min(block, lines - first);
+				a.get_lines(ch, first, count, va.data());
+				b.get_lines(ch, first, count, vb.data());
+				if (failed())
+					return;
+
+				// a range of lines per thread, so that each knows its
+				// first mismatch
+				parallel_for(parts, parts, [&](size_t begin, size_t end) {
+					for (size_t t = begin; t < end; ++t) {
+						BandStats& s = partial[t];
+						float max_error = 0;
+						s.mismatches = 0;
+						s.first_line = SIZE_MAX;
+						for (size_t l = count*t/parts; l < count*(t + 1)/parts; ++l) {
+							const size_t at = l*samples;
+							const size_t n = Kernels::compare(va.data() + at, vb.data() + at,
+								float(atol), float(rtol), output ? diff.data() + at : nullptr,
+								relative, samples, max_error);
+							if (n && s.first_line == SIZE_MAX)
+								s.first_line = first + l;
+							s.mismatches += n;
+						}
+						s.max_error = max_error;
+					}
+				});
+				for (auto const& s : partial) {
+					total.mismatches += s.mismatches;
+					total.max_error = std::max(total.max_error, s.max_error);
+					total.first_line = std::min(total.first_line, s.first_line);
+				}
+				total.compared += count*samples;
+
+				if (output) {
+					output->write_lines(out, first, diff.data(), count);
+					if (failed())
+						return;
+				}
+				if (fail_fast && total.mismatches) {
+					stats.push_back(total);
+					return;
+				}
+			}
+			stats.push_back(total);
+		}
+		complete = true;
+	}
+
+public:
+	CubeComparison() : atol(0), rtol(0), relative(false), fail_fast(false),
+		threads(0), block_lines(0), complete(false)
+	{}
+
+	// Samples a and b match if |a - b| <= absolute + relative*|b|, if
+	// both are NaN, or if both are the same infinity (an infinity never
+	// matches anything else). By default, they must be equal
+	void set_tolerance(double absolute, double relative = 0)
+	{
+		atol = absolute;
+		rtol = relative;
+	}
+
+	// Whether the difference cube holds (a - b)/|b| rather than a - b
+	void set_relative(bool enable)
+	{ relative = enable; }
+
+	// Whether to stop at the first block with a mismatch, leaving the
+	// remaining channels (and lines) uncompared
+	void set_fail_fast(bool enable)
+	{ fail_fast = enable; }
+
+	// Number of threads comparing each block; 0 (the default) uses one
+	// per hardware thread
+	void set_threads(size_t count)
+	{ threads = count; }
+
+	// Number of lines loaded at a time; 0 (the default) picks about
+	// 16MB of samples per input
+	void set_block_lines(size_t count)
+	{ block_lines = count; }
+
+	// Compare all the channels of a and b, which must have the same
+	// extent and number of channels
+	template<typename StreamTypeA, typename StreamTypeB>
+	void run(BasicInput<StreamTypeA>& a, BasicInput<StreamTypeB>& b)
+	{
+		const CallScope call;
+		if (check(a, b))
+			compare(a, b, static_cast<Output<float>*>(nullptr));
+	}
+
+	// Compare a and b, and write the differences into output, a channel
+	// for each of a, with its name
+	template<typename StreamTypeA, typename StreamTypeB, typename OutputDataType, typename OutStreamType>
+	void run(BasicInput<StreamTypeA>& a, BasicInput<StreamTypeB>& b,
+		Output<OutputDataType, OutStreamType>& output)
+	{
+		const CallScope call;
+		if (!check(a, b))
+			return;
+		if (output.extent() != a.extent())
+			return raise(STATUS_INVALID_ARGUMENT, std::invalid_argument("extent of output differs from the inputs"));
+		compare(a, b, &output);
+	}
+
+	template<typename StreamTypeA, typename StreamTypeB>
+	Status try_run(BasicInput<StreamTypeA>& a, BasicInput<StreamTypeB>& b) noexcept
+	{ return capture(STATUS_FAILED, [&]() { run(a, b); }); }
+
+	template<typename StreamTypeA, typename StreamTypeB, typename OutputDataType, typename OutStreamType>
+	Status try_run(BasicInput<StreamTypeA>& a, BasicInput<StreamTypeB>& b,
+		Output<OutputDataType, OutStreamType>& output) noexcept
+	{ return capture(STATUS_FAILED, [&]() { run(a, b, output); }); }
+
+	// Number of channels compared, all of them unless the comparison
+	// failed fast
+	size_t num_channels() const
+	{ return stats.size(); }
+
+	BandStats const& band(size_t chnum) const
+	{ return stats.at(chnum); }
+
+	// Whether all the channels were compared to the end
+	bool completed() const
+	{ return complete; }
+
+	// Total number of mismatches over the channels compared
+	uint64_t mismatches() const
+	{
+		uint64_t total = 0;
+		for (auto const& s : stats)
+			total += s.mismatches;
+		return total;
+	}
+
+	// Largest absolute difference over the channels compared
+	double max_error() const
+	{
+		double error = 0;
+		for (auto const& s : stats)
+			error = std::max(error, s.max_error);
+		return error;
 	}
+
+	// Whether the inputs were compared to the end without a mismatch
+	bool matches() const
+	{ return complete && !mismatches(); }
 };
 
 template<>
 inline void ENVI::string_extract<decltype(std::ignore)>(std::string const& /* str */, decltype(std::ignore)&)
 {}
 
-std::shared_ptr<ENVI::Input> ENVI::ropen(std::string const& input_fname)
+#if CXXENVI_DEFINITIONS
+CXXENVI_INLINE std::shared_ptr<ENVI::Input>
+ENVI::ropen(std::string const& input_fname)
 {
 	return std::shared_ptr<Input>(new Input(input_fname));
 }
 
+CXXENVI_INLINE ENVI::Result<std::shared_ptr<ENVI::Input>>
+ENVI::try_ropen(std::string const& input_fname) noexcept
+{
+	Result<std::shared_ptr<Input>> ret;
+	ret.status = capture(STATUS_OPEN_FAILED, [&]() { ret.value = ropen(input_fname); });
+	if (!ret.ok())
+		ret.value.reset();
+	return ret;
+}
+#endif
+
 template<typename OutputDataType, typename ChannelSpec>
 void ENVI::undump(std::string const& input_fname, ChannelSpec const& channel,
 	size_t &lines, size_t &samples, std::vector<OutputDataType>& data)
 {
+	const CallScope call;
 	Input loader(input_fname);
+	if (failed())
+		return;
 
 	loader.get_channel(channel, lines, samples, data);
 }
@@ -1184,12 +9328,94 @@ template<typename OutputDataType>
 void ENVI::undump(std::string const& input_fname,
 	size_t &lines, size_t &samples, std::vector<OutputDataType>& data)
 {
+	const CallScope call;
 	Input loader(input_fname);
+	if (failed())
+		return;
 
 	if (loader.num_channels() > 1)
-		throw std::runtime_error("file has multiple channel, cannot do a simple undump");
+		return raise(STATUS_INVALID_ARGUMENT,
+			std::runtime_error("file has multiple channel, cannot do a simple undump"));
 
 	loader.get_channel(0, lines, samples, data);
 }
 
+/*
+ * Template instances: with CXXENVI_LIBRARY, these are declared here and
+ * compiled once in cxxenvi.cc rather than in every translation unit
+ */
+
+#if CXXENVI_LIBRARY
+
+// X-macros over the data types, with and without an extra argument
+// (they must be distinct macros to be nested)
+#define CXXENVI_REAL_TYPES(X) \
+	X(int8_t) X(int16_t) X(int32_t) X(float) X(double) \
+	X(uint16_t) X(uint32_t) X(int64_t) X(uint64_t)
+#define CXXENVI_REAL_TYPES_ARG(X, A) \
+	X(A, int8_t) X(A, int16_t) X(A, int32_t) X(A, float) X(A, double) \
+	X(A, uint16_t) X(A, uint32_t) X(A, int64_t) X(A, uint64_t)
+
+#if CXXENVI_COMPLEX
+#define CXXENVI_COMPLEX_TYPES(X) X(std::complex<float>) X(std::complex<double>)
+#define CXXENVI_COMPLEX_TYPES_ARG(X, A) X(A, std::complex<float>) X(A, std::complex<double>)
+#else
+#define CXXENVI_COMPLEX_TYPES(X)
+#define CXXENVI_COMPLEX_TYPES_ARG(X, A)
+#endif
+
+#define CXXENVI_TYPES(X) CXXENVI_REAL_TYPES(X) CXXENVI_COMPLEX_TYPES(X)
+#define CXXENVI_TYPES_ARG(X, A) CXXENVI_REAL_TYPES_ARG(X, A) CXXENVI_COMPLEX_TYPES_ARG(X, A)
+
+// Writing: Output<Out> and its channel writers from every input type
+#define CXXENVI_ADD_CHANNEL(Out, In) \
+	CXXENVI_EXTERN template size_t ENVI::Output<Out>::add_channel<In>( \
+		std::string const&, In const*); \
+	CXXENVI_EXTERN template size_t ENVI::Output<Out>::add_channel_rect<In>( \
+		std::string const&, In const*, size_t, size_t, size_t); \
+	CXXENVI_EXTERN template void ENVI::Output<Out>::write_lines<In>( \
+		size_t, size_t, In const*, size_t);
+
+#define CXXENVI_OUTPUT(Out) \
+	CXXENVI_EXTERN template class ENVI::Output<Out>; \
+	CXXENVI_TYPES_ARG(CXXENVI_ADD_CHANNEL, Out)
+
+CXXENVI_TYPES(CXXENVI_OUTPUT)
+
+// Reading: Input and the Loader chain for every output type
+CXXENVI_EXTERN template class ENVI::BasicInput<std::ifstream>;
+
+#define CXXENVI_GET_CHANNEL(Out) \
+	CXXENVI_EXTERN template void ENVI::Input::get_channel<Out>(size_t, Out*); \
+	CXXENVI_EXTERN template void ENVI::Input::get_channel<Out>(size_t, ImageView<Out> const&); \
+	CXXENVI_EXTERN template void ENVI::Input::get_lines<Out>(size_t, size_t, size_t, Out*);
+
+CXXENVI_TYPES(CXXENVI_GET_CHANNEL)
+
+#if CXXENVI_COMPLEX
+// Planar writers into complex files, and reduced or planar loads
+// into real types
+#define CXXENVI_ADD_PLANAR(Out, In) \
+	CXXENVI_EXTERN template size_t ENVI::Output<Out>::add_channel<In>( \
+		std::string const&, In const*, In const*);
+
+CXXENVI_REAL_TYPES_ARG(CXXENVI_ADD_PLANAR, std::complex<float>)
+CXXENVI_REAL_TYPES_ARG(CXXENVI_ADD_PLANAR, std::complex<double>)
+
+#define CXXENVI_GET_REAL_CHANNEL(Out) \
+	CXXENVI_EXTERN template void ENVI::Input::get_channel<Out>(size_t, Out*, ComplexReduction); \
+	CXXENVI_EXTERN template void ENVI::Input::get_channel<Out>(size_t, Out*, Out*);
+
+CXXENVI_REAL_TYPES(CXXENVI_GET_REAL_CHANNEL)
+
+#undef CXXENVI_ADD_PLANAR
+#undef CXXENVI_GET_REAL_CHANNEL
+#endif
+
+#undef CXXENVI_ADD_CHANNEL
+#undef CXXENVI_OUTPUT
+#undef CXXENVI_GET_CHANNEL
+
+#endif // CXXENVI_LIBRARY
+
 #endif
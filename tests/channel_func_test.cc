@@ -0,0 +1,69 @@
+/*
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/* Checks of add_channel_func() with functions returning bool, values only
+ * convertible to the output type, and numbers converted with a policy.
+ */
+
+#include "cxxenvi.hh"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, std::string const& what)
+{
+	if (!ok) {
+		std::cerr << "FAILED: " << what << std::endl;
+		++failures;
+	}
+}
+
+// A value that only converts to float
+struct Level
+{
+	float value;
+	operator float() const { return value; }
+};
+
+} // namespace
+
+int main()
+{
+	const size_t lines = 3, samples = 4;
+	try {
+		{
+			auto out = ENVI::create<int16_t>("channel_func_test.dat", "func", lines, samples);
+			out->add_channel_func("mask", [](size_t l, size_t c) { return l == c; });
+			out->add_channel_func("level", [](size_t l, size_t c) { return Level{ float(l*10 + c) }; });
+			out->set_conversion(ENVI::SATURATE_ROUND);
+			out->add_channel_func("rounded", [](size_t l, size_t c) { return l + c*0.4 + 40000.0*(l == 2); });
+		}
+		auto in = ENVI::ropen("channel_func_test.dat");
+		std::vector<int16_t> mask(lines*samples), level(lines*samples), rounded(lines*samples);
+		in->get_channel(0, mask.data());
+		in->get_channel(1, level.data());
+		in->get_channel(2, rounded.data());
+		for (size_t l = 0; l < lines; ++l)
+			for (size_t c = 0; c < samples; ++c) {
+				const size_t i = l*samples + c;
+				check(mask[i] == (l == c), "bool mask at " + std::to_string(i));
+				check(level[i] == int16_t(l*10 + c), "converted level at " + std::to_string(i));
+				const double v = l + c*0.4 + 40000.0*(l == 2);
+				check(rounded[i] == (v > 32767 ? 32767 : int16_t(std::lround(v))),
+					"rounded value at " + std::to_string(i));
+			}
+	} catch (std::exception const& e) {
+		std::cerr << "error: " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
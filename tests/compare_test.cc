@@ -0,0 +1,126 @@
+/*
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/* Checks of the comparison kernel and ENVI::CubeComparison on special
+ * values (infinities and NaNs in either operand), at every instruction
+ * set level the CPU supports.
+ */
+
+#include "cxxenvi.hh"
+
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, std::string const& what)
+{
+	if (!ok) {
+		std::cerr << "FAILED: " << what << std::endl;
+		++failures;
+	}
+}
+
+const float inf = std::numeric_limits<float>::infinity();
+const float nan = std::numeric_limits<float>::quiet_NaN();
+
+// Pairs of samples, and whether they must match with no tolerance
+struct Case
+{
+	float a, b;
+	bool match;
+};
+
+const Case cases[] = {
+	{ 1, 1, true },
+	{ 1, 3, false },
+	{ 1, inf, false },
+	{ inf, 1, false },
+	{ 5, -inf, false },
+	{ -inf, 5, false },
+	{ inf, -inf, false },
+	{ inf, inf, true },
+	{ -inf, -inf, true },
+	{ nan, nan, true },
+	{ nan, 1, false },
+	{ 1, nan, false },
+	{ nan, inf, false },
+	{ inf, nan, false },
+};
+const size_t num_cases = sizeof(cases)/sizeof(cases[0]);
+
+// Each case alone, repeated to fill the vector paths and the scalar
+// tail, with and without a relative tolerance (which must not make an
+// infinite difference match)
+void check_kernel(std::string const& level)
+{
+	for (size_t c = 0; c < num_cases; ++c) {
+		for (size_t count : { size_t(1), size_t(3), size_t(8), size_t(21) }) {
+			for (float rtol : { 0.0f, 0.5f }) {
+				std::vector<float> a(count, cases[c].a), b(count, cases[c].b);
+				float max_error = 0;
+				const size_t mismatches = ENVI::Kernels::compare(a.data(), b.data(),
+					0, rtol, nullptr, false, count, max_error);
+				check(mismatches == (cases[c].match ? 0 : count),
+					level + ": case " + std::to_string(c) + ", " + std::to_string(count) +
+					" samples, rtol " + std::to_string(rtol));
+			}
+		}
+	}
+}
+
+// All the cases in a cube, with the mismatches counted per channel
+void check_cubes()
+{
+	std::vector<float> a, b;
+	size_t expected = 0;
+	for (size_t c = 0; c < num_cases; ++c) {
+		a.push_back(cases[c].a);
+		b.push_back(cases[c].b);
+		expected += !cases[c].match;
+	}
+	{
+		auto out = ENVI::create<float>("compare_test_a.dat", "a", 1, num_cases);
+		out->add_channel("x", a);
+		out->add_channel("y", a);
+	}
+	{
+		auto out = ENVI::create<float>("compare_test_b.dat", "b", 1, num_cases);
+		out->add_channel("x", b);
+		out->add_channel("y", a);
+	}
+	auto in_a = ENVI::ropen("compare_test_a.dat"), in_b = ENVI::ropen("compare_test_b.dat");
+	ENVI::CubeComparison cmp;
+	cmp.run(*in_a, *in_b);
+	check(cmp.completed() && cmp.num_channels() == 2, "cube comparison completed");
+	check(cmp.band(0).mismatches == expected, "mismatches of the special values");
+	check(cmp.band(1).mismatches == 0, "no mismatches of identical channels");
+	check(!cmp.matches(), "cubes with different infinities do not match");
+}
+
+} // namespace
+
+int main()
+{
+	try {
+		const ENVI::SimdLevel supported = ENVI::supported_simd_level();
+		for (int level = ENVI::SIMD_SCALAR; level <= supported; ++level) {
+			ENVI::set_simd_level(ENVI::SimdLevel(level));
+			check_kernel("level " + std::to_string(level));
+		}
+		ENVI::set_simd_level(supported);
+		check_cubes();
+	} catch (std::exception const& e) {
+		std::cerr << "error: " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,80 @@
+/*
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/* Checks of the error reporting without exceptions: an error stops the
+ * call that raised it, is reported by ENVI::last_error(), and does not
+ * leak into later calls.
+ */
+
+#include "cxxenvi.hh"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, std::string const& what)
+{
+	if (!ok) {
+		std::cerr << "FAILED: " << what << std::endl;
+		++failures;
+	}
+}
+
+} // namespace
+
+int main()
+{
+	const size_t lines = 4, samples = 5;
+	std::vector<float> data(lines*samples);
+	for (size_t i = 0; i < data.size(); ++i)
+		data[i] = float(i);
+
+	{
+		auto out = ENVI::create<float>("errors_test.dat", "errors", lines, samples);
+		check(out->add_channel("x", std::vector<float>(3)) == SIZE_MAX, "short channel rejected");
+		check(ENVI::last_error().code == ENVI::STATUS_INVALID_ARGUMENT, "short channel reported");
+		check(out->add_channel("x", data) == 0, "channel added after an error");
+		check(ENVI::last_error().ok(), "no error after a good call");
+		out->add_meta("key", 1);
+		out->add_meta("key", 2);
+		check(ENVI::last_error().code == ENVI::STATUS_INVALID_ARGUMENT, "duplicate key reported");
+		check(out->add_channel("y", data) == 1, "second channel added after an error");
+	}
+
+	auto in = ENVI::ropen("errors_test.dat");
+	check(ENVI::last_error().ok() && in->num_channels() == 2, "file read back");
+	std::vector<float> buf(lines*samples, -1);
+	in->get_channel(5, buf.data());
+	check(ENVI::last_error().code == ENVI::STATUS_NO_CHANNEL, "missing channel reported");
+	in->get_channel(0, buf.data());
+	check(ENVI::last_error().ok() && buf == data, "channel read after an error");
+
+	// a try_*() call reports its own error only
+	in->get_channel(5, buf.data());
+	check(in->try_get_channel(1, buf.data()).ok(), "try_get_channel after an error");
+
+	// malformed quantile sketches fall back to the preview samples
+	{
+		auto out = ENVI::create<float>("errors_test_sketches.dat", "sketches", lines, samples);
+		out->add_meta("quantile sketches", std::vector<std::string>{ "8 20 x", "8 20 y" });
+		out->add_channel("x", data);
+		out->add_channel("y", data);
+	}
+	auto sketched = ENVI::ropen("errors_test_sketches.dat");
+	ENVI::Quicklook quicklook;
+	std::vector<uint8_t> expected, rgb;
+	quicklook.render(*in, expected);
+	const std::pair<size_t, size_t> size = quicklook.render(*sketched, rgb);
+	check(ENVI::last_error().ok() && size.first == lines && rgb == expected,
+		"preview with malformed sketches");
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,107 @@
+/*
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/* Checks of ENVI::SpectralMatch reused on several inputs: without a given
+ * background, the matched filter must fit each input on its own rather
+ * than keep the statistics of the first one.
+ */
+
+#include "cxxenvi.hh"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, std::string const& what)
+{
+	if (!ok) {
+		std::cerr << "FAILED: " << what << std::endl;
+		++failures;
+	}
+}
+
+const size_t lines = 16, samples = 20, channels = 4;
+
+// A cube of noise around the given level, with the given spread
+void make_cube(std::string const& name, double level, double spread, unsigned seed)
+{
+	std::mt19937 rng(seed);
+	std::normal_distribution<float> noise(0, float(spread));
+	auto out = ENVI::create<float>(name, name, lines, samples);
+	for (size_t c = 0; c < channels; ++c) {
+		std::vector<float> values(lines*samples);
+		for (auto& v : values)
+			v = float(level*(c + 1)) + noise(rng);
+		out->add_channel("c" + std::to_string(c), values);
+	}
+}
+
+std::vector<float> scores(ENVI::SpectralMatch& match, std::string const& input, std::string const& output)
+{
+	{
+		auto in = ENVI::ropen(input);
+		auto out = ENVI::create<float>(output, "scores", lines, samples);
+		match.run(*in, *out);
+	}
+	std::vector<float> ret(lines*samples);
+	ENVI::ropen(output)->get_channel(0, ret.data());
+	return ret;
+}
+
+} // namespace
+
+int main()
+{
+	try {
+		make_cube("match_test_a.dat", 10, 1, 1);
+		make_cube("match_test_b.dat", 50, 8, 2);
+		const std::vector<double> target = { 20, 40, 60, 80 };
+
+		ENVI::SpectralMatch reused(ENVI::MATCHED_FILTER);
+		reused.add_target("t", target);
+		scores(reused, "match_test_a.dat", "match_test_a_scores.dat");
+		const std::vector<float> second = scores(reused, "match_test_b.dat", "match_test_b_scores.dat");
+
+		ENVI::SpectralMatch fresh(ENVI::MATCHED_FILTER);
+		fresh.add_target("t", target);
+		const std::vector<float> expected = scores(fresh, "match_test_b.dat", "match_test_b_fresh.dat");
+
+		for (size_t i = 0; i < expected.size(); ++i)
+			check(std::fabs(second[i] - expected[i]) <= 1e-5*(1 + std::fabs(expected[i])),
+				"score of pixel " + std::to_string(i) + " against the second background: "
+				+ std::to_string(second[i]) + " vs " + std::to_string(expected[i]));
+
+		// a given background is kept for every input
+		ENVI::PCA stats;
+		stats.fit(*ENVI::ropen("match_test_a.dat"));
+		ENVI::SpectralMatch given(ENVI::MATCHED_FILTER);
+		given.add_target("t", target);
+		given.set_background(stats);
+		const std::vector<float> first = scores(given, "match_test_a.dat", "match_test_a_given.dat");
+		const std::vector<float> kept = scores(given, "match_test_b.dat", "match_test_b_given.dat");
+		ENVI::SpectralMatch fitted(ENVI::MATCHED_FILTER);
+		fitted.add_target("t", target);
+		const std::vector<float> own = scores(fitted, "match_test_a.dat", "match_test_a_fitted.dat");
+		bool same = true, differs = false;
+		for (size_t i = 0; i < own.size(); ++i) {
+			same = same && std::fabs(first[i] - own[i]) <= 1e-5*(1 + std::fabs(own[i]));
+			differs = differs || std::fabs(kept[i] - expected[i]) > 1e-3*(1 + std::fabs(expected[i]));
+		}
+		check(same, "given background equal to the fitted one");
+		check(differs, "given background kept for the second input");
+	} catch (std::exception const& e) {
+		std::cerr << "error: " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,66 @@
+/*
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/* Checks of ENVI::Quicklook on a header with malformed 'quantile
+ * sketches': the preview must be stretched from its samples, as without
+ * sketches, rather than fail.
+ */
+
+#include "cxxenvi.hh"
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, std::string const& what)
+{
+	if (!ok) {
+		std::cerr << "FAILED: " << what << std::endl;
+		++failures;
+	}
+}
+
+const size_t lines = 30, samples = 40;
+
+void write_cube(std::string const& name, std::vector<std::string> const& sketches)
+{
+	auto out = ENVI::create<float>(name, "quicklook", lines, samples);
+	if (!sketches.empty())
+		out->add_meta("quantile sketches", sketches);
+	for (size_t c = 0; c < 3; ++c) {
+		std::vector<float> values(lines*samples);
+		for (size_t i = 0; i < values.size(); ++i)
+			values[i] = float((i*(c + 3))%101);
+		out->add_channel("c" + std::to_string(c), values);
+	}
+}
+
+} // namespace
+
+int main()
+{
+	try {
+		write_cube("quicklook_test_plain.dat", std::vector<std::string>());
+		write_cube("quicklook_test_bad.dat", { "8 1200 1 2", "garbage", "16 x" });
+
+		ENVI::Quicklook quicklook;
+		std::vector<uint8_t> expected, rgb;
+		const auto plain = quicklook.render(*ENVI::ropen("quicklook_test_plain.dat"), expected);
+		const auto bad = quicklook.render(*ENVI::ropen("quicklook_test_bad.dat"), rgb);
+		check(plain == std::make_pair(lines, samples), "preview without sketches");
+		check(bad == plain && rgb == expected, "preview with malformed sketches");
+	} catch (std::exception const& e) {
+		std::cerr << "error: " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,84 @@
+/*
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/* Checks of ENVI::SpectralResampler weights: a Gaussian target band must
+ * weigh channels of differing widths like the same response tabulated,
+ * and a lone channel without FWHM must resample to itself.
+ */
+
+#include "cxxenvi.hh"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, std::string const& what)
+{
+	if (!ok) {
+		std::cerr << "FAILED: " << what << std::endl;
+		++failures;
+	}
+}
+
+// A Gaussian response tabulated finely enough to integrate exactly
+void gaussian_response(double center, double fwhm,
+	std::vector<double>& wavelengths, std::vector<double>& response)
+{
+	const double sigma = fwhm/2.3548200450309493;
+	for (double w = center - 8*sigma; w <= center + 8*sigma; w += 0.05) {
+		wavelengths.push_back(w);
+		response.push_back(std::exp(-(w - center)*(w - center)/(2*sigma*sigma)));
+	}
+}
+
+} // namespace
+
+int main()
+{
+	const size_t lines = 2, samples = 3;
+	try {
+		{
+			auto out = ENVI::create<float>("resample_test.dat", "widths", lines, samples);
+			out->add_meta("wavelength", std::vector<double>{ 500, 510, 520, 530 });
+			out->add_meta("fwhm", std::vector<double>{ 5, 20, 10, 40 });
+			for (size_t c = 0; c < 4; ++c)
+				out->add_channel("c" + std::to_string(c), std::vector<float>(lines*samples, 1));
+		}
+		{
+			auto out = ENVI::create<float>("resample_test_one.dat", "one", lines, samples);
+			out->add_meta("wavelength", std::vector<double>{ 515 });
+			out->add_channel("c", std::vector<float>(lines*samples, 1));
+		}
+
+		ENVI::SpectralResampler gaussian, tabulated;
+		gaussian.add_band("g", 515, 15);
+		std::vector<double> wavelengths, response;
+		gaussian_response(515, 15, wavelengths, response);
+		tabulated.add_band("t", wavelengths, response);
+
+		auto widths = ENVI::ropen("resample_test.dat");
+		const std::vector<double> g = gaussian.matrix(*widths), t = tabulated.matrix(*widths);
+		check(g.size() == 4 && t.size() == 4, "weights of the channels of differing widths");
+		for (size_t c = 0; c < g.size() && c < t.size(); ++c)
+			check(std::fabs(g[c] - t[c]) < 1e-4, "weight of channel " + std::to_string(c) + ": "
+				+ std::to_string(g[c]) + " vs tabulated " + std::to_string(t[c]));
+
+		auto one = ENVI::ropen("resample_test_one.dat");
+		const std::vector<double> g1 = gaussian.matrix(*one), t1 = tabulated.matrix(*one);
+		check(g1.size() == 1 && g1[0] == 1, "lone channel, Gaussian band");
+		check(t1.size() == 1 && t1[0] == 1, "lone channel, tabulated band");
+	} catch (std::exception const& e) {
+		std::cerr << "error: " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,77 @@
+/*
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/* Checks of BasicInput::verify() on a cube larger than its blocks, with
+ * one-line chunks (many per block) and whole-channel ones (split between
+ * threads), before and after corrupting a byte.
+ */
+
+#include "cxxenvi.hh"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, std::string const& what)
+{
+	if (!ok) {
+		std::cerr << "FAILED: " << what << std::endl;
+		++failures;
+	}
+}
+
+// Two channels of about 17MB each
+const size_t lines = 2100, samples = 2048;
+
+void write_cube(std::string const& name, size_t chunk_lines)
+{
+	std::vector<float> values(lines*samples);
+	for (size_t i = 0; i < values.size(); ++i)
+		values[i] = float(i%9973)*0.5f;
+	auto out = ENVI::create<float>(name, "verify", lines, samples);
+	out->set_checksums(chunk_lines);
+	out->add_channel("a", values);
+	out->add_channel("b", values);
+}
+
+void corrupt(std::string const& name, size_t channel, size_t line)
+{
+	std::fstream f(name, std::ios::in | std::ios::out | std::ios::binary);
+	f.seekp(std::streamoff(((channel*lines + line)*samples + 5)*sizeof(float)));
+	f.put(0x55);
+}
+
+void check_file(std::string const& name, size_t chunk_lines)
+{
+	const std::string what = std::to_string(chunk_lines) + "-line chunks";
+	write_cube(name, chunk_lines);
+	check(ENVI::ropen(name)->verify(3).empty(), "intact file with " + what);
+
+	corrupt(name, 1, 1234);
+	const auto bad = ENVI::ropen(name)->verify(3);
+	check(bad.size() == 1 && bad[0].first == 1 && bad[0].second == 1234/chunk_lines*chunk_lines,
+		"corrupt chunk with " + what);
+}
+
+} // namespace
+
+int main()
+{
+	try {
+		check_file("verify_test_lines.dat", 1);
+		check_file("verify_test_channels.dat", lines);
+	} catch (std::exception const& e) {
+		std::cerr << "error: " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
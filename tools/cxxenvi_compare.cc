@@ -0,0 +1,128 @@
+/*
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/* Compare two ENVI files sample by sample, e.g. to check a processing
+ * chain against reference outputs.
+ *
+ * The files must have the same extent and number of channels. Each
+ * channel is printed as a CSV row with the samples compared, the
+ * mismatches and the largest absolute difference. The exit status is 0
+ * if the files match within the tolerances, 1 if they do not, and 2 on
+ * errors.
+ */
+
+#include "cxxenvi.hh"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+namespace {
+
+/*
+ * Configuration
+ */
+
+struct Config
+{
+	double atol, rtol; // tolerances, see ENVI::CubeComparison
+	bool relative; // relative differences in the difference cube
+	bool fail_fast; // stop at the first block with a mismatch
+	size_t threads; // 0 for one per hardware thread
+	std::string diff; // difference cube to write, if any
+	std::string a, b;
+
+	Config() :
+		atol(0),
+		rtol(0),
+		relative(false),
+		fail_fast(false),
+		threads(0)
+	{}
+};
+
+void usage(const char *argv0)
+{
+	std::cerr << "usage: " << argv0 << " [options] A B\n"
+		"  --atol X          absolute tolerance (default 0)\n"
+		"  --rtol X          tolerance relative to the samples of B (default 0)\n"
+		"  --diff PATH       write the differences A - B as a float file\n"
+		"  --relative        write (A - B)/|B| instead\n"
+		"  --fail-fast       stop at the first block with a mismatch\n"
+		"  --threads N       number of threads (default: all)\n";
+}
+
+Config parse_args(int argc, char *argv[])
+{
+	Config cfg;
+	int files = 0;
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg(argv[i]);
+		const bool has_value = i + 1 < argc;
+		if (arg == "--atol" && has_value) {
+			cfg.atol = std::atof(argv[++i]);
+		} else if (arg == "--rtol" && has_value) {
+			cfg.rtol = std::atof(argv[++i]);
+		} else if (arg == "--diff" && has_value) {
+			cfg.diff = argv[++i];
+		} else if (arg == "--relative") {
+			cfg.relative = true;
+		} else if (arg == "--fail-fast") {
+			cfg.fail_fast = true;
+		} else if (arg == "--threads" && has_value) {
+			cfg.threads = std::strtoul(argv[++i], nullptr, 10);
+		} else if (arg.compare(0, 2, "--") && arg != "-h" && files < 2) {
+			(files++ ? cfg.b : cfg.a) = arg;
+		} else {
+			usage(argv[0]);
+			std::exit(arg == "-h" || arg == "--help" ? EXIT_SUCCESS : 2);
+		}
+	}
+	if (files != 2) {
+		usage(argv[0]);
+		std::exit(2);
+	}
+	return cfg;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+	try {
+		const Config cfg = parse_args(argc, argv);
+		auto a = ENVI::ropen(cfg.a), b = ENVI::ropen(cfg.b);
+
+		ENVI::CubeComparison cmp;
+		cmp.set_tolerance(cfg.atol, cfg.rtol);
+		cmp.set_relative(cfg.relative);
+		cmp.set_fail_fast(cfg.fail_fast);
+		cmp.set_threads(cfg.threads);
+		if (cfg.diff.empty()) {
+			cmp.run(*a, *b);
+		} else {
+			auto out = ENVI::create<float>(cfg.diff, "differences of " + cfg.a + " and " + cfg.b,
+				a->extent().first, a->extent().second);
+			cmp.run(*a, *b, *out);
+		}
+
+		std::cout << "channel,name,compared,mismatches,max_error,first_line\n";
+		for (size_t ch = 0; ch < cmp.num_channels(); ++ch) {
+			auto const& s = cmp.band(ch);
+			std::cout << ch << ',' << a->channel_names()[ch] << ',' << s.compared << ','
+				<< s.mismatches << ',' << s.max_error << ',';
+			if (s.first_line != SIZE_MAX)
+				std::cout << s.first_line;
+			std::cout << '\n';
+		}
+		if (!cmp.completed())
+			std::cerr << "stopped at the first mismatch" << std::endl;
+		return cmp.matches() ? EXIT_SUCCESS : EXIT_FAILURE;
+	} catch (std::exception const& e) {
+		std::cerr << "error: " << e.what() << std::endl;
+		return 2;
+	}
+}